@@ -1,6 +1,15 @@
 #include "../vgc-core/gif.h"
+#include "../vgc-core/gif-decoder.h"
 #include "../vgc-core/recorder.h"
 #include "../vgc-core/quantization.h"
+#include "../vgc-core/lzw.h"
+#include "../vgc-core/resample.h"
+#include "../vgc-core/yuv.h"
+#include "../vgc-core/video-export.h"
+#include "../vgc-core/frame-store.h"
+#include "../vgc-core/frame-codec.h"
+#include "../vgc-core/frame-delta.h"
+#include <random>
 using namespace std;
 using namespace vgc;
 
@@ -92,7 +101,8 @@ void test_run3()
         }
 
         lastFrameTime += frameTime * 10'000'000;
-        gifImg.AddFrame(D3D11::TextureToImage(texture), (USHORT)frameTime);
+        MappedTexture mapped(texture);
+        gifImg.AddFrame(mapped.View(), (USHORT)frameTime);
     }
 }
 
@@ -131,7 +141,8 @@ void test_run4()
         }
 
         lastFrameTime += frameTime * 10'000'000;
-        gifImg.AddFrame(D3D11::TextureToImage(texture), (USHORT)frameTime);
+        MappedTexture mapped(texture);
+        gifImg.AddFrame(mapped.View(), (USHORT)frameTime);
     }
 
     SafeRelease(texture);
@@ -151,8 +162,1079 @@ void test_run5()
     Sleep(1000);
 }
 
-int main()
+template<class Dictionary>
+double MeasureLzwThroughput(const std::vector<BYTE>& pixels, UINT bitDepth)
 {
+    using namespace std::chrono;
+
+    size_t outputBits = 0;
+    auto func = [&](UINT, UINT bits) { outputBits += bits; };
+
+    auto start = steady_clock::now();
+    {
+        LZW<decltype(func), Dictionary> lzw(func, bitDepth);
+        for (auto pixel : pixels)
+        {
+            lzw += pixel;
+        }
+    }
+    double seconds = duration<double>(steady_clock::now() - start).count();
+
+    // Megapixels per second
+    return pixels.size() / seconds / 1e6;
+}
+
+void test_run6()
+{
+    // Throughput comparison of the LZW dictionary engines on 2560x1440 frames
+    const int w = 2560, h = 1440;
+
+    std::mt19937 generator(1);
+    std::vector<BYTE> noise(w * h), gradient(w * h), flat(w * h);
+
+    for (size_t i = 0; i < noise.size(); i++)
+    {
+        noise[i] = generator() % 256;
+        gradient[i] = (BYTE)((i / w * 7 + i % w / 40) % 217);
+        flat[i] = generator() % 64 ? 3 : generator() % 8;
+    }
+
+    for (auto [name, pixels] : { std::pair{ "noise", &noise }, std::pair{ "gradient", &gradient }, std::pair{ "flat", &flat } })
+    {
+        double tree = MeasureLzwThroughput<LzwTreeDictionary>(*pixels, 8);
+        double hash = MeasureLzwThroughput<LzwHashDictionary>(*pixels, 8);
+        cout << name << ": tree " << tree << " MP/s, hash " << hash << " MP/s\n";
+    }
+}
+
+void test_run7()
+{
+    // Per-frame time and size overhead of the strip-parallel LZW which the GIF encoders
+    // use for large frames, on 3840x2160 frames
+    const int w = 3840, h = 2160;
+
+    using namespace std::chrono;
+
+    std::mt19937 generator(1);
+    std::vector<BYTE> noise(w * h), gradient(w * h), flat(w * h);
+
+    for (size_t i = 0; i < noise.size(); i++)
+    {
+        noise[i] = generator() % 256;
+        gradient[i] = (BYTE)((i / w * 7 + i % w / 40) % 217);
+        flat[i] = generator() % 64 ? 3 : generator() % 8;
+    }
+
+    cout << std::thread::hardware_concurrency() << " hardware threads\n";
+
+    for (auto [name, pixels] : { std::pair{ "noise", &noise }, std::pair{ "gradient", &gradient }, std::pair{ "flat", &flat } })
+    {
+        ByteBuffer serial, parallel;
+
+        auto start = steady_clock::now();
+        CompressLZWBlocks(*pixels, 8, serial);
+        auto middle = steady_clock::now();
+        CompressLZWBlocksParallel(*pixels, 8, parallel);
+        auto end = steady_clock::now();
+
+        double serialTime = duration<double, std::milli>(middle - start).count();
+        double parallelTime = duration<double, std::milli>(end - middle).count();
+
+        cout << name << ": serial " << serialTime << " ms, " << serial.size() << " bytes; parallel "
+            << parallelTime << " ms, " << parallel.size() << " bytes (" << 100.0 * parallel.size() / serial.size() - 100.0
+            << "% larger, " << serialTime / parallelTime << "x faster)\n";
+    }
+}
+
+void CompareLzwClearModes(const char* name, const std::vector<std::vector<BYTE>>& frames)
+{
+    using namespace std::chrono;
+
+    for (auto [modeName, mode] : { std::pair{ "clear when full", LzwClearMode::WhenFull }, std::pair{ "deferred clear", LzwClearMode::Deferred } })
+    {
+        size_t size = 0;
+        auto start = steady_clock::now();
+
+        for (auto& frame : frames)
+        {
+            ByteBuffer output;
+            CompressLZWBlocks(frame, 8, output, mode);
+            size += output.size();
+        }
+
+        cout << name << ", " << modeName << ": " << size << " bytes, "
+            << duration<double, std::milli>(steady_clock::now() - start).count() << " ms\n";
+    }
+}
+
+void test_run8()
+{
+    // Compares the LZW reset policies on synthetic frames and on recorded frames
+    const int w = 1920, h = 1080;
+
+    std::mt19937 generator(1);
+    std::vector<std::vector<BYTE>> text(10), gradient(10), noise(10);
+
+    for (size_t f = 0; f < 10; f++)
+    {
+        text[f].resize(w * h);
+        gradient[f].resize(w * h);
+        noise[f].resize(w * h);
+
+        for (size_t i = 0; i < text[f].size(); i++)
+        {
+            // Rows of repeated glyph-like patterns on a flat background
+            size_t row = i / w % 16, column = i % w % 9;
+            text[f][i] = row < 12 && column < 6 && (row * 7 + column * 3 + f) % 5 == 0 ? 1 : 200;
+            gradient[f][i] = (BYTE)((i / w * 7 + i % w / 40 + f) % 217);
+            noise[f][i] = generator() % 256;
+        }
+    }
+
+    CompareLzwClearModes("text", text);
+    CompareLzwClearModes("gradient", gradient);
+    CompareLzwClearModes("noise", noise);
+
+    std::vector<std::vector<BYTE>> recorded;
+    ScreenCapture rec(0);
+    SimpleQuantizer quantizer;
+
+    for (int i = 0; i < 30; i++)
+    {
+        rec.GrabImage();
+        rec.DrawCursor();
+        recorded.push_back(quantizer(rec.OutputImage()).pixels);
+        Sleep(100);
+    }
+
+    CompareLzwClearModes("recorded", recorded);
+}
+
+void test_run9()
+{
+    // Compares the export time and size of lossless and lossy GIFs of recorded frames.
+    // SimpleQuantizer's palette colors are 51 apart, so lower tolerances have no effect.
+    std::vector<ImageData> frames;
+    ScreenCapture rec(0);
+
+    for (int i = 0; i < 30; i++)
+    {
+        rec.GrabImage();
+        rec.DrawCursor();
+        frames.push_back(rec.OutputImage());
+        Sleep(100);
+    }
+
+    using namespace std::chrono;
+
+    for (UINT tolerance : { 0u, 51u, 72u, 89u })
+    {
+        auto fileName = L"lossy" + std::to_wstring(tolerance) + L".gif";
+        auto start = steady_clock::now();
+        {
+            GifEncoderOptions options;
+            options.lossyTolerance = tolerance;
+
+            SimpleGifEncoder<SimpleQuantizer> gifImg(fileName, frames[0].width, frames[0].height, options);
+            for (auto& frame : frames)
+            {
+                gifImg.AddFrame(frame, 10);
+            }
+        }
+        double milliseconds = duration<double, std::milli>(steady_clock::now() - start).count();
+
+        std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+        cout << "tolerance " << tolerance << ": " << file.tellg() << " bytes, " << milliseconds << " ms\n";
+    }
+}
+
+void test_run10()
+{
+    // Sequential playback and random seek speed of the decoder, on a GIF made by test_run5
+    using namespace std::chrono;
+
+    GifDecoder decoder;
+    if (FAILED(decoder.Open(L"img.gif")) || decoder.FrameCount() == 0)
+    {
+        cout << "Couldn't open img.gif\n";
+        return;
+    }
+
+    ImageData img(0, 0);
+    auto start = steady_clock::now();
+    for (size_t i = 0; i < decoder.FrameCount(); i++)
+    {
+        decoder.ReadFrame(i, img);
+    }
+    double sequential = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    std::mt19937 generator(1);
+    start = steady_clock::now();
+    for (size_t i = 0; i < decoder.FrameCount(); i++)
+    {
+        decoder.ReadFrame(generator() % decoder.FrameCount(), img);
+    }
+    double random = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    cout << decoder.FrameCount() << " frames: " << sequential / decoder.FrameCount() << " ms per frame sequentially, "
+        << random / decoder.FrameCount() << " ms per random seek\n";
+}
+
+template<bool UseAppend>
+double MeasureLzwAppendThroughput(const std::vector<BYTE>& pixels)
+{
+    using namespace std::chrono;
+
+    size_t outputBits = 0;
+    auto func = [&](UINT, UINT bits) { outputBits += bits; };
+
+    auto start = steady_clock::now();
+    {
+        LZW<decltype(func), LzwHashDictionary> lzw(func, 8);
+        if (UseAppend)
+        {
+            lzw.Append(pixels.data(), pixels.size());
+        }
+        else
+        {
+            for (auto pixel : pixels)
+            {
+                lzw += pixel;
+            }
+        }
+    }
+    double seconds = duration<double>(steady_clock::now() - start).count();
+
+    // Megapixels per second
+    return pixels.size() / seconds / 1e6;
+}
+
+void test_run11()
+{
+    // Throughput of the run-length fast path of LZW::Append on 2560x1440 frames
+    const int w = 2560, h = 1440;
+
+    std::mt19937 generator(1);
+    std::vector<BYTE> flat(w * h), gradient(w * h), noise(w * h);
+
+    for (size_t i = 0; i < flat.size(); i++)
+    {
+        // A window background with a few lines of text
+        flat[i] = i / w % 40 < 12 && generator() % 3 == 0 ? generator() % 8 : 215;
+        gradient[i] = (BYTE)((i / w * 7 + i % w / 40) % 217);
+        noise[i] = generator() % 256;
+    }
+
+    for (auto [name, pixels] : { std::pair{ "flat", &flat }, std::pair{ "gradient", &gradient }, std::pair{ "noise", &noise } })
+    {
+        double bytes = MeasureLzwAppendThroughput<false>(*pixels);
+        double append = MeasureLzwAppendThroughput<true>(*pixels);
+        cout << name << ": += " << bytes << " MP/s, Append " << append << " MP/s\n";
+    }
+}
+
+// Peak signal-to-noise ratio of the quantized image, in decibels
+double QuantizationPsnr(const ImageData& img, const QuantizationOutput& quantization)
+{
+    double squaredError = 0;
+
+    for (size_t k = 0; k < quantization.pixels.size(); k++)
+    {
+        auto color = quantization.palette[quantization.pixels[k]];
+        double db = img.buffer[4 * k + 0] - color.b;
+        double dg = img.buffer[4 * k + 1] - color.g;
+        double dr = img.buffer[4 * k + 2] - color.r;
+        squaredError += db * db + dg * dg + dr * dr;
+    }
+
+    double meanSquaredError = squaredError / (3.0 * quantization.pixels.size());
+    return 10 * std::log10(255.0 * 255.0 / std::max(meanSquaredError, 1e-9));
+}
+
+template<class Quantizer>
+void CompareQuantizer(const char* name, const Quantizer& quantizer, const std::vector<ImageData>& frames)
+{
+    using namespace std::chrono;
+
+    double milliseconds = 0, psnr = 0;
+
+    for (auto& frame : frames)
+    {
+        auto start = steady_clock::now();
+        auto quantization = quantizer(frame);
+        milliseconds += duration<double, std::milli>(steady_clock::now() - start).count();
+        psnr += QuantizationPsnr(frame, quantization);
+    }
+
+    cout << name << ": " << milliseconds / frames.size() << " ms per frame, PSNR " << psnr / frames.size() << " dB\n";
+}
+
+void test_run12()
+{
+    // Encode time and quality of the quantizers on recorded frames
+    std::vector<ImageData> frames;
+    ScreenCapture rec(0);
+
+    for (int i = 0; i < 10; i++)
+    {
+        rec.GrabImage();
+        rec.DrawCursor();
+        frames.push_back(rec.OutputImage());
+        Sleep(200);
+    }
+
+    CompareQuantizer("SimpleQuantizer", SimpleQuantizer(), frames);
+    CompareQuantizer("NeuralQuantizer, sampling factor 1", NeuralQuantizer(1), frames);
+    CompareQuantizer("NeuralQuantizer, sampling factor 10", NeuralQuantizer(10), frames);
+    CompareQuantizer("NeuralQuantizer, sampling factor 30", NeuralQuantizer(30), frames);
+    CompareQuantizer("MedianCutQuantizer, sample step 1", MedianCutQuantizer(1), frames);
+    CompareQuantizer("MedianCutQuantizer, sample step 2", MedianCutQuantizer(2), frames);
+}
+
+// The SimpleQuantizer kernel as it was before vectorization, for comparison
+QuantizationOutput QuantizeToCubeReference(const ImageData& img)
+{
+    QuantizationOutput output;
+    output.pixels.resize((size_t)img.width * img.height);
+
+    for (UINT i = 0, k = 0; i < img.height; i++)
+    {
+        for (UINT j = 0; j < img.width; j++)
+        {
+            UINT b = (5 * img[i][4 * j + 0] + 130) >> 8;
+            UINT g = (5 * img[i][4 * j + 1] + 130) >> 8;
+            UINT r = (5 * img[i][4 * j + 2] + 130) >> 8;
+
+            output.pixels[k++] = r * 36 + g * 6 + b + 1;
+        }
+    }
+
+    return output;
+}
+
+void test_run13()
+{
+    // Throughput of SimpleQuantizer on 2560x1440 frames
+    using namespace std::chrono;
+
+    std::mt19937 generator(1);
+    ImageData img(2560, 1440);
+    for (auto& byte : img.buffer)
+    {
+        byte = (BYTE)generator();
+    }
+
+    const int runs = 20;
+
+    auto start = steady_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        QuantizeToCubeReference(img);
+    }
+    double reference = duration<double, std::milli>(steady_clock::now() - start).count() / runs;
+
+    start = steady_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        SimpleQuantizer()(img);
+    }
+    double vectorized = duration<double, std::milli>(steady_clock::now() - start).count() / runs;
+
+    bool identical = SimpleQuantizer()(img).pixels == QuantizeToCubeReference(img).pixels;
+
+    cout << "Reference: " << reference << " ms per frame\n";
+    cout << "SimpleQuantizer: " << vectorized << " ms per frame, " << (identical ? "identical" : "DIFFERENT") << "\n";
+}
+
+template<class Quantizer>
+void MeasureGifExport(const char* name, const std::vector<ImageData>& frames)
+{
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+    {
+        ParallelGifEncoder<Quantizer> gifImg(L"img-dithered.gif", frames[0].width, frames[0].height);
+        for (auto& frame : frames)
+        {
+            gifImg.AddFrame(frame, 3);
+        }
+    }
+    double milliseconds = duration<double, std::milli>(steady_clock::now() - start).count() / frames.size();
+
+    cout << name << ": " << milliseconds << " ms per frame, " << 1000 / milliseconds << " fps\n";
+}
+
+void test_run14()
+{
+    // Export speed of dithered GIFs from 2560x1440 frames, to compare with the
+    // recording frame rate
+    const UINT w = 2560, h = 1440;
+    std::vector<ImageData> frames;
+
+    for (UINT f = 0; f < 30; f++)
+    {
+        ImageData img(w, h);
+        for (UINT i = 0; i < h; i++)
+        {
+            for (UINT j = 0; j < w; j++)
+            {
+                // Smooth gradients, which band without dithering, and a moving window
+                bool window = i >= 300 && i < 900 && j >= 40 * f && j < 40 * f + 800;
+                img[i][4 * j + 0] = window ? 240 : (BYTE)(i * 255 / h);
+                img[i][4 * j + 1] = window ? 240 : (BYTE)(j * 255 / w);
+                img[i][4 * j + 2] = window ? 240 : (BYTE)(128 + (i + j) / 64);
+                img[i][4 * j + 3] = 255;
+            }
+        }
+        frames.push_back(std::move(img));
+    }
+
+    MeasureGifExport<SimpleQuantizer>("SimpleQuantizer", frames);
+    MeasureGifExport<Dithered<SimpleQuantizer, DitherMode::Ordered>>("SimpleQuantizer, ordered dithering", frames);
+    MeasureGifExport<Dithered<SimpleQuantizer>>("SimpleQuantizer, Floyd-Steinberg", frames);
+    MeasureGifExport<MedianCutQuantizer>("MedianCutQuantizer", frames);
+    MeasureGifExport<Dithered<MedianCutQuantizer, DitherMode::Ordered>>("MedianCutQuantizer, ordered dithering", frames);
+    MeasureGifExport<Dithered<MedianCutQuantizer>>("MedianCutQuantizer, Floyd-Steinberg", frames);
+}
+
+template<class Quantizer>
+void MeasureDeltaGifExport(const char* name, const wchar_t* fileName, Quantizer quantizer, const std::vector<ImageData>& frames)
+{
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+    {
+        GifEncoderOptions options;
+        options.deltaFrames = true;
+
+        SimpleGifEncoder<Quantizer> gifImg(fileName, frames[0].width, frames[0].height, std::move(quantizer), options);
+        for (auto& frame : frames)
+        {
+            gifImg.AddFrame(frame, 10);
+        }
+    }
+    double milliseconds = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    std::ifstream file(fileName, std::ios::binary | std::ios::ate);
+    cout << name << ": " << file.tellg() << " bytes, " << milliseconds / frames.size() << " ms per frame\n";
+}
+
+void test_run15()
+{
+    // Export time and size with per-frame palettes, and with palettes kept across
+    // frames, on recorded frames
+    std::vector<ImageData> frames;
+    ScreenCapture rec(0);
+
+    for (int i = 0; i < 60; i++)
+    {
+        rec.GrabImage();
+        rec.DrawCursor();
+        frames.push_back(rec.OutputImage());
+        Sleep(100);
+    }
+
+    MeasureDeltaGifExport("MedianCutQuantizer", L"img-median-cut.gif", MedianCutQuantizer(), frames);
+    MeasureDeltaGifExport("TemporalQuantizer<MedianCutQuantizer>", L"img-temporal.gif", TemporalQuantizer<MedianCutQuantizer>(), frames);
+
+    // The encoder owns its quantizer, so rebuilds are counted in a separate pass
+    TemporalQuantizer<MedianCutQuantizer> temporal;
+    for (auto& frame : frames)
+    {
+        temporal(frame);
+    }
+
+    cout << "Palette rebuilds over " << frames.size() << " full frames: " << temporal.PaletteRebuilds() << "\n";
+}
+
+void test_run16()
+{
+    // Export time and size of recorded frames with exact palettes where they fit
+    std::vector<ImageData> frames;
+    ScreenCapture rec(0);
+
+    for (int i = 0; i < 30; i++)
+    {
+        rec.GrabImage();
+        rec.DrawCursor();
+        frames.push_back(rec.OutputImage());
+        Sleep(100);
+    }
+
+    size_t exactFrames = 0;
+    for (auto& frame : frames)
+    {
+        QuantizationOutput quantization;
+        exactFrames += TryQuantizeExactly(frame, quantization);
+    }
+    cout << exactFrames << " of " << frames.size() << " frames have at most 255 colors\n";
+
+    MeasureDeltaGifExport("SimpleQuantizer", L"img-simple.gif", SimpleQuantizer(), frames);
+    MeasureDeltaGifExport("ExactPaletteQuantizer<SimpleQuantizer>", L"img-exact.gif", ExactPaletteQuantizer<SimpleQuantizer>(), frames);
+}
+
+// Size of a frame's color table and LZW data, without the GIF block headers
+size_t QuantizedFrameSize(const QuantizationOutput& quantization)
+{
+    return 3 * quantization.palette.size() + CompressLZW(quantization.pixels, std::max(2u, quantization.bitsPerPixel)).size();
+}
+
+void test_run17()
+{
+    // The effect of CompactPalette on recorded frames. Permuting palette indices doesn't
+    // change the LZW output size; dropping unused entries makes codes shorter.
+    std::vector<ImageData> frames;
+    ScreenCapture rec(0);
+
+    for (int i = 0; i < 30; i++)
+    {
+        rec.GrabImage();
+        rec.DrawCursor();
+        frames.push_back(rec.OutputImage());
+        Sleep(100);
+    }
+
+    using namespace std::chrono;
+
+    size_t originalSize = 0, compactSize = 0;
+    double milliseconds = 0;
+
+    for (auto& frame : frames)
+    {
+        auto quantization = SimpleQuantizer()(frame);
+        originalSize += QuantizedFrameSize(quantization);
+
+        auto start = steady_clock::now();
+        CompactPalette(quantization);
+        milliseconds += duration<double, std::milli>(steady_clock::now() - start).count();
+
+        compactSize += QuantizedFrameSize(quantization);
+    }
+
+    cout << "Original palettes: " << originalSize << " bytes\n";
+    cout << "Compact palettes: " << compactSize << " bytes, " << milliseconds / frames.size() << " ms per frame\n";
+}
+
+void test_run20()
+{
+    // Resizing 2560x1440 recordings to 800 pixels wide, and exporting them at full size
+    // and resized
+    const UINT w = 800, h = 450;
+    std::vector<ImageData> frames;
+    ScreenCapture rec(0);
+
+    auto texture = D3D11::CreateCPUTexture(2560, 1440, DXGI_FORMAT_B8G8R8A8_UNORM);
+
+    for (int i = 0; i < 30; i++)
+    {
+        rec.GrabImage();
+        rec.DrawCursor();
+        rec.OutputSubregion(texture, RECT{ .left = 0, .top = 0, .right = 2560, .bottom = 1440 }, 0, 0);
+        frames.push_back(D3D11::TextureToImage(texture));
+        Sleep(100);
+    }
+
+    SafeRelease(texture);
+
+    using namespace std::chrono;
+
+    for (auto [name, filter] : { std::pair{ "Box", ResampleFilter::Box }, std::pair{ "Bilinear", ResampleFilter::Bilinear }, std::pair{ "Lanczos3", ResampleFilter::Lanczos3 } })
+    {
+        auto start = steady_clock::now();
+        for (auto& frame : frames)
+        {
+            ResizeImage(frame, w, h, filter);
+        }
+        double milliseconds = duration<double, std::milli>(steady_clock::now() - start).count();
+
+        cout << name << ": " << milliseconds / frames.size() << " ms per frame\n";
+    }
+
+    // 2560x1440 to 1280x720 takes the integer path
+    auto start = steady_clock::now();
+    for (auto& frame : frames)
+    {
+        ResizeImage(frame, 1280, 720);
+    }
+    cout << "Box, half size: " << duration<double, std::milli>(steady_clock::now() - start).count() / frames.size() << " ms per frame\n";
+
+    MeasureDeltaGifExport("Full size", L"img-full-size.gif", SimpleQuantizer(), frames);
+
+    start = steady_clock::now();
+    {
+        SimpleGifEncoder<SimpleQuantizer> gifImg(L"img-resized.gif", w, h, GifEncoderOptions{ .deltaFrames = true });
+        for (auto& frame : frames)
+        {
+            gifImg.AddFrame(frame, 10);
+        }
+    }
+    double milliseconds = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    std::ifstream file(L"img-resized.gif", std::ios::binary | std::ios::ate);
+    cout << "Resized to " << w << "x" << h << ": " << file.tellg() << " bytes, " << milliseconds / frames.size() << " ms per frame\n";
+}
+
+// Straightforward floating point BT.601 conversion to I420, one pixel at a time
+void ConvertToI420Reference(const ImageData& img, BYTE* y, BYTE* u, BYTE* v)
+{
+    const UINT chromaWidth = (img.width + 1) / 2;
+
+    auto luma = [](double r, double g, double b) { return 0.299 * r + 0.587 * g + 0.114 * b; };
+
+    for (UINT i = 0; i < img.height; i++)
+    {
+        for (UINT j = 0; j < img.width; j++)
+        {
+            const BYTE* pixel = img[i] + 4 * j;
+            y[(size_t)i * img.width + j] = (BYTE)std::lround(16 + luma(pixel[2], pixel[1], pixel[0]) * 219 / 255);
+        }
+    }
+
+    for (UINT i = 0; i < (img.height + 1) / 2; i++)
+    {
+        for (UINT j = 0; j < chromaWidth; j++)
+        {
+            double b = 0, g = 0, r = 0;
+            for (UINT k = 0; k < 4; k++)
+            {
+                const BYTE* pixel = img[std::min(2 * i + k / 2, img.height - 1)] + 4 * std::min(2 * j + k % 2, img.width - 1);
+                b += pixel[0] / 4.0;
+                g += pixel[1] / 4.0;
+                r += pixel[2] / 4.0;
+            }
+
+            double l = luma(r, g, b);
+            u[(size_t)i * chromaWidth + j] = (BYTE)std::lround(128 + (b - l) / 1.772 * 224 / 255);
+            v[(size_t)i * chromaWidth + j] = (BYTE)std::lround(128 + (r - l) / 1.402 * 224 / 255);
+        }
+    }
+}
+
+void test_run21()
+{
+    // Conversion of 2560x1440 frames to I420 and NV12, compared with a scalar reference
+    using namespace std::chrono;
+
+    std::mt19937 generator(1);
+    ImageData img(2560, 1440);
+    for (auto& byte : img.buffer)
+    {
+        byte = (BYTE)generator();
+    }
+
+    const size_t lumaSize = (size_t)img.width * img.height;
+    const size_t chromaSize = lumaSize / 4;
+    std::vector<BYTE> reference(lumaSize + 2 * chromaSize), i420(lumaSize + 2 * chromaSize), nv12(lumaSize + 2 * chromaSize);
+
+    const int runs = 20;
+
+    auto start = steady_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        ConvertToI420Reference(img, reference.data(), reference.data() + lumaSize, reference.data() + lumaSize + chromaSize);
+    }
+    double referenceTime = duration<double, std::milli>(steady_clock::now() - start).count() / runs;
+
+    start = steady_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        ConvertToI420(img, YuvMatrix::Bt601, i420.data(), img.width, i420.data() + lumaSize, img.width / 2, i420.data() + lumaSize + chromaSize, img.width / 2);
+    }
+    double i420Time = duration<double, std::milli>(steady_clock::now() - start).count() / runs;
+
+    start = steady_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        ConvertToNv12(img, YuvMatrix::Bt601, nv12.data(), img.width, nv12.data() + lumaSize, img.width);
+    }
+    double nv12Time = duration<double, std::milli>(steady_clock::now() - start).count() / runs;
+
+    int maxError = 0;
+    for (size_t k = 0; k < reference.size(); k++)
+    {
+        maxError = std::max(maxError, std::abs(reference[k] - i420[k]));
+    }
+
+    cout << "Reference: " << referenceTime << " ms per frame\n";
+    cout << "ConvertToI420: " << i420Time << " ms per frame, maximum error " << maxError << "\n";
+    cout << "ConvertToNv12: " << nv12Time << " ms per frame\n";
+    cout << "Bytes per frame: " << img.buffer.size() << " as BGRA, " << i420.size() << " as 4:2:0\n";
+}
+
+// FNV-1a hash of a sequence of bytes, continuing from the given hash
+uint64_t Fnv1a(const BYTE* data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    for (size_t k = 0; k < size; k++)
+    {
+        hash = (hash ^ data[k]) * 1099511628211ull;
+    }
+
+    return hash;
+}
+
+// Stands in for ffmpeg when testing video export: reads the standard input to the end,
+// and writes its size and hash to the given file
+int ChecksumStdin(const char* outputPath)
+{
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    std::vector<BYTE> buffer(1 << 20);
+    uint64_t size = 0, hash = Fnv1a(nullptr, 0);
+    DWORD read = 0;
+
+    while (ReadFile(input, buffer.data(), (DWORD)buffer.size(), &read, nullptr) && read > 0)
+    {
+        hash = Fnv1a(buffer.data(), read, hash);
+        size += read;
+    }
+
+    std::ofstream(outputPath) << size << ' ' << hash << '\n';
+    return 0;
+}
+
+void test_run22()
+{
+    // Streams frames to this executable started with --checksum-stdin instead of ffmpeg,
+    // and checks that it received exactly the expected I420 frames. Then exports the
+    // same frames with ffmpeg, if it's installed.
+    const UINT w = 641, h = 361;
+    const std::vector<UINT> counts{ 1, 3, 0, 2, 1, 30 };
+
+    std::mt19937 generator(22);
+    std::vector<ImageData> frames;
+    for (size_t f = 0; f < counts.size(); f++)
+    {
+        frames.emplace_back(w, h);
+        for (auto& byte : frames.back().buffer)
+        {
+            byte = (BYTE)generator();
+        }
+    }
+
+    uint64_t expectedSize = 0, expectedHash = Fnv1a(nullptr, 0);
+    std::vector<BYTE> frame(VideoPipeEncoder::FrameSize(w, h));
+    for (size_t f = 0; f < frames.size(); f++)
+    {
+        const UINT chromaWidth = (w + 1) / 2;
+        BYTE* u = frame.data() + (size_t)w * h;
+        BYTE* v = u + (size_t)chromaWidth * ((h + 1) / 2);
+        ConvertToI420(frames[f], YuvMatrix::Bt709, frame.data(), w, u, chromaWidth, v, chromaWidth);
+
+        for (UINT k = 0; k < counts[f]; k++)
+        {
+            expectedHash = Fnv1a(frame.data(), frame.size(), expectedHash);
+            expectedSize += frame.size();
+        }
+    }
+
+    WCHAR executable[MAX_PATH];
+    GetModuleFileNameW(nullptr, executable, MAX_PATH);
+
+    using namespace std::chrono;
+
+    auto start = steady_clock::now();
+    HRESULT result;
+    {
+        VideoPipeEncoder video(L"\"" + std::wstring(executable) + L"\" --checksum-stdin checksum.txt", w, h);
+        for (size_t f = 0; f < frames.size(); f++)
+        {
+            video.AddFrame(frames[f], counts[f]);
+        }
+        result = video.Finish();
+    }
+    double milliseconds = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    uint64_t size = 0, hash = 0;
+    std::ifstream("checksum.txt") >> size >> hash;
+
+    bool identical = SUCCEEDED(result) && size == expectedSize && hash == expectedHash;
+    cout << "Stand-in: " << size << " bytes in " << milliseconds << " ms, " << (identical ? "identical" : "DIFFERENT") << "\n";
+
+    try
+    {
+        VideoExportOptions options;
+        VideoPipeEncoder video(FfmpegCommandLine(options, w, h, L"video.mp4"), w, h, options.matrix);
+        for (size_t f = 0; f < frames.size(); f++)
+        {
+            video.AddFrame(frames[f], counts[f]);
+        }
+
+        cout << "ffmpeg: " << (SUCCEEDED(video.Finish()) ? "exported video.mp4" : "failed") << "\n";
+    }
+    catch (HRESULT hr)
+    {
+        cout << "ffmpeg could not be started, error " << std::hex << hr << std::dec << "\n";
+    }
+}
+
+void test_run23()
+{
+    // Writes compressed-sized frames to one temporary file each, as the recorder used to,
+    // and to a frame store, then reads them back and checks both copies
+    using namespace std::chrono;
+
+    const size_t frameCount = 300;
+    std::mt19937 generator(23);
+    std::vector<std::vector<BYTE>> payloads(frameCount);
+    for (auto& payload : payloads)
+    {
+        payload.resize(200000 + generator() % 400000);
+        for (auto& byte : payload)
+        {
+            byte = (BYTE)generator();
+        }
+    }
+
+    uint64_t expectedHash = Fnv1a(nullptr, 0);
+    for (auto& payload : payloads)
+    {
+        expectedHash = Fnv1a(payload.data(), payload.size(), expectedHash);
+    }
+
+    WCHAR pathBuffer[MAX_PATH];
+    GetTempPathW(MAX_PATH, pathBuffer);
+
+    auto start = steady_clock::now();
+    std::vector<std::wstring> fileNames;
+    for (auto& payload : payloads)
+    {
+        WCHAR fileNameBuffer[MAX_PATH];
+        GetTempFileNameW(pathBuffer, L"vgc", 0, fileNameBuffer);
+        fileNames.push_back(fileNameBuffer);
+
+        HANDLE file = CreateFileW(fileNameBuffer, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        DWORD written = 0;
+        WriteFile(file, payload.data(), (DWORD)payload.size(), &written, nullptr);
+        CloseHandle(file);
+    }
+    double filesWriteTime = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    start = steady_clock::now();
+    uint64_t filesHash = Fnv1a(nullptr, 0);
+    std::vector<BYTE> buffer;
+    for (auto& fileName : fileNames)
+    {
+        HANDLE file = CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER size;
+        GetFileSizeEx(file, &size);
+        buffer.resize((size_t)size.QuadPart);
+        DWORD read = 0;
+        ReadFile(file, buffer.data(), (DWORD)buffer.size(), &read, nullptr);
+        CloseHandle(file);
+        filesHash = Fnv1a(buffer.data(), read, filesHash);
+    }
+    double filesReadTime = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    for (auto& fileName : fileNames)
+    {
+        DeleteFileW(fileName.c_str());
+    }
+
+    std::wstring storePath = std::wstring(pathBuffer) + L"vgc-frames.vgc";
+
+    start = steady_clock::now();
+    {
+        FrameStoreWriter writer(storePath.c_str(), 1920, 1080);
+        for (size_t f = 0; f < frameCount; f++)
+        {
+            writer.Append((UINT)f, f * 20000000ull, payloads[f].data(), payloads[f].size());
+        }
+    }
+    double storeWriteTime = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    start = steady_clock::now();
+    uint64_t storeHash = Fnv1a(nullptr, 0);
+    {
+        FrameStoreReader store(storePath.c_str());
+        for (size_t f = 0; f < store.FrameCount(); f++)
+        {
+            auto frame = store.Frame(f);
+            storeHash = Fnv1a(frame.data, frame.size, storeHash);
+        }
+    }
+    double storeReadTime = duration<double, std::milli>(steady_clock::now() - start).count();
+
+    DeleteFileW(storePath.c_str());
+
+    cout << "One file per frame: write " << filesWriteTime << " ms, read " << filesReadTime << " ms, " << (filesHash == expectedHash ? "identical" : "DIFFERENT") << "\n";
+    cout << "Frame store: write " << storeWriteTime << " ms, read " << storeReadTime << " ms, " << (storeHash == expectedHash ? "identical" : "DIFFERENT") << "\n";
+}
+
+// A 2560x1440 frame resembling a desktop: a gradient background, flat windows with
+// lines of text, and a photo
+ImageData MakeDesktopFrame(std::mt19937& generator)
+{
+    ImageData img(2560, 1440);
+
+    for (UINT i = 0; i < img.height; i++)
+    {
+        for (UINT j = 0; j < img.width; j++)
+        {
+            BYTE* pixel = img[i] + 4 * j;
+            pixel[0] = (BYTE)(120 + i / 12);
+            pixel[1] = (BYTE)(60 + j / 20);
+            pixel[2] = 40;
+            pixel[3] = 255;
+        }
+    }
+
+    for (int w = 0; w < 6; w++)
+    {
+        UINT left = generator() % 1800, top = generator() % 900;
+        UINT width = 400 + generator() % 700, height = 200 + generator() % 500;
+        BYTE shade = (BYTE)(200 + generator() % 56);
+
+        for (UINT i = top; i < std::min(top + height, img.height); i++)
+        {
+            // Lines of text are 16 pixels apart, and made of short strokes
+            bool text = (i - top) % 16 < 10 && i - top > 30;
+
+            for (UINT j = left; j < std::min(left + width, img.width); j++)
+            {
+                BYTE value = text && (j * 7 + i * 3) % 11 < 4 ? (BYTE)(generator() % 80) : shade;
+                BYTE* pixel = img[i] + 4 * j;
+                pixel[0] = pixel[1] = pixel[2] = value;
+            }
+        }
+    }
+
+    for (UINT i = 1000; i < 1400; i++)
+    {
+        for (UINT j = 1900; j < 2500; j++)
+        {
+            BYTE* pixel = img[i] + 4 * j;
+            pixel[0] = (BYTE)(j / 3 + generator() % 8);
+            pixel[1] = (BYTE)(i / 2 + generator() % 8);
+            pixel[2] = (BYTE)((i + j) / 5 + generator() % 8);
+        }
+    }
+
+    return img;
+}
+
+void test_run24()
+{
+    // Encodes desktop-like frames with the frame codec and as PNG files, and checks
+    // that the frame codec is lossless
+    using namespace std::chrono;
+
+    std::mt19937 generator(24);
+    std::vector<ImageData> frames;
+    for (int f = 0; f < 10; f++)
+    {
+        frames.push_back(MakeDesktopFrame(generator));
+    }
+
+    const double megabytes = frames.size() * frames[0].buffer.size() / 1e6;
+
+    std::vector<std::vector<BYTE>> encoded(frames.size());
+    size_t encodedSize = 0;
+
+    auto start = steady_clock::now();
+    for (size_t f = 0; f < frames.size(); f++)
+    {
+        EncodeFrame(frames[f], encoded[f]);
+        encodedSize += encoded[f].size();
+    }
+    double encodeTime = duration<double>(steady_clock::now() - start).count();
+
+    bool identical = true;
+    ImageData decoded(0, 0);
+
+    start = steady_clock::now();
+    for (size_t f = 0; f < frames.size(); f++)
+    {
+        DecodeFrame(decoded, encoded[f].data(), encoded[f].size());
+        identical = identical && decoded.buffer == frames[f].buffer;
+    }
+    double decodeTime = duration<double>(steady_clock::now() - start).count();
+
+    size_t pngSize = 0;
+    std::vector<BYTE> png;
+
+    start = steady_clock::now();
+    for (auto& frame : frames)
+    {
+        SaveImageAsPngToMemory(frame, png);
+        pngSize += png.size();
+    }
+    double pngTime = duration<double>(steady_clock::now() - start).count();
+
+    cout << "Threads: " << std::thread::hardware_concurrency() << "\n";
+    cout << "Frame codec: encode " << megabytes / encodeTime << " MB/s, decode " << megabytes / decodeTime << " MB/s, "
+        << encodedSize / frames.size() << " bytes per frame, " << (identical ? "identical" : "DIFFERENT") << "\n";
+    cout << "PNG: encode " << megabytes / pngTime << " MB/s, " << pngSize / frames.size() << " bytes per frame\n";
+}
+
+void test_run25()
+{
+    // A mostly static recording: text being typed and a moving cursor on a desktop,
+    // stored as whole frames and as deltas, and reconstructed from the deltas
+    using namespace std::chrono;
+
+    std::mt19937 generator(25);
+    ImageData desktop = MakeDesktopFrame(generator);
+    ImageData frame = desktop;
+
+    const size_t frameCount = 300;
+    size_t wholeSize = 0, deltaSize = 0;
+    double wholeTime = 0, deltaTime = 0, decodeTime = 0;
+    bool identical = true;
+
+    FrameDeltaEncoder encoder;
+    FrameDeltaDecoder decoder;
+    std::vector<BYTE> encoded;
+
+    for (size_t f = 0; f < frameCount; f++)
+    {
+        // A character is typed every other frame
+        for (UINT i = 400; i < 412; i++)
+        {
+            for (UINT j = 0; j < 6; j++)
+            {
+                BYTE* pixel = frame[i] + 4 * (300 + 7 * (f / 2) + j);
+                pixel[0] = pixel[1] = pixel[2] = (BYTE)(generator() % 80);
+            }
+        }
+
+        // The cursor moves, and the desktop is restored where it was
+        ImageData captured = frame;
+        UINT cursorLeft = 1000 + 3 * (UINT)f, cursorTop = 700 + (UINT)f;
+        for (UINT i = cursorTop; i < cursorTop + 20; i++)
+        {
+            for (UINT j = cursorLeft; j < cursorLeft + i - cursorTop; j++)
+            {
+                memcpy(captured[i] + 4 * j, "\xff\xff\xff\xff", 4);
+            }
+        }
+
+        auto start = steady_clock::now();
+        EncodeFrame(captured, encoded);
+        wholeTime += duration<double, std::milli>(steady_clock::now() - start).count();
+        wholeSize += encoded.size();
+
+        start = steady_clock::now();
+        EncodeFrameDelta(encoder.ComputeDelta(ImageData(captured)), encoded);
+        deltaTime += duration<double, std::milli>(steady_clock::now() - start).count();
+        deltaSize += encoded.size();
+
+        start = steady_clock::now();
+        decoder.Decode(encoded.data(), encoded.size());
+        decodeTime += duration<double, std::milli>(steady_clock::now() - start).count();
+        identical = identical && decoder.Frame().buffer == captured.buffer;
+    }
+
+    cout << "Whole frames: " << wholeSize / 1e6 << " MB, " << wholeTime / frameCount << " ms per frame\n";
+    cout << "Deltas: " << deltaSize / 1e6 << " MB, " << deltaTime / frameCount << " ms per frame, " << (double)wholeSize / deltaSize << "x smaller\n";
+    cout << "Reconstruction: " << decodeTime / frameCount << " ms per frame, " << (identical ? "identical" : "DIFFERENT") << "\n";
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == 3 && std::string(argv[1]) == "--checksum-stdin")
+    {
+        return ChecksumStdin(argv[2]);
+    }
+
     SetProcessDpiAwarenessContext(DPI_AWARENESS_CONTEXT_PER_MONITOR_AWARE_V2);
     test_run5();
 }
@@ -11,5 +11,7 @@
 #include <vector>
 #include <thread>
 #include <random>
+#include <atomic>
+#include <numeric>
 
 #endif //PCH_H
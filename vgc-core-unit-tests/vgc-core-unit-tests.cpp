@@ -1,7 +1,16 @@
 #include "pch.h"
 #include "../vgc-core/png.h"
 #include "../vgc-core/gif.h"
+#include "../vgc-core/gif-decoder.h"
 #include "../vgc-core/quantization.h"
+#include "../vgc-core/lzw.h"
+#include "../vgc-core/parallel.h"
+#include "../vgc-core/resample.h"
+#include "../vgc-core/yuv.h"
+#include "../vgc-core/video-export.h"
+#include "../vgc-core/frame-store.h"
+#include "../vgc-core/frame-codec.h"
+#include "../vgc-core/frame-delta.h"
 #include "CppUnitTest.h"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
@@ -164,5 +173,1747 @@ namespace vgccoreunittests
                 gifImg.AddFrame(img, 2);
             }
         }
+
+        template<class Dictionary>
+        static std::vector<UINT> CompressToCodes(const std::vector<BYTE>& input, UINT bitDepth)
+        {
+            std::vector<UINT> codes;
+            auto func = [&](UINT code, UINT bits) { codes.push_back(code); codes.push_back(bits); };
+            LZW<decltype(func), Dictionary> lzw(func, bitDepth);
+
+            for (BYTE byte : input)
+            {
+                lzw += byte;
+            }
+
+            lzw.Finish();
+            return codes;
+        }
+
+        TEST_METHOD(TestLzwDictionariesMatch)
+        {
+            std::mt19937 generator(42);
+
+            for (UINT bitDepth = 2; bitDepth <= 8; bitDepth++)
+            {
+                std::uniform_int_distribution<UINT> distribution(0, (1u << bitDepth) - 1);
+                std::vector<BYTE> input(200000);
+
+                for (size_t i = 0; i < input.size(); i++)
+                {
+                    // Alternate between noise and long runs, so both short and long codes are exercised
+                    input[i] = (i / 1000) % 2 ? distribution(generator) : (BYTE)((i / 5000) % (1u << bitDepth));
+                }
+
+                auto treeCodes = CompressToCodes<LzwTreeDictionary>(input, bitDepth);
+                auto hashCodes = CompressToCodes<LzwHashDictionary>(input, bitDepth);
+
+                Assert::IsTrue(treeCodes == hashCodes);
+            }
+        }
+
+        // A straightforward GIF LZW decoder, used to verify the encoder output.
+        static std::vector<BYTE> DecompressLZW(const std::vector<BYTE>& data, UINT bitDepth)
+        {
+            const UINT clearCode = 1u << bitDepth;
+            std::vector<std::vector<BYTE>> table;
+            std::vector<BYTE> output, previous;
+            UINT codeSize = bitDepth + 1;
+            size_t bitPos = 0;
+
+            while (bitPos + codeSize <= data.size() * 8)
+            {
+                UINT code = 0;
+                for (UINT i = 0; i < codeSize; i++, bitPos++)
+                {
+                    code |= ((data[bitPos / 8] >> (bitPos % 8)) & 1u) << i;
+                }
+
+                if (code == clearCode)
+                {
+                    table.resize(clearCode + 2);
+                    for (UINT i = 0; i < clearCode; i++)
+                    {
+                        table[i] = { (BYTE)i };
+                    }
+                    codeSize = bitDepth + 1;
+                    previous.clear();
+                    continue;
+                }
+
+                if (code == clearCode + 1)
+                {
+                    break;
+                }
+
+                std::vector<BYTE> current = code < table.size() ? table[code] : previous;
+                if (code >= table.size())
+                {
+                    current.push_back(previous[0]);
+                }
+
+                if (!previous.empty() && table.size() < 4096)
+                {
+                    previous.push_back(current[0]);
+                    table.push_back(previous);
+                    if (table.size() == (1u << codeSize) && codeSize < 12)
+                    {
+                        codeSize++;
+                    }
+                }
+
+                output.insert(output.end(), current.begin(), current.end());
+                previous = current;
+            }
+
+            return output;
+        }
+
+        TEST_METHOD(TestLzwParallelRoundTrip)
+        {
+            std::mt19937 generator(7);
+
+            for (UINT bitDepth = 2; bitDepth <= 8; bitDepth++)
+            {
+                std::uniform_int_distribution<UINT> distribution(0, (1u << bitDepth) - 1);
+                std::vector<BYTE> input(1 << 19);
+
+                for (size_t i = 0; i < input.size(); i++)
+                {
+                    input[i] = (i / 3000) % 2 ? distribution(generator) : (BYTE)((i / 700) % (1u << bitDepth));
+                }
+
+                Assert::IsTrue(CompressLZWParallel(input, bitDepth, 1) == CompressLZW(input, bitDepth));
+
+                for (UINT strips = 2; strips <= 7; strips++)
+                {
+                    auto compressed = CompressLZWParallel(input, bitDepth, strips);
+                    Assert::IsTrue(DecompressLZW(compressed, bitDepth) == input);
+                }
+            }
+        }
+
+        TEST_METHOD(TestLzwResetAtEverySplit)
+        {
+            std::mt19937 generator(11);
+
+            for (UINT bitDepth : { 2u, 8u })
+            {
+                std::uniform_int_distribution<UINT> distribution(0, (1u << bitDepth) - 1);
+                std::vector<BYTE> input(6000);
+
+                for (size_t i = 0; i < input.size(); i++)
+                {
+                    input[i] = (i / 300) % 2 ? distribution(generator) : (BYTE)((i / 70) % (1u << bitDepth));
+                }
+
+                // Reset must leave the decoder with the initial code size wherever it
+                // happens, including right after the code size grows.
+                for (size_t split = 1; split < input.size(); split++)
+                {
+                    std::vector<BYTE> compressed;
+                    BitStream bitStream([&](BYTE b) { compressed.push_back(b); });
+                    auto writeCode = [&](UINT num, UINT bits) { bitStream.WriteBits(num, bits); };
+
+                    {
+                        LZW<decltype(writeCode), LzwHashDictionary> lzw(writeCode, bitDepth);
+                        lzw.Append(input.data(), split);
+                        lzw.Reset();
+                        lzw.Append(input.data() + split, input.size() - split);
+                        lzw.Finish();
+                    }
+
+                    bitStream.Flush();
+                    Assert::IsTrue(DecompressLZW(compressed, bitDepth) == input);
+                }
+            }
+        }
+
+        static std::vector<BYTE> ReadFileBytes(const std::wstring& path)
+        {
+            std::ifstream ifs(path, std::ios::binary);
+            return std::vector<BYTE>(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+        }
+
+        TEST_METHOD(TestParallelGifEncoderMatchesSimple)
+        {
+            ImageData img(320, 200);
+
+            {
+                SimpleGifEncoder<SimpleQuantizer> simpleGif(L"img-simple.gif", img.width, img.height);
+                ParallelGifEncoder<SimpleQuantizer> parallelGif(L"img-parallel.gif", img.width, img.height, GifEncoderOptions{ .maxFramesInFlight = 3 });
+
+                for (UINT f = 0; f < 20; f++)
+                {
+                    for (UINT i = 0; i < img.height; i++)
+                    {
+                        for (UINT j = 0; j < img.width; j++)
+                        {
+                            img[i][4 * j + 0] = (BYTE)(i + f * 13);
+                            img[i][4 * j + 1] = (BYTE)(j ^ f);
+                            img[i][4 * j + 2] = (BYTE)(i * j);
+                            img[i][4 * j + 3] = 255;
+                        }
+                    }
+
+                    simpleGif.AddFrame(img, 2);
+                    parallelGif.AddFrame(img, 2);
+                }
+            }
+
+            auto simpleBytes = ReadFileBytes(L"img-simple.gif");
+            Assert::IsFalse(simpleBytes.empty());
+            Assert::IsTrue(simpleBytes == ReadFileBytes(L"img-parallel.gif"));
+
+            DeleteFileW(L"img-simple.gif");
+            DeleteFileW(L"img-parallel.gif");
+        }
+
+        // Runs out of memory on the images whose first pixel is white.
+        struct FailingQuantizer
+        {
+            QuantizationOutput operator() (ImageView img) const
+            {
+                if (img.data[0] == 255)
+                {
+                    throw std::bad_alloc();
+                }
+
+                return SimpleQuantizer()(img);
+            }
+        };
+
+        TEST_METHOD(TestParallelGifEncoderErrors)
+        {
+            ImageData img(64, 48);
+            auto fill = [&](BYTE value)
+            {
+                std::fill(img.buffer.begin(), img.buffer.end(), value);
+            };
+
+            {
+                ParallelGifEncoder<FailingQuantizer> gif(L"img-parallel-error.gif", img.width, img.height, GifEncoderOptions{ .maxFramesInFlight = 2 });
+
+                for (UINT f = 0; f < 3; f++)
+                {
+                    fill((BYTE)(f * 10));
+                    gif.AddFrame(img, 2);
+                }
+
+                // The failing frame and the ones after it are dropped
+                fill(255);
+                gif.AddFrame(img, 2);
+                fill(0);
+                gif.AddFrame(img, 2);
+                gif.AddFrame(ImageData(img), 2);
+
+                Assert::AreEqual(E_OUTOFMEMORY, gif.Finish());
+                Assert::AreEqual(E_OUTOFMEMORY, gif.Finish());
+            }
+
+            {
+                GifDecoder decoder;
+                Assert::AreEqual(S_OK, decoder.Open(L"img-parallel-error.gif"));
+                Assert::AreEqual((size_t)3, decoder.FrameCount());
+            }
+
+            // The destructor doesn't throw when Finish wasn't called
+            {
+                ParallelGifEncoder<FailingQuantizer> gif(L"img-parallel-error.gif", img.width, img.height);
+                gif.AddFrame(img, 2);
+                fill(255);
+                gif.AddFrame(img, 2);
+            }
+
+            DeleteFileW(L"img-parallel-error.gif");
+        }
+
+        // Concatenates the contents of the GIF sub-blocks starting at the given offset.
+        static std::vector<BYTE> RemoveSubBlockHeaders(const ByteBuffer& blocks, size_t offset)
+        {
+            std::vector<BYTE> data;
+            for (size_t i = offset; i < blocks.size(); i += blocks[i] + 1)
+            {
+                // Every sub-block but the last one must be full
+                Assert::IsTrue(blocks[i] == 255 || i + blocks[i] + 1 == blocks.size());
+                Assert::IsTrue(blocks[i] > 0 && i + blocks[i] < blocks.size());
+                data.insert(data.end(), blocks.begin() + i + 1, blocks.begin() + i + 1 + blocks[i]);
+            }
+
+            return data;
+        }
+
+        TEST_METHOD(TestLzwSubBlocks)
+        {
+            std::mt19937 generator(3);
+            std::uniform_int_distribution<UINT> distribution(0, 255);
+
+            // Include sizes around the 255-byte sub-block boundaries
+            for (size_t size : { 1, 2, 100, 170, 171, 172, 339, 340, 341, 5000, 1 << 18 })
+            {
+                std::vector<BYTE> input(size);
+                for (auto& byte : input)
+                {
+                    byte = distribution(generator) % 37;
+                }
+
+                ByteBuffer blocks = { 0xaa, 0xbb };
+                CompressLZWBlocks(input, 8, blocks);
+
+                Assert::IsTrue(blocks[0] == 0xaa && blocks[1] == 0xbb);
+                Assert::IsTrue(RemoveSubBlockHeaders(blocks, 2) == CompressLZW(input, 8));
+            }
+        }
+
+        TEST_METHOD(TestLzwBlocksParallel)
+        {
+            std::mt19937 generator(19);
+
+            // Inputs which make a single strip are compressed as by CompressLZWBlocks
+            std::vector<BYTE> input(5000);
+            for (auto& byte : input)
+            {
+                byte = generator() % 37;
+            }
+
+            ByteBuffer serial, parallel;
+            CompressLZWBlocks(input, 8, serial);
+            CompressLZWBlocksParallel(input, 8, parallel);
+            Assert::IsTrue(parallel == serial);
+
+            // Five strips, in both clear modes, lossless and lossy
+            std::vector<PaletteColor> palette(256);
+            for (UINT i = 1; i < 256; i++)
+            {
+                palette[i] = PaletteColor{ (BYTE)i, (BYTE)i, (BYTE)i };
+            }
+
+            auto substitutes = FindSimilarColors(palette, 0, 2);
+
+            input.resize((5 << 19) + 123);
+            for (size_t i = 0; i < input.size(); i++)
+            {
+                input[i] = (i / 3000) % 2 ? (BYTE)(1 + generator() % 255) : (BYTE)(1 + (i / 700) % 60 + generator() % 3);
+            }
+
+            for (auto mode : { LzwClearMode::WhenFull, LzwClearMode::Deferred })
+            {
+                ByteBuffer blocks = { 0xaa };
+                CompressLZWBlocksParallel(input, 8, blocks, mode);
+                Assert::AreEqual((BYTE)0xaa, blocks[0]);
+                Assert::IsTrue(DecompressLZW(RemoveSubBlockHeaders(blocks, 1), 8) == input);
+
+                ByteBuffer lossy;
+                CompressLZWBlocksParallel(input, 8, lossy, mode, &substitutes);
+                auto output = DecompressLZW(RemoveSubBlockHeaders(lossy, 0), 8);
+                Assert::AreEqual(input.size(), output.size());
+                Assert::IsTrue(lossy.size() < blocks.size());
+
+                for (size_t i = 0; i < input.size(); i++)
+                {
+                    Assert::IsTrue(std::abs((int)input[i] - output[i]) <= 2);
+                }
+            }
+
+            // The encoders use it for large frames, which decode to the same pixels
+            ImageData img(2048, 1080);
+            for (UINT i = 0; i < img.height; i++)
+            {
+                for (UINT j = 0; j < img.width; j++)
+                {
+                    img[i][4 * j + 0] = (BYTE)(i / 4 * 36);
+                    img[i][4 * j + 1] = (BYTE)(j / 8 * 36);
+                    img[i][4 * j + 2] = (BYTE)((i ^ j) % 5 * 51);
+                    img[i][4 * j + 3] = 255;
+                }
+            }
+
+            {
+                SimpleGifEncoder<SimpleQuantizer> parallelGif(L"img-lzw-parallel.gif", img.width, img.height);
+                SimpleGifEncoder<SimpleQuantizer> serialGif(L"img-lzw-serial.gif", img.width, img.height, GifEncoderOptions{ .parallelLzwMinPixels = 0 });
+                parallelGif.AddFrame(img, 2);
+                serialGif.AddFrame(img, 2);
+            }
+
+            Assert::IsTrue(ReadFileBytes(L"img-lzw-parallel.gif") != ReadFileBytes(L"img-lzw-serial.gif"));
+
+            {
+                ImageData parallelFrame(0, 0), serialFrame(0, 0);
+                GifDecoder parallelDecoder, serialDecoder;
+                Assert::AreEqual(S_OK, parallelDecoder.Open(L"img-lzw-parallel.gif"));
+                Assert::AreEqual(S_OK, serialDecoder.Open(L"img-lzw-serial.gif"));
+                Assert::AreEqual(S_OK, parallelDecoder.ReadFrame(0, parallelFrame));
+                Assert::AreEqual(S_OK, serialDecoder.ReadFrame(0, serialFrame));
+                Assert::IsTrue(parallelFrame.buffer == serialFrame.buffer);
+            }
+
+            DeleteFileW(L"img-lzw-parallel.gif");
+            DeleteFileW(L"img-lzw-serial.gif");
+        }
+
+        TEST_METHOD(TestFindChangedRect)
+        {
+            ImageData previous(64, 48);
+            ImageData current(64, 48);
+
+            for (BYTE& byte : previous.buffer)
+            {
+                byte = 7;
+            }
+
+            current = previous;
+            Assert::AreEqual((UINT)FindChangedRect(previous, current).width, 0u);
+
+            current[5][4 * 10 + 2] = 1;
+            current[20][4 * 3 + 0] = 1;
+            current[9][4 * 40 + 3] = 1;
+
+            GifFrameRect rect = FindChangedRect(previous, current);
+            Assert::AreEqual((UINT)rect.left, 3u);
+            Assert::AreEqual((UINT)rect.top, 5u);
+            Assert::AreEqual((UINT)rect.width, 38u);
+            Assert::AreEqual((UINT)rect.height, 16u);
+        }
+
+        TEST_METHOD(TestSaveImageAsGifDeltaFrames)
+        {
+            ImageData img(640, 480);
+
+            for (UINT i = 0; i < img.height; i++)
+            {
+                for (UINT j = 0; j < img.width; j++)
+                {
+                    img[i][4 * j + 0] = (BYTE)(i * j);
+                    img[i][4 * j + 1] = (BYTE)(i ^ j);
+                    img[i][4 * j + 2] = (BYTE)(i + j);
+                    img[i][4 * j + 3] = 255;
+                }
+            }
+
+            {
+                SimpleGifEncoder<SimpleQuantizer> fullGif(L"img-full.gif", img.width, img.height);
+                SimpleGifEncoder<SimpleQuantizer> deltaGif(L"img-delta.gif", img.width, img.height, GifEncoderOptions{ .deltaFrames = true });
+                ParallelGifEncoder<SimpleQuantizer> parallelDeltaGif(L"img-parallel-delta.gif", img.width, img.height, GifEncoderOptions{ .deltaFrames = true });
+
+                for (UINT f = 0; f < 30; f++)
+                {
+                    // A small moving square, and every tenth frame is unchanged
+                    if (f % 10)
+                    {
+                        for (UINT i = 100; i < 140; i++)
+                        {
+                            for (UINT j = 10 * f; j < 10 * f + 40; j++)
+                            {
+                                img[i][4 * j + 1] = 255;
+                            }
+                        }
+                    }
+
+                    fullGif.AddFrame(img, 2);
+                    deltaGif.AddFrame(img, 2);
+                    parallelDeltaGif.AddFrame(img, 2);
+                }
+            }
+
+            auto fullBytes = ReadFileBytes(L"img-full.gif");
+            auto deltaBytes = ReadFileBytes(L"img-delta.gif");
+
+            Assert::IsTrue(deltaBytes.size() * 10 < fullBytes.size());
+            Assert::IsTrue(deltaBytes == ReadFileBytes(L"img-parallel-delta.gif"));
+
+            DeleteFileW(L"img-full.gif");
+            DeleteFileW(L"img-delta.gif");
+            DeleteFileW(L"img-parallel-delta.gif");
+        }
+
+        TEST_METHOD(TestPaletteBuilder)
+        {
+            // Colors whose channels survive the reduction to 5 bits exactly
+            const PaletteColor colors[] = { { 0, 0, 0 }, { 255, 255, 255 }, { 132, 0, 255 }, { 33, 66, 99 }, { 255, 132, 0 } };
+
+            ImageData img(64, 64);
+            for (UINT i = 0; i < img.height; i++)
+            {
+                for (UINT j = 0; j < img.width; j++)
+                {
+                    auto color = colors[(i / 8 + j / 16) % 5];
+                    img[i][4 * j + 0] = color.b;
+                    img[i][4 * j + 1] = color.g;
+                    img[i][4 * j + 2] = color.r;
+                    img[i][4 * j + 3] = 255;
+                }
+            }
+
+            PaletteBuilder paletteBuilder;
+            paletteBuilder.AddImage(img);
+            auto palette = paletteBuilder.Build();
+
+            Assert::AreEqual((size_t)256, palette.size());
+            for (auto color : colors)
+            {
+                Assert::IsTrue(std::find(palette.begin() + 1, palette.begin() + 6, color) != palette.begin() + 6);
+            }
+
+            FixedPaletteQuantizer quantizer(palette);
+            auto quantization = quantizer(img);
+
+            Assert::IsTrue(quantization.palette == palette);
+            for (UINT i = 0, k = 0; i < img.height; i++)
+            {
+                for (UINT j = 0; j < img.width; j++, k++)
+                {
+                    auto color = palette[quantization.pixels[k]];
+                    Assert::AreNotEqual(0, (int)quantization.pixels[k]);
+                    Assert::IsTrue(color == colors[(i / 8 + j / 16) % 5]);
+                }
+            }
+        }
+
+        TEST_METHOD(TestSaveImageAsGifGlobalPalette)
+        {
+            ImageData img(320, 240);
+
+            PaletteBuilder paletteBuilder;
+            std::vector<ImageData> frames;
+
+            for (UINT f = 0; f < 10; f++)
+            {
+                for (UINT i = 0; i < img.height; i++)
+                {
+                    for (UINT j = 0; j < img.width; j++)
+                    {
+                        img[i][4 * j + 0] = (BYTE)(i + f);
+                        img[i][4 * j + 1] = (BYTE)(j * 3);
+                        img[i][4 * j + 2] = (BYTE)(i ^ j);
+                        img[i][4 * j + 3] = 255;
+                    }
+                }
+
+                paletteBuilder.AddImage(img, 2);
+                frames.push_back(img);
+            }
+
+            GifEncoderOptions options;
+            options.globalPalette = paletteBuilder.Build();
+
+            {
+                SimpleGifEncoder<FixedPaletteQuantizer> localGif(L"img-local-palette.gif", img.width, img.height, FixedPaletteQuantizer(options.globalPalette));
+                SimpleGifEncoder<FixedPaletteQuantizer> globalGif(L"img-global-palette.gif", img.width, img.height, FixedPaletteQuantizer(options.globalPalette), options);
+                ParallelGifEncoder<FixedPaletteQuantizer> parallelGlobalGif(L"img-parallel-global-palette.gif", img.width, img.height, FixedPaletteQuantizer(options.globalPalette), options);
+
+                for (auto& frame : frames)
+                {
+                    localGif.AddFrame(frame, 2);
+                    globalGif.AddFrame(frame, 2);
+                    parallelGlobalGif.AddFrame(frame, 2);
+                }
+            }
+
+            auto localBytes = ReadFileBytes(L"img-local-palette.gif");
+            auto globalBytes = ReadFileBytes(L"img-global-palette.gif");
+
+            // Each frame drops its 768 byte local table, and the dummy 2 entry global
+            // table is replaced with the real one.
+            Assert::AreEqual(localBytes.size() - 10 * 768 + 768 - 6, globalBytes.size());
+            Assert::IsTrue(globalBytes == ReadFileBytes(L"img-parallel-global-palette.gif"));
+        }
+
+        // The image as it should look after GIF encoding with the given quantizer
+        template<class Quantizer>
+        static ImageData QuantizeToImage(const Quantizer& quantizer, const ImageData& img)
+        {
+            auto quantization = quantizer(img);
+            ImageData result(img.width, img.height);
+
+            for (size_t k = 0; k < quantization.pixels.size(); k++)
+            {
+                auto color = quantization.palette[quantization.pixels[k]];
+                result.buffer[4 * k + 0] = color.b;
+                result.buffer[4 * k + 1] = color.g;
+                result.buffer[4 * k + 2] = color.r;
+                result.buffer[4 * k + 3] = 255;
+            }
+
+            return result;
+        }
+
+        TEST_METHOD(TestGifDecoderRoundTrip)
+        {
+            ImageData img(200, 150);
+            std::vector<ImageData> expected;
+
+            {
+                SimpleGifEncoder<SimpleQuantizer> gifImg(L"img-decoder.gif", img.width, img.height, GifEncoderOptions{ .deltaFrames = true });
+
+                for (UINT f = 0; f < 40; f++)
+                {
+                    for (UINT i = 0; i < img.height; i++)
+                    {
+                        for (UINT j = 0; j < img.width; j++)
+                        {
+                            // A static background, and a moving square
+                            bool square = i >= 50 && i < 80 && j >= 3 * f && j < 3 * f + 30;
+                            img[i][4 * j + 0] = (BYTE)(i * 2);
+                            img[i][4 * j + 1] = square ? 255 : (BYTE)(j ^ i);
+                            img[i][4 * j + 2] = (BYTE)(j + f / 10 * 60);
+                            img[i][4 * j + 3] = 255;
+                        }
+                    }
+
+                    gifImg.AddFrame(img, (USHORT)(2 + f));
+                    expected.push_back(QuantizeToImage(SimpleQuantizer(), img));
+                }
+            }
+
+            GifDecoder decoder(4);
+            Assert::AreEqual(S_OK, decoder.Open(L"img-decoder.gif"));
+            Assert::AreEqual(img.width, decoder.Width());
+            Assert::AreEqual(img.height, decoder.Height());
+            Assert::AreEqual(expected.size(), decoder.FrameCount());
+
+            ImageData decoded(0, 0);
+            for (size_t f = 0; f < expected.size(); f++)
+            {
+                Assert::AreEqual(S_OK, decoder.ReadFrame(f, decoded));
+                Assert::AreEqual((USHORT)(2 + f), decoder.FrameDelay(f));
+                Assert::IsTrue(decoded.buffer == expected[f].buffer);
+            }
+
+            // Random seeks, backwards and forwards
+            std::mt19937 generator(3);
+            for (UINT k = 0; k < 30; k++)
+            {
+                size_t f = generator() % expected.size();
+                Assert::AreEqual(S_OK, decoder.ReadFrame(f, decoded));
+                Assert::IsTrue(decoded.buffer == expected[f].buffer);
+            }
+
+            Assert::AreEqual(E_INVALIDARG, decoder.ReadFrame(expected.size(), decoded));
+        }
+
+        TEST_METHOD(TestGifDecoderTruncatedFile)
+        {
+            ImageData img(100, 100);
+            {
+                SimpleGifEncoder<SimpleQuantizer> gifImg(L"img-truncated-source.gif", img.width, img.height);
+
+                for (UINT f = 0; f < 10; f++)
+                {
+                    for (UINT i = 0; i < img.height; i++)
+                    {
+                        for (UINT j = 0; j < img.width; j++)
+                        {
+                            img[i][4 * j + 0] = (BYTE)(i * j + f);
+                            img[i][4 * j + 1] = (BYTE)(i + f);
+                            img[i][4 * j + 2] = (BYTE)(j - f);
+                            img[i][4 * j + 3] = 255;
+                        }
+                    }
+
+                    gifImg.AddFrame(img, 2);
+                }
+            }
+
+            auto bytes = ReadFileBytes(L"img-truncated-source.gif");
+            {
+                std::ofstream ofs(L"img-truncated.gif", std::ios::binary);
+                ofs.write(reinterpret_cast<const char*>(bytes.data()), bytes.size() / 2);
+            }
+
+            GifDecoder decoder;
+            Assert::AreEqual(S_OK, decoder.Open(L"img-truncated.gif"));
+            Assert::IsTrue(decoder.FrameCount() > 0 && decoder.FrameCount() < 10);
+
+            ImageData decoded(0, 0);
+            Assert::AreEqual(S_OK, decoder.ReadFrame(decoder.FrameCount() - 1, decoded));
+
+            Assert::AreEqual(E_FAIL, decoder.Open(L"img-decoder-missing.gif"));
+        }
+
+        template<class ResetPolicy>
+        static void AssertAppendMatchesBytes(const std::vector<BYTE>& input, UINT bitDepth)
+        {
+            std::vector<UINT> byteCodes, appendCodes;
+            auto byteFunc = [&](UINT code, UINT bits) { byteCodes.push_back(code); byteCodes.push_back(bits); };
+            auto appendFunc = [&](UINT code, UINT bits) { appendCodes.push_back(code); appendCodes.push_back(bits); };
+
+            {
+                LZW<decltype(byteFunc), LzwHashDictionary, ResetPolicy> lzw(byteFunc, bitDepth);
+                for (BYTE byte : input)
+                {
+                    lzw += byte;
+                }
+            }
+
+            {
+                LZW<decltype(appendFunc), LzwHashDictionary, ResetPolicy> lzw(appendFunc, bitDepth);
+
+                // In uneven pieces, so runs are split between calls
+                for (size_t i = 0; i < input.size(); i += 1000 + i % 7)
+                {
+                    lzw.Append(input.data() + i, std::min<size_t>(1000 + i % 7, input.size() - i));
+                }
+            }
+
+            Assert::IsTrue(byteCodes == appendCodes);
+        }
+
+        TEST_METHOD(TestLzwAppendMatchesBytes)
+        {
+            std::mt19937 generator(9);
+
+            for (UINT bitDepth = 1; bitDepth <= 8; bitDepth++)
+            {
+                const UINT values = 1u << bitDepth;
+                std::vector<BYTE> flat(1 << 18), runs, noise(1 << 16), gradient(1 << 18);
+
+                for (size_t i = 0; i < flat.size(); i++)
+                {
+                    flat[i] = generator() % 500 ? 0 : generator() % values;
+                    gradient[i] = (BYTE)(i / 300 % values);
+                }
+
+                while (runs.size() < (1 << 18))
+                {
+                    runs.insert(runs.end(), generator() % 2000 + 1, (BYTE)(generator() % values));
+                }
+
+                for (auto& byte : noise)
+                {
+                    byte = generator() % values;
+                }
+
+                for (auto input : { &flat, &runs, &noise, &gradient })
+                {
+                    AssertAppendMatchesBytes<LzwClearWhenFull>(*input, bitDepth);
+                    AssertAppendMatchesBytes<LzwDeferredClear>(*input, bitDepth);
+                }
+            }
+        }
+
+        TEST_METHOD(TestCountRun)
+        {
+            std::vector<BYTE> data(100, 7);
+
+            for (size_t end = 0; end < data.size(); end++)
+            {
+                data[end] = 8;
+                Assert::AreEqual(end, CountRun(data.data(), data.size(), 7));
+                Assert::AreEqual(std::min<size_t>(end, 20), CountRun(data.data(), 20, 7));
+                data[end] = 7;
+            }
+
+            Assert::AreEqual(data.size(), CountRun(data.data(), data.size(), 7));
+        }
+
+        TEST_METHOD(TestParallelForBands)
+        {
+            for (size_t count : { 0, 1, 7, 1000 })
+            {
+                std::vector<std::atomic<int>> visits(count);
+
+                ParallelForBands(count, [&](size_t begin, size_t end)
+                {
+                    for (size_t i = begin; i < end; i++)
+                    {
+                        visits[i]++;
+                    }
+                }, 3);
+
+                for (auto& visit : visits)
+                {
+                    Assert::AreEqual(1, visit.load());
+                }
+            }
+        }
+
+        // Peak signal-to-noise ratio of the quantized image, in decibels
+        static double QuantizationPsnr(const ImageData& img, const QuantizationOutput& quantization)
+        {
+            double squaredError = 0;
+
+            for (size_t k = 0; k < quantization.pixels.size(); k++)
+            {
+                auto color = quantization.palette[quantization.pixels[k]];
+                double db = img.buffer[4 * k + 0] - color.b;
+                double dg = img.buffer[4 * k + 1] - color.g;
+                double dr = img.buffer[4 * k + 2] - color.r;
+                squaredError += db * db + dg * dg + dr * dr;
+            }
+
+            double meanSquaredError = squaredError / (3.0 * quantization.pixels.size());
+            return 10 * std::log10(255.0 * 255.0 / std::max(meanSquaredError, 1e-9));
+        }
+
+        TEST_METHOD(TestFrameBufferPool)
+        {
+            // A size which no other test uses, so the pool starts without such buffers
+            const UINT width = 1001, height = 503;
+            auto before = FrameBufferPool::GetStatistics();
+
+            {
+                ImageData img(width, height, ImageData::Uninitialized);
+                Assert::AreEqual((uintptr_t)0, (uintptr_t)img.buffer.data() % 4096);
+                std::fill(img.buffer.begin(), img.buffer.end(), (BYTE)0xff);
+            }
+
+            // The dirty buffer is reused, and zeroed when asked to
+            ImageData zeroed(width, height);
+            Assert::IsTrue(std::all_of(zeroed.buffer.begin(), zeroed.buffer.end(), [](BYTE b) { return b == 0; }));
+
+            // Copies take buffers from the pool too
+            ImageData copy = zeroed;
+
+            auto after = FrameBufferPool::GetStatistics();
+            Assert::AreEqual(before.hits + 1, after.hits);
+            Assert::AreEqual(before.misses + 2, after.misses);
+            Assert::IsTrue(after.HitRate() > 0);
+
+            // Small images aren't pooled
+            ImageData small(10, 10);
+            Assert::AreEqual(after.hits + after.misses, FrameBufferPool::GetStatistics().hits + FrameBufferPool::GetStatistics().misses);
+        }
+
+        TEST_METHOD(TestFrameBufferPoolMixedSizes)
+        {
+            const size_t frameSize = 4ull * 2560 * 1440;
+            FrameBufferPool::Trim();
+
+            // One-off sizes, like the tile columns of frame deltas, fill the pool
+            for (size_t i = 0; i < 100; i++)
+            {
+                const size_t size = (6ull << 20) + i * 4096;
+                FrameBufferPool::Release(FrameBufferPool::Allocate(size), size);
+            }
+
+            auto filled = FrameBufferPool::GetStatistics();
+            Assert::IsTrue(filled.pooledBytes <= FrameBufferPool::s_maxPooledBytes);
+            Assert::IsTrue(filled.evictions > 0);
+
+            // Frames still reuse their buffer, which takes the place of old ones
+            for (int i = 0; i < 100; i++)
+            {
+                FrameBufferPool::Release(FrameBufferPool::Allocate(frameSize), frameSize);
+            }
+
+            auto after = FrameBufferPool::GetStatistics();
+            Assert::AreEqual(filled.hits + 99, after.hits);
+            Assert::AreEqual(filled.misses + 1, after.misses);
+            Assert::IsTrue(after.pooledBytes <= FrameBufferPool::s_maxPooledBytes);
+
+            FrameBufferPool::Trim();
+            Assert::AreEqual((size_t)0, FrameBufferPool::GetStatistics().pooledBytes);
+        }
+
+        template<class Quantizer>
+        static void AssertSameQuantization(const Quantizer& quantizer, ImageView view, const ImageData& packed)
+        {
+            auto fromView = quantizer(view);
+            auto fromPacked = quantizer(packed);
+            Assert::IsTrue(fromView.palette == fromPacked.palette);
+            Assert::IsTrue(fromView.pixels == fromPacked.pixels);
+        }
+
+        TEST_METHOD(TestImageViewWithPaddedStride)
+        {
+            const UINT width = 203, height = 97;
+            const size_t pitch = 4 * width + 36;
+
+            // Padding bytes which must never be read as pixels, and a row start which
+            // isn't aligned for vector loads
+            std::vector<BYTE> storage(4 + pitch * height, 0xab);
+            ImageView view(storage.data() + 4, width, height, pitch);
+            BYTE* pixels = storage.data() + 4;
+
+            auto draw = [&](UINT f)
+            {
+                for (UINT i = 0; i < height; i++)
+                {
+                    for (UINT j = 0; j < width; j++)
+                    {
+                        bool square = i >= 30 && i < 50 && j >= 5 * f && j < 5 * f + 20;
+                        BYTE* pixel = pixels + i * pitch + 4 * j;
+                        pixel[0] = (BYTE)(i * 2);
+                        pixel[1] = square ? 255 : (BYTE)(j ^ i);
+                        pixel[2] = (BYTE)(j + i);
+                        pixel[3] = 255;
+                    }
+                }
+            };
+
+            draw(0);
+            ImageData packed(view);
+            Assert::AreEqual(4ull * width * height, (unsigned long long)packed.buffer.size());
+            for (UINT i = 0; i < height; i++)
+            {
+                Assert::IsTrue(memcmp(view[i], packed[i], 4ull * width) == 0);
+            }
+
+            AssertSameQuantization(SimpleQuantizer(), view, packed);
+            AssertSameQuantization(MedianCutQuantizer(), view, packed);
+            AssertSameQuantization(NeuralQuantizer(), view, packed);
+            AssertSameQuantization(Dithered<SimpleQuantizer>(), view, packed);
+            AssertSameQuantization(Dithered<MedianCutQuantizer, DitherMode::Ordered>(), view, packed);
+
+            // Subviews crop without copying
+            GifFrameRect rect{ 17, 9, 60, 41 };
+            auto subview = view.Subview(rect.left, rect.top, rect.width, rect.height);
+            Assert::IsTrue(subview[0] == view[rect.top] + 4 * rect.left);
+            Assert::IsTrue(ImageData(subview).buffer == CropImage(packed, rect).buffer);
+
+            // Encoding views gives the same file as encoding packed copies
+            {
+                GifEncoderOptions options{ .deltaFrames = true };
+                SimpleGifEncoder<SimpleQuantizer> viewGif(L"img-view.gif", width, height, options);
+                SimpleGifEncoder<SimpleQuantizer> packedGif(L"img-view-packed.gif", width, height, options);
+
+                for (UINT f = 0; f < 10; f++)
+                {
+                    draw(f);
+                    viewGif.AddFrame(view, 4);
+                    packedGif.AddFrame(ImageData(view), 4);
+                }
+            }
+
+            auto viewBytes = ReadFileBytes(L"img-view.gif");
+            Assert::IsFalse(viewBytes.empty());
+            Assert::IsTrue(viewBytes == ReadFileBytes(L"img-view-packed.gif"));
+        }
+
+        TEST_METHOD(TestResizeImage)
+        {
+            std::mt19937 generator(20);
+            ImageData img(360, 240);
+            for (auto& byte : img.buffer)
+            {
+                byte = (BYTE)generator();
+            }
+
+            // Whole factors average blocks of pixels
+            auto box = ResizeImage(img, 120, 60, ResampleFilter::Box);
+            for (UINT i = 0; i < box.height; i++)
+            {
+                for (UINT j = 0; j < box.width; j++)
+                {
+                    for (UINT c = 0; c < 4; c++)
+                    {
+                        UINT sum = 0;
+                        for (UINT y = 0; y < 4; y++)
+                        {
+                            for (UINT x = 0; x < 3; x++)
+                            {
+                                sum += img[4 * i + y][4 * (3 * j + x) + c];
+                            }
+                        }
+                        Assert::AreEqual((BYTE)((sum + 6) / 12), box[i][4 * j + c]);
+                    }
+                }
+            }
+
+            // Any filter keeps a flat image flat, and the same size unchanged
+            ImageData flat(97, 61);
+            for (UINT k = 0; k < flat.buffer.size(); k += 4)
+            {
+                flat.buffer[k + 0] = 37;
+                flat.buffer[k + 1] = 140;
+                flat.buffer[k + 2] = 220;
+                flat.buffer[k + 3] = 255;
+            }
+
+            for (auto filter : { ResampleFilter::Box, ResampleFilter::Bilinear, ResampleFilter::Lanczos3 })
+            {
+                for (auto [width, height] : { std::pair{ 40u, 23u }, std::pair{ 150u, 61u }, std::pair{ 3u, 200u } })
+                {
+                    auto resized = ResizeImage(flat, width, height, filter);
+                    Assert::AreEqual(width, resized.width);
+                    Assert::IsTrue(std::equal(resized.buffer.begin(), resized.buffer.end() - 4, resized.buffer.begin() + 4));
+                    Assert::IsTrue(std::equal(flat.buffer.begin(), flat.buffer.begin() + 4, resized.buffer.begin()));
+                }
+
+                Assert::IsTrue(ResizeImage(img, img.width, img.height, filter).buffer == img.buffer);
+            }
+
+            // A horizontal gradient stays close to the mean of the covered source pixels
+            ImageData gradient(512, 8);
+            for (UINT i = 0; i < gradient.height; i++)
+            {
+                for (UINT j = 0; j < gradient.width; j++)
+                {
+                    std::fill(gradient[i] + 4 * j, gradient[i] + 4 * j + 4, (BYTE)(j / 2));
+                }
+            }
+
+            for (auto filter : { ResampleFilter::Box, ResampleFilter::Bilinear, ResampleFilter::Lanczos3 })
+            {
+                auto resized = ResizeImage(gradient, 100, 3, filter);
+                for (UINT j = 3; j + 3 < resized.width; j++)
+                {
+                    double expected = (j + 0.5) * 5.12 / 2 - 0.5;
+                    Assert::AreEqual(expected, (double)resized[1][4 * j + 1], 1.0);
+                }
+            }
+
+            // Views with padded rows give the same result as packed images
+            auto view = ImageView(img).Subview(13, 7, 301, 211);
+            for (auto filter : { ResampleFilter::Box, ResampleFilter::Bilinear, ResampleFilter::Lanczos3 })
+            {
+                Assert::IsTrue(ResizeImage(view, 77, 50, filter).buffer == ResizeImage(ImageData(view), 77, 50, filter).buffer);
+            }
+
+            // Encoders resize frames to the size of the GIF before quantizing them
+            {
+                SimpleGifEncoder<SimpleQuantizer> gifImg(L"img-resized.gif", 90, 60, GifEncoderOptions{ .deltaFrames = true });
+                gifImg.AddFrame(img, 2);
+                gifImg.AddFrame(flat, 2);
+            }
+
+            GifDecoder decoder(2);
+            Assert::AreEqual(S_OK, decoder.Open(L"img-resized.gif"));
+            Assert::AreEqual(90u, decoder.Width());
+            Assert::AreEqual((size_t)2, decoder.FrameCount());
+
+            ImageData decoded(0, 0);
+            Assert::AreEqual(S_OK, decoder.ReadFrame(0, decoded));
+            Assert::IsTrue(decoded.buffer == QuantizeToImage(SimpleQuantizer(), ResizeImage(img, 90, 60)).buffer);
+            Assert::AreEqual(S_OK, decoder.ReadFrame(1, decoded));
+            Assert::IsTrue(decoded.buffer == QuantizeToImage(SimpleQuantizer(), ResizeImage(flat, 90, 60)).buffer);
+        }
+
+        // Limited range Y'CbCr of an RGB color, in double precision
+        static std::vector<double> ReferenceYuv(double r, double g, double b, YuvMatrix matrix)
+        {
+            const double kr = matrix == YuvMatrix::Bt709 ? 0.2126 : 0.299;
+            const double kb = matrix == YuvMatrix::Bt709 ? 0.0722 : 0.114;
+            const double luma = kr * r + (1 - kr - kb) * g + kb * b;
+
+            return
+            {
+                16 + luma * 219 / 255,
+                128 + (b - luma) / (2 * (1 - kb)) * 224 / 255,
+                128 + (r - luma) / (2 * (1 - kr)) * 224 / 255,
+            };
+        }
+
+        TEST_METHOD(TestConvertToYuv420)
+        {
+            std::mt19937 generator(21);
+
+            for (auto [width, height] : { std::pair{ 133u, 67u }, std::pair{ 37u, 23u }, std::pair{ 1u, 1u } })
+            {
+                ImageData img(width, height);
+                for (auto& byte : img.buffer)
+                {
+                    byte = (BYTE)generator();
+                }
+
+                const UINT chromaWidth = (width + 1) / 2;
+                const UINT chromaHeight = (height + 1) / 2;
+
+                // Padded planes, whose padding must be left alone
+                const size_t yPitch = width + 5, uPitch = chromaWidth + 3, uvPitch = 2 * chromaWidth + 7;
+
+                for (auto matrix : { YuvMatrix::Bt601, YuvMatrix::Bt709 })
+                {
+                    std::vector<BYTE> y(yPitch * height, 0xee), u(uPitch * chromaHeight, 0xee), v(uPitch * chromaHeight, 0xee);
+                    std::vector<BYTE> yNv12(yPitch * height, 0xee), uv(uvPitch * chromaHeight, 0xee);
+
+                    ConvertToI420(img, matrix, y.data(), yPitch, u.data(), uPitch, v.data(), uPitch);
+                    ConvertToNv12(img, matrix, yNv12.data(), yPitch, uv.data(), uvPitch);
+                    Assert::IsTrue(y == yNv12);
+
+                    for (UINT i = 0; i < height; i++)
+                    {
+                        for (UINT j = 0; j < width; j++)
+                        {
+                            const BYTE* pixel = img[i] + 4 * j;
+                            auto expected = ReferenceYuv(pixel[2], pixel[1], pixel[0], matrix);
+                            Assert::AreEqual(expected[0], (double)y[i * yPitch + j], 1.0);
+                        }
+
+                        Assert::AreEqual((BYTE)0xee, y[i * yPitch + width]);
+                    }
+
+                    for (UINT i = 0; i < chromaHeight; i++)
+                    {
+                        for (UINT j = 0; j < chromaWidth; j++)
+                        {
+                            // The mean of the 2x2 block, repeating the last row and column
+                            double b = 0, g = 0, r = 0;
+                            for (UINT k = 0; k < 4; k++)
+                            {
+                                const BYTE* pixel = img[std::min(2 * i + k / 2, height - 1)] + 4 * std::min(2 * j + k % 2, width - 1);
+                                b += pixel[0] / 4.0;
+                                g += pixel[1] / 4.0;
+                                r += pixel[2] / 4.0;
+                            }
+
+                            auto expected = ReferenceYuv(r, g, b, matrix);
+                            Assert::AreEqual(expected[1], (double)u[i * uPitch + j], 1.0);
+                            Assert::AreEqual(expected[2], (double)v[i * uPitch + j], 1.0);
+                            Assert::AreEqual(u[i * uPitch + j], uv[i * uvPitch + 2 * j]);
+                            Assert::AreEqual(v[i * uPitch + j], uv[i * uvPitch + 2 * j + 1]);
+                        }
+
+                        Assert::AreEqual((BYTE)0xee, u[i * uPitch + chromaWidth]);
+                        Assert::AreEqual((BYTE)0xee, uv[i * uvPitch + 2 * chromaWidth]);
+                    }
+                }
+            }
+
+            // The ends of the range
+            ImageData gray(32, 2);
+            std::fill(gray.buffer.begin(), gray.buffer.begin() + gray.buffer.size() / 2, (BYTE)0);
+            std::fill(gray.buffer.begin() + gray.buffer.size() / 2, gray.buffer.end(), (BYTE)255);
+
+            BYTE y[64], u[16], v[16];
+            ConvertToI420(gray, YuvMatrix::Bt709, y, 32, u, 16, v, 16);
+            Assert::AreEqual((BYTE)16, y[0]);
+            Assert::AreEqual((BYTE)235, y[32]);
+            Assert::IsTrue(std::all_of(u, u + 16, [](BYTE c) { return c == 128; }));
+            Assert::IsTrue(std::all_of(v, v + 16, [](BYTE c) { return c == 128; }));
+        }
+
+        TEST_METHOD(TestTimestampsToFrameCounts)
+        {
+            const Timestamp start = 5'000'000'000, ms = 1'000'000;
+
+            // At 10 fps, video frames start every 100 ms. Frames which only lasted
+            // between two video frames are dropped.
+            std::vector<Timestamp> timestamps{ start, start + 100 * ms, start + 120 * ms, start + 130 * ms, start + 400 * ms };
+            auto counts = TimestampsToFrameCounts(timestamps, start + 1000 * ms, 10);
+            Assert::IsTrue(counts == std::vector<UINT>{ 1, 1, 0, 2, 6 });
+
+            // The total follows the length of the recording at any frame rate
+            counts = TimestampsToFrameCounts(timestamps, start + 1000 * ms, 60);
+            Assert::AreEqual(60u, std::accumulate(counts.begin(), counts.end(), 0u));
+
+            Assert::IsTrue(TimestampsToFrameCounts({ start }, start, 30) == std::vector<UINT>{ 1 });
+            Assert::IsTrue(TimestampsToFrameCounts({}, start, 30).empty());
+        }
+
+        TEST_METHOD(TestVideoPipeEncoderErrors)
+        {
+            ImageData img(33, 17);
+
+            try
+            {
+                VideoPipeEncoder video(L"vgc-missing-executable.exe", img.width, img.height);
+                Assert::Fail();
+            }
+            catch (HRESULT hr)
+            {
+                Assert::IsTrue(FAILED(hr));
+            }
+
+            // A process which exits without reading its input
+            VideoPipeEncoder video(L"cmd.exe /c exit 3", img.width, img.height);
+            for (UINT f = 0; f < 10; f++)
+            {
+                video.AddFrame(img, 100);
+            }
+            Assert::IsTrue(FAILED(video.Finish()));
+            Assert::IsTrue(FAILED(video.Finish()));
+        }
+
+        TEST_METHOD(TestFrameStore)
+        {
+            // Payloads of various sizes, including empty and unpadded ones
+            std::vector<std::vector<BYTE>> payloads;
+            for (size_t k = 0; k < 6; k++)
+            {
+                std::vector<BYTE> payload(k * k * 1001 % 4099);
+                for (size_t i = 0; i < payload.size(); i++)
+                {
+                    payload[i] = (BYTE)(i * 31 + k);
+                }
+                payloads.push_back(payload);
+            }
+
+            auto checkFrames = [&](const FrameStoreReader& store)
+            {
+                Assert::AreEqual(37u, store.Width());
+                Assert::AreEqual(19u, store.Height());
+                Assert::AreEqual(payloads.size(), store.FrameCount());
+
+                for (size_t k = 0; k < payloads.size(); k++)
+                {
+                    auto frame = store.Frame(k);
+                    Assert::AreEqual((UINT)k, frame.number);
+                    Assert::AreEqual((Timestamp)(1000 + 10 * k), frame.timestamp);
+                    Assert::AreEqual(payloads[k].size(), frame.size);
+                    Assert::IsTrue(std::equal(payloads[k].begin(), payloads[k].end(), frame.data));
+                }
+
+                auto timestamps = store.Timestamps();
+                Assert::AreEqual((Timestamp)1050, timestamps.back());
+            };
+
+            {
+                FrameStoreWriter writer(L"frames.vgc", 37, 19);
+
+                // Frames are appended in the order their compression finishes
+                for (UINT k : { 1, 0, 3, 2, 5, 4 })
+                {
+                    writer.Append(k, 1000 + 10 * k, payloads[k].data(), payloads[k].size());
+                }
+
+                // Without an index, the records are walked
+                FrameStoreReader store(L"frames.vgc");
+                checkFrames(store);
+            }
+
+            FrameStoreReader store(L"frames.vgc");
+            checkFrames(store);
+
+            try
+            {
+                FrameStoreReader missing(L"vgc-missing-frames.vgc");
+                Assert::Fail();
+            }
+            catch (HRESULT hr)
+            {
+                Assert::IsTrue(FAILED(hr));
+            }
+        }
+
+        TEST_METHOD(TestFrameCodecRoundTrip)
+        {
+            std::mt19937 generator(24);
+
+            // Flat areas, gradients and some noise, similar to a desktop, with a padded
+            // stride and sizes which aren't multiples of the strip height
+            ImageData desktop(1001, 203);
+            for (UINT i = 0; i < desktop.height; i++)
+            {
+                for (UINT j = 0; j < desktop.width; j++)
+                {
+                    BYTE* pixel = desktop[i] + 4 * j;
+                    pixel[0] = j < 300 ? 240 : (BYTE)(i + j);
+                    pixel[1] = j < 300 ? 240 : (BYTE)i;
+                    pixel[2] = (i / 10 + j / 10) % 7 == 0 ? (BYTE)generator() : 200;
+                    pixel[3] = j % 97 == 0 ? (BYTE)generator() : 255;
+                }
+            }
+
+            ImageData noise(67, 33);
+            for (auto& byte : noise.buffer)
+            {
+                byte = (BYTE)generator();
+            }
+
+            ImageData single(1, 1);
+            single.buffer = { 1, 2, 3, 4 };
+
+            const std::vector<ImageView> views
+            {
+                desktop,
+                ImageView(desktop[3] + 4 * 5, 900, 150, 4 * desktop.width),
+                noise,
+                single,
+            };
+
+            for (auto& view : views)
+            {
+                std::vector<BYTE> encoded;
+                Assert::IsTrue(SUCCEEDED(EncodeFrame(view, encoded)));
+
+                ImageData decoded(0, 0);
+                Assert::IsTrue(SUCCEEDED(DecodeFrame(decoded, encoded.data(), encoded.size())));
+                Assert::AreEqual(view.width, decoded.width);
+                Assert::AreEqual(view.height, decoded.height);
+
+                for (UINT i = 0; i < view.height; i++)
+                {
+                    Assert::IsTrue(std::equal(view[i], view[i] + 4 * view.width, decoded[i]));
+                }
+
+                // Truncated frames are detected
+                Assert::IsTrue(FAILED(DecodeFrame(decoded, encoded.data(), encoded.size() - 1)));
+            }
+
+            // Flat content takes a few bytes per row
+            ImageData flat(1920, 1080);
+            std::vector<BYTE> encoded;
+            Assert::IsTrue(SUCCEEDED(EncodeFrame(flat, encoded)));
+            Assert::IsTrue(encoded.size() < flat.buffer.size() / 200);
+        }
+
+        TEST_METHOD(TestFrameDeltas)
+        {
+            std::mt19937 generator(25);
+
+            // Tiles of the last row and column are partial
+            ImageData img(300, 200);
+            for (auto& byte : img.buffer)
+            {
+                byte = (BYTE)(generator() % 4);
+            }
+
+            auto fill = [&](ImageData& frame, UINT left, UINT top, UINT width, UINT height)
+            {
+                for (UINT i = top; i < top + height; i++)
+                {
+                    for (UINT j = left; j < left + width; j++)
+                    {
+                        memcpy(frame[i] + 4 * j, "\x10\x20\x30\xff", 4);
+                    }
+                }
+            };
+
+            // Unchanged, changed across tile borders, changed in the corner tile, and
+            // a keyframe for the new size
+            std::vector<ImageData> frames(5, img);
+            fill(frames[2], 60, 60, 10, 10);
+            frames[3] = frames[2];
+            fill(frames[3], 299, 199, 1, 1);
+            frames[4] = ImageData(100, 70);
+            fill(frames[4], 0, 0, 100, 70);
+
+            const std::vector<bool> keyframes{ true, false, false, false, true };
+            const std::vector<size_t> changedTiles{ 0, 0, 4, 1, 0 };
+
+            FrameDeltaEncoder encoder(10);
+            FrameDeltaDecoder decoder;
+
+            for (size_t f = 0; f < frames.size(); f++)
+            {
+                ImageData frame = frames[f];
+                FrameDelta delta = encoder.ComputeDelta(std::move(frame));
+                Assert::AreEqual((bool)keyframes[f], delta.keyframe);
+
+                if (!delta.keyframe)
+                {
+                    size_t count = 0;
+                    for (BYTE bits : delta.changedTiles)
+                    {
+                        count += std::popcount(bits);
+                    }
+                    Assert::AreEqual(changedTiles[f], count);
+                }
+
+                std::vector<BYTE> encoded;
+                Assert::IsTrue(SUCCEEDED(EncodeFrameDelta(delta, encoded)));
+                Assert::IsTrue(SUCCEEDED(decoder.Decode(encoded.data(), encoded.size())));
+                Assert::IsTrue(decoder.Frame().buffer == frames[f].buffer);
+            }
+
+            // Every keyframeInterval-th frame is a keyframe
+            FrameDeltaEncoder periodic(2);
+            Assert::IsTrue(periodic.ComputeDelta(ImageData(img)).keyframe);
+            Assert::IsFalse(periodic.ComputeDelta(ImageData(img)).keyframe);
+            Assert::IsTrue(periodic.ComputeDelta(ImageData(img)).keyframe);
+
+            // Deltas need the keyframe they follow
+            FrameDelta delta = periodic.ComputeDelta(ImageData(img));
+            std::vector<BYTE> encoded;
+            Assert::IsTrue(SUCCEEDED(EncodeFrameDelta(delta, encoded)));
+            Assert::IsTrue(FAILED(FrameDeltaDecoder().Decode(encoded.data(), encoded.size())));
+
+            // After a missing delta, the frame is kept until the next keyframe
+            FrameDeltaEncoder gapEncoder(10);
+            std::vector<std::vector<BYTE>> stream(3);
+            for (size_t f = 0; f < stream.size(); f++)
+            {
+                Assert::IsTrue(SUCCEEDED(EncodeFrameDelta(gapEncoder.ComputeDelta(ImageData(frames[f])), stream[f])));
+            }
+
+            FrameDeltaDecoder gapDecoder;
+            Assert::IsTrue(SUCCEEDED(gapDecoder.Decode(stream[0].data(), stream[0].size())));
+            gapDecoder.SkipFrame();
+            Assert::IsTrue(FAILED(gapDecoder.Decode(stream[2].data(), stream[2].size())));
+            Assert::IsTrue(gapDecoder.Frame().buffer == frames[0].buffer);
+            Assert::IsTrue(SUCCEEDED(gapDecoder.Decode(stream[0].data(), stream[0].size())));
+        }
+
+        TEST_METHOD(TestSimpleQuantizerMatchesScalar)
+        {
+            // Odd widths leave a scalar tail after the vectorized part of each row
+            for (UINT width : { 1, 15, 16, 17, 333 })
+            {
+                std::mt19937 generator(width);
+                ImageData img(width, 31);
+                for (auto& byte : img.buffer)
+                {
+                    byte = (BYTE)generator();
+                }
+
+                auto quantization = SimpleQuantizer()(img);
+
+                Assert::AreEqual((size_t)256, quantization.palette.size());
+                Assert::IsTrue(quantization.palette[0] == PaletteColor{});
+                Assert::IsTrue(quantization.palette[216] == (PaletteColor{ 255, 255, 255 }));
+
+                for (size_t k = 0; k < quantization.pixels.size(); k++)
+                {
+                    UINT b = (5 * img.buffer[4 * k + 0] + 130) >> 8;
+                    UINT g = (5 * img.buffer[4 * k + 1] + 130) >> 8;
+                    UINT r = (5 * img.buffer[4 * k + 2] + 130) >> 8;
+
+                    Assert::AreEqual((BYTE)(r * 36 + g * 6 + b + 1), quantization.pixels[k]);
+
+                    auto color = quantization.palette[quantization.pixels[k]];
+                    Assert::IsTrue(color == (PaletteColor{ (BYTE)(r * 51), (BYTE)(g * 51), (BYTE)(b * 51) }));
+                }
+            }
+        }
+
+        TEST_METHOD(TestNeuralQuantizer)
+        {
+            // Smooth gradients, which a fixed palette handles badly
+            ImageData img(320, 240);
+            for (UINT i = 0; i < img.height; i++)
+            {
+                for (UINT j = 0; j < img.width; j++)
+                {
+                    img[i][4 * j + 0] = (BYTE)(40 + i / 4);
+                    img[i][4 * j + 1] = (BYTE)(j * 255 / img.width);
+                    img[i][4 * j + 2] = (BYTE)(200 - i / 3);
+                    img[i][4 * j + 3] = 255;
+                }
+            }
+
+            for (UINT samplingFactor : { 1, 10, 30 })
+            {
+                auto quantization = NeuralQuantizer(samplingFactor)(img);
+
+                Assert::AreEqual(8u, quantization.bitsPerPixel);
+                Assert::AreEqual((size_t)256, quantization.palette.size());
+                Assert::AreEqual((size_t)img.width * img.height, quantization.pixels.size());
+                Assert::IsTrue(std::find(quantization.pixels.begin(), quantization.pixels.end(), 0) == quantization.pixels.end());
+                Assert::IsTrue(QuantizationPsnr(img, quantization) > QuantizationPsnr(img, SimpleQuantizer()(img)) + 5);
+            }
+
+            // Tiny images are fully sampled
+            ImageData tiny(3, 2);
+            Assert::AreEqual((size_t)6, NeuralQuantizer()(tiny).pixels.size());
+        }
+
+        TEST_METHOD(TestMedianCutQuantizer)
+        {
+            ImageData img(320, 240);
+            for (UINT i = 0; i < img.height; i++)
+            {
+                for (UINT j = 0; j < img.width; j++)
+                {
+                    img[i][4 * j + 0] = (BYTE)(40 + i / 4);
+                    img[i][4 * j + 1] = (BYTE)(j * 255 / img.width);
+                    img[i][4 * j + 2] = (BYTE)(200 - i / 3);
+                    img[i][4 * j + 3] = 255;
+                }
+            }
+
+            for (UINT sampleStep : { 1, 2, 4 })
+            {
+                auto quantization = MedianCutQuantizer(sampleStep)(img);
+
+                Assert::AreEqual(8u, quantization.bitsPerPixel);
+                Assert::AreEqual((size_t)256, quantization.palette.size());
+                Assert::AreEqual((size_t)img.width * img.height, quantization.pixels.size());
+                Assert::IsTrue(std::find(quantization.pixels.begin(), quantization.pixels.end(), 0) == quantization.pixels.end());
+                Assert::IsTrue(QuantizationPsnr(img, quantization) > QuantizationPsnr(img, SimpleQuantizer()(img)) + 5);
+            }
+
+            // As another quantizer of the GIF encoders
+            {
+                SimpleGifEncoder<MedianCutQuantizer> gifImg(L"img-median-cut.gif", img.width, img.height);
+                gifImg.AddFrame(img, 10);
+            }
+
+            GifDecoder decoder;
+            ImageData decoded(0, 0);
+            Assert::AreEqual(S_OK, decoder.Open(L"img-median-cut.gif"));
+            Assert::AreEqual(S_OK, decoder.ReadFrame(0, decoded));
+            Assert::IsTrue(decoded.buffer == QuantizeToImage(MedianCutQuantizer(), img).buffer);
+        }
+
+        TEST_METHOD(TestExactPaletteQuantizer)
+        {
+            // Images with 1, 3, 15, 16 and 255 colors, and one with too many
+            for (UINT colors : { 1, 3, 15, 16, 255, 256 })
+            {
+                ImageData img(123, 45);
+                for (UINT k = 0; k < img.width * img.height; k++)
+                {
+                    UINT color = k / 7 % colors;
+                    img.buffer[4 * k + 0] = (BYTE)color;
+                    img.buffer[4 * k + 1] = (BYTE)(color * 3);
+                    img.buffer[4 * k + 2] = (BYTE)(255 - color);
+                    img.buffer[4 * k + 3] = 255;
+                }
+
+                auto quantization = ExactPaletteQuantizer<>()(img);
+
+                if (colors == 256)
+                {
+                    Assert::IsTrue(quantization.pixels == SimpleQuantizer()(img).pixels);
+                    continue;
+                }
+
+                UINT expectedBits = colors < 2 ? 1 : colors < 4 ? 2 : colors < 16 ? 4 : colors < 32 ? 5 : 8;
+                Assert::AreEqual(expectedBits, quantization.bitsPerPixel);
+                Assert::AreEqual((size_t)1 << expectedBits, quantization.palette.size());
+                Assert::IsTrue(QuantizeToImage(ExactPaletteQuantizer<>(), img).buffer == img.buffer);
+                Assert::IsTrue(std::find(quantization.pixels.begin(), quantization.pixels.end(), 0) == quantization.pixels.end());
+
+                // The GIF decodes to the same image, with the smaller code sizes
+                {
+                    SimpleGifEncoder<ExactPaletteQuantizer<>> gifImg(L"img-exact.gif", img.width, img.height);
+                    gifImg.AddFrame(img, 10);
+                }
+
+                GifDecoder decoder;
+                ImageData decoded(0, 0);
+                Assert::AreEqual(S_OK, decoder.Open(L"img-exact.gif"));
+                Assert::AreEqual(S_OK, decoder.ReadFrame(0, decoded));
+                Assert::IsTrue(decoded.buffer == img.buffer);
+            }
+        }
+
+        TEST_METHOD(TestCompactPalette)
+        {
+            std::mt19937 generator(17);
+            QuantizationOutput quantization;
+            quantization.palette.resize(256);
+            for (UINT k = 0; k < 256; k++)
+            {
+                quantization.palette[k] = PaletteColor{ (BYTE)k, (BYTE)(k * 7), (BYTE)(255 - k) };
+            }
+
+            // Indices 200, 9 and 5, and some transparent pixels
+            for (UINT k = 0; k < 10000; k++)
+            {
+                UINT r = generator() % 100;
+                quantization.pixels.push_back(r < 50 ? 200 : r < 80 ? 9 : r < 95 ? 5 : 0);
+            }
+
+            auto original = quantization;
+            CompactPalette(quantization);
+
+            Assert::AreEqual(2u, quantization.bitsPerPixel);
+            Assert::AreEqual((size_t)4, quantization.palette.size());
+            Assert::IsTrue(quantization.palette[1] == original.palette[5]);
+            Assert::IsTrue(quantization.palette[2] == original.palette[9]);
+            Assert::IsTrue(quantization.palette[3] == original.palette[200]);
+
+            for (size_t k = 0; k < quantization.pixels.size(); k++)
+            {
+                Assert::AreEqual(original.pixels[k] == 0, quantization.pixels[k] == 0);
+                Assert::IsTrue(quantization.palette[quantization.pixels[k]] == original.palette[original.pixels[k]]);
+            }
+
+            // Permuting the indices alone makes no difference to LZW, only the smaller
+            // code size does
+            Assert::AreEqual(CompressLZW(original.pixels, 8).size(), CompressLZW(quantization.pixels, 8).size());
+            Assert::IsTrue(CompressLZW(quantization.pixels, 2).size() < CompressLZW(original.pixels, 8).size());
+        }
+
+        TEST_METHOD(TestTemporalQuantizer)
+        {
+            // A gradient with a window moving over it
+            auto makeFrame = [](UINT position, BYTE window)
+            {
+                ImageData img(400, 300);
+                for (UINT i = 0; i < img.height; i++)
+                {
+                    for (UINT j = 0; j < img.width; j++)
+                    {
+                        bool inWindow = i >= 100 && i < 200 && j >= position && j < position + 100;
+                        img[i][4 * j + 0] = inWindow ? window : (BYTE)(i * 255 / img.height);
+                        img[i][4 * j + 1] = inWindow ? window : (BYTE)(j * 255 / img.width);
+                        img[i][4 * j + 2] = inWindow ? window : 128;
+                        img[i][4 * j + 3] = 255;
+                    }
+                }
+                return img;
+            };
+
+            TemporalQuantizer<MedianCutQuantizer> quantizer;
+            auto first = quantizer(makeFrame(0, 240));
+            Assert::AreEqual((size_t)1, quantizer.PaletteRebuilds());
+
+            // Moving the window a little only remaps the pixels
+            for (UINT position = 4; position <= 20; position += 4)
+            {
+                auto img = makeFrame(position, 240);
+                auto quantization = quantizer(img);
+
+                Assert::AreEqual((size_t)1, quantizer.PaletteRebuilds());
+                Assert::IsTrue(quantization.palette == first.palette);
+                Assert::AreEqual((size_t)img.width * img.height, quantization.pixels.size());
+                Assert::IsTrue(std::find(quantization.pixels.begin(), quantization.pixels.end(), 0) == quantization.pixels.end());
+                Assert::IsTrue(QuantizationPsnr(img, quantization) > QuantizationPsnr(img, SimpleQuantizer()(img)));
+            }
+
+            // So does a crop, as delta frames give
+            quantizer(CropImage(makeFrame(20, 240), GifFrameRect{ 110, 90, 120, 120 }));
+            Assert::AreEqual((size_t)1, quantizer.PaletteRebuilds());
+
+            // But not the placeholder pixel of an unchanged delta frame, whatever its color
+            ImageData placeholder(1, 1);
+            placeholder.buffer[1] = 255;
+            quantizer(placeholder);
+            Assert::AreEqual((size_t)1, quantizer.PaletteRebuilds());
+
+            // A window with a new color is a scene change
+            auto changed = quantizer(makeFrame(100, 20));
+            Assert::AreEqual((size_t)2, quantizer.PaletteRebuilds());
+            Assert::IsTrue(changed.palette != first.palette);
+
+            // The encoders choose the palettes in frame order, so the parallel encoder
+            // gives the same file as the simple one, however many frames are in flight
+            auto encode = [&](auto&& gif)
+            {
+                for (UINT position = 0; position < 200; position += 20)
+                {
+                    gif.AddFrame(makeFrame(position, position < 100 ? 240 : 20), 5);
+                }
+            };
+
+            encode(SimpleGifEncoder<TemporalQuantizer<MedianCutQuantizer>>(L"img-temporal-simple.gif", 400, 300, GifEncoderOptions{ .deltaFrames = true }));
+            encode(ParallelGifEncoder<TemporalQuantizer<MedianCutQuantizer>>(L"img-temporal.gif", 400, 300, GifEncoderOptions{ .deltaFrames = true, .maxFramesInFlight = 8 }));
+            encode(ParallelGifEncoder<TemporalQuantizer<MedianCutQuantizer>>(L"img-temporal-2.gif", 400, 300, GifEncoderOptions{ .deltaFrames = true, .maxFramesInFlight = 2 }));
+
+            auto simpleBytes = ReadFileBytes(L"img-temporal-simple.gif");
+            Assert::IsFalse(simpleBytes.empty());
+            Assert::IsTrue(simpleBytes == ReadFileBytes(L"img-temporal.gif"));
+            Assert::IsTrue(simpleBytes == ReadFileBytes(L"img-temporal-2.gif"));
+
+            GifDecoder decoder;
+            Assert::AreEqual(S_OK, decoder.Open(L"img-temporal.gif"));
+            Assert::AreEqual((size_t)10, decoder.FrameCount());
+        }
+
+        template<class Quantizer>
+        static double MeanGreen(const Quantizer& quantizer, const ImageData& img)
+        {
+            auto quantization = quantizer(img);
+            Assert::IsTrue(std::find(quantization.pixels.begin(), quantization.pixels.end(), 0) == quantization.pixels.end());
+
+            double sum = 0;
+            for (BYTE index : quantization.pixels)
+            {
+                sum += quantization.palette[index].g;
+            }
+
+            return sum / quantization.pixels.size();
+        }
+
+        TEST_METHOD(TestDithering)
+        {
+            // A flat color halfway between two levels of the color cube
+            ImageData flat(97, 61);
+            for (UINT k = 0; k < flat.width * flat.height; k++)
+            {
+                flat.buffer[4 * k + 1] = 76;
+                flat.buffer[4 * k + 3] = 255;
+            }
+
+            Assert::AreEqual(51.0, MeanGreen(SimpleQuantizer(), flat));
+
+            // Ordered dithering goes through the 5-5-5 inverse color map, which moves the
+            // threshold between the two levels by a few units
+            Assert::AreEqual(76.0, MeanGreen(Dithered<SimpleQuantizer, DitherMode::Ordered>(SimpleQuantizer(), 51), flat), 5.0);
+            Assert::AreEqual(76.0, MeanGreen(Dithered<SimpleQuantizer>(), flat), 1.0);
+
+            // The wavefront gives the same result however the threads are scheduled
+            ImageData img(333, 200);
+            for (UINT i = 0; i < img.height; i++)
+            {
+                for (UINT j = 0; j < img.width; j++)
+                {
+                    img[i][4 * j + 0] = (BYTE)(j * 255 / img.width);
+                    img[i][4 * j + 1] = (BYTE)(i + j / 3);
+                    img[i][4 * j + 2] = (BYTE)(90 + i / 4);
+                    img[i][4 * j + 3] = 255;
+                }
+            }
+
+            Dithered<MedianCutQuantizer> quantizer;
+            auto expected = quantizer(img);
+            for (int run = 0; run < 5; run++)
+            {
+                Assert::IsTrue(quantizer(img).pixels == expected.pixels);
+            }
+
+            // Only the palette of the wrapped quantizer is used
+            auto mapped = MedianCutQuantizer()(img);
+            DitherToPalette(img, DitherMode::FloydSteinberg, 32, mapped);
+            Assert::IsTrue(mapped.palette == expected.palette);
+            Assert::IsTrue(mapped.pixels == expected.pixels);
+            Assert::AreEqual(mapped.bitsPerPixel, expected.bitsPerPixel);
+        }
+
+        TEST_METHOD(TestLzwDeferredClear)
+        {
+            std::mt19937 generator(11);
+            std::vector<BYTE> pattern(3000);
+            for (auto& byte : pattern)
+            {
+                byte = generator() % 16;
+            }
+
+            // A long repetitive section, which fills the dictionary and keeps compressing
+            // well with it, followed by noise, which should trigger a clear.
+            std::vector<BYTE> input;
+            for (UINT i = 0; i < 300; i++)
+            {
+                input.insert(input.end(), pattern.begin(), pattern.end());
+            }
+            for (UINT i = 0; i < 300000; i++)
+            {
+                input.push_back(generator() % 256);
+            }
+
+            ByteBuffer whenFull, deferred;
+            CompressLZWBlocks(input, 8, whenFull, LzwClearMode::WhenFull);
+            CompressLZWBlocks(input, 8, deferred, LzwClearMode::Deferred);
+
+            Assert::IsTrue(DecompressLZW(RemoveSubBlockHeaders(deferred, 0), 8) == input);
+            Assert::IsTrue(deferred.size() < whenFull.size());
+        }
+
+        TEST_METHOD(TestLzwLossy)
+        {
+            // A grayscale palette, with index 0 as the transparent color
+            std::vector<PaletteColor> palette(256);
+            for (UINT i = 1; i < 256; i++)
+            {
+                palette[i] = PaletteColor{ (BYTE)i, (BYTE)i, (BYTE)i };
+            }
+
+            const UINT tolerance = 2;
+            auto substitutes = FindSimilarColors(palette, 0, tolerance);
+            Assert::IsTrue(substitutes[0].empty());
+            Assert::IsTrue(substitutes[10] == std::vector<BYTE>{ 9, 11 });
+
+            // A noisy gradient, with some transparent pixels
+            std::mt19937 generator(5);
+            std::vector<BYTE> input(1 << 18);
+            for (size_t i = 0; i < input.size(); i++)
+            {
+                input[i] = generator() % 50 == 0 ? 0 : (BYTE)(1 + (i / 512) % 60 + generator() % 3);
+            }
+
+            ByteBuffer lossless, lossy;
+            CompressLZWBlocks(input, 8, lossless);
+            CompressLZWBlocks(input, 8, lossy, LzwClearMode::WhenFull, &substitutes);
+            Assert::IsTrue(lossy.size() < lossless.size());
+
+            auto output = DecompressLZW(RemoveSubBlockHeaders(lossy, 0), 8);
+            Assert::AreEqual(input.size(), output.size());
+
+            for (size_t i = 0; i < input.size(); i++)
+            {
+                if (input[i] == 0 || output[i] == 0)
+                {
+                    Assert::AreEqual(input[i], output[i]);
+                }
+                else
+                {
+                    int difference = (int)palette[input[i]].r - palette[output[i]].r;
+                    Assert::IsTrue(std::abs(difference) <= (int)tolerance);
+                }
+            }
+        }
     };
 }
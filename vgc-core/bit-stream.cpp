@@ -2,6 +2,13 @@
 
 namespace vgc
 {
+    void SubBlockBitStream::Grow(ByteBuffer& out, size_t size)
+    {
+        // Resizing a ByteBuffer within its capacity doesn't write anything
+        out.reserve(size);
+        out.resize(out.capacity());
+    }
+
     void InsertByteLengthHeaders(std::vector<BYTE>& bytes)
     {
         size_t dataR = bytes.size();
@@ -4,6 +4,45 @@
 
 namespace vgc
 {
+    /*
+     * A standard allocator whose elements are default-initialized rather than
+     * value-initialized, like FrameAllocator, so resizing a vector of bytes doesn't zero them.
+     */
+    template<class T>
+    struct DefaultInitAllocator : std::allocator<T>
+    {
+        template<class U>
+        struct rebind
+        {
+            using other = DefaultInitAllocator<U>;
+        };
+
+        DefaultInitAllocator() = default;
+
+        template<class U>
+        DefaultInitAllocator(const DefaultInitAllocator<U>&) noexcept
+        {
+        }
+
+        template<class U>
+        void construct(U* pointer) noexcept(std::is_nothrow_default_constructible_v<U>)
+        {
+            ::new (static_cast<void*>(pointer)) U;
+        }
+
+        template<class U, class... Args>
+        void construct(U* pointer, Args&&... args)
+        {
+            ::new (static_cast<void*>(pointer)) U(std::forward<Args>(args)...);
+        }
+    };
+
+    /*
+     * Byte buffer which SubBlockBitStream can grow without writing to the new bytes.
+     * The GIF encoding functions write their output to it.
+     */
+    using ByteBuffer = std::vector<BYTE, DefaultInitAllocator<BYTE>>;
+
     /*
      * Bit stream wrapper. Used for capturing the output of compression
      * and for writing the contents of an image to a file. Construct it
@@ -97,5 +136,155 @@ namespace vgc
         }
     };
 
+    /*
+     * Bit stream which writes its output as GIF data sub-blocks, directly into a byte
+     * buffer. Each sub-block holds up to 255 bytes and is prefixed by its length, so the
+     * output doesn't need to be passed to InsertByteLengthHeaders. The bits are accumulated
+     * in a 64-bit word and copied to the buffer 32 bits at a time. The output is appended
+     * to the buffer; call Finish() to write the remaining bits and complete the last
+     * sub-block. The block terminator is not written.
+     */
+    class SubBlockBitStream
+    {
+        ByteBuffer& m_out;
+
+        // Size of m_out before this stream started writing to it
+        const size_t m_start;
+
+        // Number of bytes written to m_out. The rest of m_out is preallocated space,
+        // which is left uninitialized (see Grow).
+        size_t m_size;
+
+        // Index of the length byte of the current sub-block
+        size_t m_blockStart;
+
+        // The offset will always be in 0..31 before/after member function calls
+        UINT m_offset;
+
+        uint64_t m_part;
+
+        bool m_finished;
+
+        // Makes the whole capacity of the buffer, at least the given size, usable. It's
+        // out of line, and doesn't take this, so the stream's state stays in registers.
+        static void Grow(ByteBuffer& out, size_t size);
+
+        void Reserve(size_t bytes)
+        {
+            if (m_size + bytes > m_out.size())
+            {
+                // Grow geometrically relative to what this stream has written, so the
+                // preallocated space doesn't depend on what was in the buffer before.
+                Grow(m_out, m_size + bytes + std::max(m_size - m_start, size_t(1) << 16));
+            }
+        }
+
+        void StartBlock()
+        {
+            Reserve(256);
+            m_blockStart = m_size++;
+        }
+
+        void WriteByte(BYTE byte)
+        {
+            if (m_size - m_blockStart > 255)
+            {
+                m_out[m_blockStart] = 255;
+                StartBlock();
+            }
+
+            m_out[m_size++] = byte;
+        }
+
+        void WriteWord(uint32_t word)
+        {
+            if (m_size - m_blockStart + 4 <= 256)
+            {
+                // Fast path, the whole word fits in the current sub-block.
+                // The targets are little-endian, so the bytes are in the right order.
+                memcpy(m_out.data() + m_size, &word, 4);
+                m_size += 4;
+            }
+            else
+            {
+                for (UINT i = 0; i < 4; i++)
+                {
+                    WriteByte((BYTE)(word & 0xff));
+                    word >>= 8;
+                }
+            }
+        }
+
+    public:
+        SubBlockBitStream(ByteBuffer& out) :
+            m_out(out),
+            m_start(out.size()),
+            m_size(out.size()),
+            m_blockStart(0),
+            m_offset(0),
+            m_part(0),
+            m_finished(false)
+        {
+            StartBlock();
+        }
+
+        /*
+         * Write the lowest m bits of the given 32-bit unsigned integer.
+         * The number of bits written must be strictly less than 32.
+         */
+        SubBlockBitStream& WriteBits(UINT num, UINT m)
+        {
+            num &= (1u << m) - 1;
+            m_part |= (uint64_t)num << m_offset;
+            m_offset += m;
+            if (m_offset >= 32)
+            {
+                WriteWord((uint32_t)m_part);
+                m_offset -= 32;
+                m_part >>= 32;
+            }
+            return *this;
+        }
+
+        /*
+         * Write the remaining bits, filling the unassigned bits of the last byte with zeroes,
+         * and complete the last sub-block. Calling it again does nothing.
+         */
+        void Finish()
+        {
+            if (m_finished)
+            {
+                return;
+            }
+
+            m_finished = true;
+
+            while (m_offset > 0)
+            {
+                WriteByte((BYTE)(m_part & 0xff));
+                m_part >>= 8;
+                m_offset = m_offset > 8 ? m_offset - 8 : 0;
+            }
+
+            size_t blockSize = m_size - m_blockStart - 1;
+            if (blockSize > 0)
+            {
+                m_out[m_blockStart] = (BYTE)blockSize;
+            }
+            else
+            {
+                // Drop the length byte of the empty sub-block
+                m_size--;
+            }
+
+            m_out.resize(m_size);
+        }
+
+        ~SubBlockBitStream()
+        {
+            Finish();
+        }
+    };
+
     void InsertByteLengthHeaders(std::vector<BYTE>& bytes);
 }
@@ -0,0 +1,465 @@
+#include "frame-codec.h"
+#include "frame-pool.h"
+#include "parallel.h"
+#include <atomic>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define VGC_SSE2
+#endif
+
+namespace vgc
+{
+    // Operations of the codec, identified by their first byte
+    static constexpr BYTE s_opIndex = 0x00;     // 00iiiiii: color i of the index
+    static constexpr BYTE s_opDiff = 0x40;      // 01rrggbb: channel differences from the previous pixel, biased by 2
+    static constexpr BYTE s_opLuma = 0x80;      // 10gggggg rrrrbbbb: green difference biased by 32, red and blue relative to it biased by 8
+    static constexpr BYTE s_opRun = 0xc0;       // 110nnnnn: n + 1 times the previous pixel
+    static constexpr BYTE s_opRunAbove = 0xe0;  // 111nnnnn: the next n + 1 pixels of the row above
+    static constexpr BYTE s_opBgr = 0xfe;       // followed by blue, green and red, with the previous alpha
+    static constexpr BYTE s_opBgra = 0xff;      // followed by blue, green, red and alpha
+
+    // Longer runs use the largest count, followed by the rest of their length as a varint
+    static constexpr UINT s_maxShortRun = 31;
+    static constexpr UINT s_maxShortRunAbove = 29;
+
+    // The largest encoded size of a pixel, a literal with alpha
+    static constexpr size_t s_maxPixelSize = 5;
+
+    static constexpr uint32_t s_initialPixel = 0xff000000;
+
+    using StripBuffer = std::vector<BYTE, FrameAllocator<BYTE>>;
+
+    static uint32_t LoadPixel(const BYTE* pixel)
+    {
+        uint32_t value;
+        memcpy(&value, pixel, 4);
+        return value;
+    }
+
+    static UINT PixelHash(uint32_t pixel)
+    {
+        UINT b = pixel & 0xff, g = (pixel >> 8) & 0xff, r = (pixel >> 16) & 0xff, a = pixel >> 24;
+        return (r * 3 + g * 5 + b * 7 + a * 11) & 63;
+    }
+
+    /*
+     * Returns the number of pixels, up to max, which are equal to the given value.
+     */
+    static UINT RunLength(const BYTE* pixels, uint32_t value, UINT max)
+    {
+        UINT n = 0;
+
+#ifdef VGC_SSE2
+        const __m128i values = _mm_set1_epi32((int)value);
+
+        for (; n + 4 <= max; n += 4)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + 4ull * n));
+            UINT mask = (UINT)_mm_movemask_epi8(_mm_cmpeq_epi32(block, values));
+            if (mask != 0xffff)
+            {
+                return n + std::countr_one(mask) / 4;
+            }
+        }
+#endif
+
+        for (; n < max && LoadPixel(pixels + 4ull * n) == value; n++)
+        {
+        }
+
+        return n;
+    }
+
+    /*
+     * Returns the number of pixels, up to max, which are equal in both rows.
+     */
+    static UINT MatchLength(const BYTE* pixels, const BYTE* others, UINT max)
+    {
+        UINT n = 0;
+
+#ifdef VGC_SSE2
+        for (; n + 4 <= max; n += 4)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + 4ull * n));
+            __m128i otherBlock = _mm_loadu_si128(reinterpret_cast<const __m128i*>(others + 4ull * n));
+            UINT mask = (UINT)_mm_movemask_epi8(_mm_cmpeq_epi32(block, otherBlock));
+            if (mask != 0xffff)
+            {
+                return n + std::countr_one(mask) / 4;
+            }
+        }
+#endif
+
+        for (; n < max && LoadPixel(pixels + 4ull * n) == LoadPixel(others + 4ull * n); n++)
+        {
+        }
+
+        return n;
+    }
+
+    static BYTE* WriteRun(BYTE* out, BYTE op, UINT maxShortRun, UINT length)
+    {
+        if (length <= maxShortRun)
+        {
+            *out++ = (BYTE)(op | (length - 1));
+            return out;
+        }
+
+        *out++ = (BYTE)(op | maxShortRun);
+
+        for (UINT rest = length - maxShortRun - 1; ; rest >>= 7)
+        {
+            if (rest < 0x80)
+            {
+                *out++ = (BYTE)rest;
+                return out;
+            }
+
+            *out++ = (BYTE)(rest | 0x80);
+        }
+    }
+
+    /*
+     * Encodes the rows [begin, end) of the image, and returns the encoded size. The
+     * buffer must hold s_maxPixelSize bytes per pixel.
+     */
+    static size_t EncodeStrip(ImageView img, UINT begin, UINT end, BYTE* out)
+    {
+        BYTE* start = out;
+        uint32_t index[64] = {};
+        uint32_t previous = s_initialPixel;
+
+        for (UINT i = begin; i < end; i++)
+        {
+            const BYTE* row = img[i];
+            const BYTE* above = i > begin ? img[i - 1] : nullptr;
+
+            for (UINT j = 0; j < img.width; )
+            {
+                const uint32_t pixel = LoadPixel(row + 4ull * j);
+
+                UINT run = pixel == previous ? RunLength(row + 4ull * j, pixel, img.width - j) : 0;
+                UINT runAbove = above && pixel == LoadPixel(above + 4ull * j) ? MatchLength(row + 4ull * j, above + 4ull * j, img.width - j) : 0;
+
+                if (run > 0 && run >= runAbove)
+                {
+                    out = WriteRun(out, s_opRun, s_maxShortRun, run);
+                    j += run;
+                    continue;
+                }
+
+                if (runAbove > 0)
+                {
+                    out = WriteRun(out, s_opRunAbove, s_maxShortRunAbove, runAbove);
+                    j += runAbove;
+                    previous = LoadPixel(row + 4ull * (j - 1));
+                    continue;
+                }
+
+                const UINT hash = PixelHash(pixel);
+                if (index[hash] == pixel)
+                {
+                    *out++ = (BYTE)(s_opIndex | hash);
+                }
+                else if ((pixel ^ previous) >> 24 == 0)
+                {
+                    index[hash] = pixel;
+
+                    int db = (int8_t)(pixel - previous);
+                    int dg = (int8_t)((pixel >> 8) - (previous >> 8));
+                    int dr = (int8_t)((pixel >> 16) - (previous >> 16));
+
+                    if (db >= -2 && db <= 1 && dg >= -2 && dg <= 1 && dr >= -2 && dr <= 1)
+                    {
+                        *out++ = (BYTE)(s_opDiff | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                    }
+                    else if (dg >= -32 && dg <= 31 && dr - dg >= -8 && dr - dg <= 7 && db - dg >= -8 && db - dg <= 7)
+                    {
+                        *out++ = (BYTE)(s_opLuma | (dg + 32));
+                        *out++ = (BYTE)((dr - dg + 8) << 4 | (db - dg + 8));
+                    }
+                    else
+                    {
+                        *out++ = s_opBgr;
+                        memcpy(out, &pixel, 3);
+                        out += 3;
+                    }
+                }
+                else
+                {
+                    index[hash] = pixel;
+                    *out++ = s_opBgra;
+                    memcpy(out, &pixel, 4);
+                    out += 4;
+                }
+
+                previous = pixel;
+                j++;
+            }
+        }
+
+        return out - start;
+    }
+
+    static bool ReadVarint(const BYTE*& data, const BYTE* end, UINT& value)
+    {
+        value = 0;
+
+        for (UINT shift = 0; shift < 32; shift += 7)
+        {
+            if (data == end)
+            {
+                return false;
+            }
+
+            BYTE byte = *data++;
+            value |= (UINT)(byte & 0x7f) << shift;
+
+            if (byte < 0x80)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /*
+     * Decodes a strip of the given number of pixels into contiguous rows of the given
+     * width. Returns false if the data is invalid.
+     */
+    static bool DecodeStrip(const BYTE* data, const BYTE* end, BYTE* out, size_t count, UINT width)
+    {
+        uint32_t index[64] = {};
+        uint32_t previous = s_initialPixel;
+        size_t position = 0;
+
+        while (position < count)
+        {
+            if (data == end)
+            {
+                return false;
+            }
+
+            const BYTE op = *data++;
+
+            if (op >= s_opRun && op < s_opBgr)
+            {
+                const bool above = op >= s_opRunAbove;
+                const UINT maxShortRun = above ? s_maxShortRunAbove : s_maxShortRun;
+
+                UINT length = (op & 0x1f) + 1;
+                if (length > maxShortRun)
+                {
+                    UINT rest;
+                    if (!ReadVarint(data, end, rest) || rest > count)
+                    {
+                        return false;
+                    }
+                    length += rest;
+                }
+
+                if (length > count - position || (above && position < width))
+                {
+                    return false;
+                }
+
+                BYTE* pixels = out + 4 * position;
+                if (above)
+                {
+                    // Runs longer than a row copy pixels they just wrote
+                    for (UINT done = 0; done < length; )
+                    {
+                        UINT chunk = std::min(length - done, width);
+                        memcpy(pixels + 4ull * done, pixels + 4ull * done - 4ull * width, 4ull * chunk);
+                        done += chunk;
+                    }
+
+                    previous = LoadPixel(pixels + 4ull * (length - 1));
+                }
+                else
+                {
+                    for (UINT k = 0; k < length; k++)
+                    {
+                        memcpy(pixels + 4ull * k, &previous, 4);
+                    }
+                }
+
+                position += length;
+                continue;
+            }
+
+            uint32_t pixel;
+
+            if (op < s_opDiff)
+            {
+                pixel = index[op];
+            }
+            else if (op < s_opLuma)
+            {
+                uint32_t b = (previous + ((op & 3) - 2)) & 0xff;
+                uint32_t g = ((previous >> 8) + ((op >> 2 & 3) - 2)) & 0xff;
+                uint32_t r = ((previous >> 16) + ((op >> 4 & 3) - 2)) & 0xff;
+                pixel = (previous & 0xff000000) | r << 16 | g << 8 | b;
+            }
+            else if (op < s_opRun)
+            {
+                if (data == end)
+                {
+                    return false;
+                }
+
+                int dg = (op & 0x3f) - 32;
+                int dr = dg + (*data >> 4) - 8;
+                int db = dg + (*data & 0xf) - 8;
+                data++;
+
+                uint32_t b = (previous + db) & 0xff;
+                uint32_t g = ((previous >> 8) + dg) & 0xff;
+                uint32_t r = ((previous >> 16) + dr) & 0xff;
+                pixel = (previous & 0xff000000) | r << 16 | g << 8 | b;
+            }
+            else
+            {
+                const size_t literal = op == s_opBgra ? 4 : 3;
+                if ((size_t)(end - data) < literal)
+                {
+                    return false;
+                }
+
+                pixel = previous;
+                memcpy(&pixel, data, literal);
+                data += literal;
+            }
+
+            index[PixelHash(pixel)] = pixel;
+            memcpy(out + 4 * position, &pixel, 4);
+            previous = pixel;
+            position++;
+        }
+
+        return true;
+    }
+
+    HRESULT EncodeFrame(ImageView img, std::vector<BYTE>& out)
+    {
+        if (!img.width || !img.height)
+        {
+            return E_INVALIDARG;
+        }
+
+        const UINT stripHeight = FrameCodecHeader::s_stripHeight;
+        const UINT stripCount = (img.height + stripHeight - 1) / stripHeight;
+
+        try
+        {
+            std::vector<StripBuffer> strips(stripCount);
+            std::vector<uint32_t> sizes(stripCount);
+
+            ParallelForBands(stripCount, [&](size_t begin, size_t end)
+            {
+                for (size_t s = begin; s < end; s++)
+                {
+                    const UINT top = (UINT)s * stripHeight;
+                    const UINT bottom = std::min(top + stripHeight, img.height);
+
+                    strips[s].resize(s_maxPixelSize * img.width * (bottom - top));
+                    sizes[s] = (uint32_t)EncodeStrip(img, top, bottom, strips[s].data());
+                }
+            });
+
+            FrameCodecHeader header{ FrameCodecHeader::s_magic, img.width, img.height, stripHeight };
+
+            size_t size = sizeof(header) + sizeof(uint32_t) * stripCount;
+            for (uint32_t stripSize : sizes)
+            {
+                size += stripSize;
+            }
+
+            out.resize(size);
+            BYTE* data = out.data();
+
+            memcpy(data, &header, sizeof(header));
+            data += sizeof(header);
+            memcpy(data, sizes.data(), sizeof(uint32_t) * stripCount);
+            data += sizeof(uint32_t) * stripCount;
+
+            for (UINT s = 0; s < stripCount; s++)
+            {
+                memcpy(data, strips[s].data(), sizes[s]);
+                data += sizes[s];
+            }
+        }
+        catch (std::bad_alloc)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        return S_OK;
+    }
+
+    HRESULT DecodeFrame(ImageData& img, const BYTE* data, size_t size)
+    {
+        FrameCodecHeader header;
+        if (!data || size < sizeof(header))
+        {
+            return E_FAIL;
+        }
+
+        memcpy(&header, data, sizeof(header));
+        if (header.magic != FrameCodecHeader::s_magic || !header.width || !header.height || !header.stripHeight)
+        {
+            return E_FAIL;
+        }
+
+        const UINT stripCount = (UINT)(((uint64_t)header.height + header.stripHeight - 1) / header.stripHeight);
+        if ((size - sizeof(header)) / sizeof(uint32_t) < stripCount)
+        {
+            return E_FAIL;
+        }
+
+        std::vector<uint32_t> sizes(stripCount);
+        memcpy(sizes.data(), data + sizeof(header), sizeof(uint32_t) * stripCount);
+
+        // The offset of each strip, and of the end of the data
+        std::vector<size_t> offsets(stripCount + 1);
+        offsets[0] = sizeof(header) + sizeof(uint32_t) * stripCount;
+        for (UINT s = 0; s < stripCount; s++)
+        {
+            if (sizes[s] > size - offsets[s])
+            {
+                return E_FAIL;
+            }
+
+            offsets[s + 1] = offsets[s] + sizes[s];
+        }
+
+        try
+        {
+            img = ImageData(header.width, header.height, ImageData::Uninitialized);
+        }
+        catch (std::bad_alloc)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        std::atomic<bool> valid = true;
+
+        ParallelForBands(stripCount, [&](size_t begin, size_t end)
+        {
+            for (size_t s = begin; s < end; s++)
+            {
+                const UINT top = (UINT)s * header.stripHeight;
+                const UINT rows = std::min(header.stripHeight, header.height - top);
+
+                if (!DecodeStrip(data + offsets[s], data + offsets[s + 1], img[top], (size_t)rows * header.width, header.width))
+                {
+                    valid = false;
+                }
+            }
+        });
+
+        return valid ? S_OK : E_FAIL;
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "pch.h"
+#include "image-data.h"
+
+namespace vgc
+{
+    /*
+     * A fast lossless codec for recorded frames, in the spirit of QOI. Pixels are coded
+     * one after the other as a run of the previous pixel, a run of the pixels of the row
+     * above, a reference to a recently seen color, a small difference from the previous
+     * pixel, or a literal. Screen content is mostly made of runs and repeated colors,
+     * which take a single byte for many pixels, and there's no entropy coding, so it's
+     * coded at several hundred megabytes per second per core.
+     *
+     * Frames are split into strips of s_stripHeight rows which are coded independently,
+     * on separate threads. The encoded frame starts with a FrameCodecHeader, followed by
+     * the encoded size of each strip as a uint32_t, then the strips.
+     */
+    struct FrameCodecHeader
+    {
+        // "VGCF" in the file
+        static constexpr uint32_t s_magic = 0x46434756;
+        static constexpr uint32_t s_stripHeight = 32;
+
+        uint32_t magic;
+        uint32_t width;
+        uint32_t height;
+        uint32_t stripHeight;
+    };
+
+    /*
+     * Encodes the image into the given byte buffer, replacing its contents.
+     */
+    HRESULT EncodeFrame(ImageView img, std::vector<BYTE>& out);
+
+    /*
+     * Decodes a frame encoded with EncodeFrame into the given ImageData object. Returns
+     * E_FAIL if the data is truncated or isn't an encoded frame.
+     */
+    HRESULT DecodeFrame(ImageData& img, const BYTE* data, size_t size);
+}
@@ -0,0 +1,247 @@
+#include "frame-delta.h"
+#include "parallel.h"
+
+namespace vgc
+{
+    static constexpr UINT s_tileSize = FrameDeltaHeader::s_tileSize;
+
+    static UINT TileCount(UINT size)
+    {
+        return (size + s_tileSize - 1) / s_tileSize;
+    }
+
+    FrameDeltaEncoder::FrameDeltaEncoder(UINT keyframeInterval) :
+        m_previous(0, 0),
+        m_keyframeInterval(std::max(1u, keyframeInterval)),
+        m_framesSinceKeyframe(0)
+    {
+    }
+
+    FrameDelta FrameDeltaEncoder::ComputeDelta(ImageData&& img)
+    {
+        FrameDelta delta;
+        delta.width = img.width;
+        delta.height = img.height;
+
+        if (m_previous.width != img.width || m_previous.height != img.height || ++m_framesSinceKeyframe >= m_keyframeInterval)
+        {
+            delta.keyframe = true;
+            delta.pixels = ImageData(ImageView(img));
+            m_previous = std::move(img);
+            m_framesSinceKeyframe = 0;
+            return delta;
+        }
+
+        const UINT tilesX = TileCount(img.width);
+        const UINT tilesY = TileCount(img.height);
+        std::vector<BYTE> changed((size_t)tilesX * tilesY);
+
+        ParallelForBands(tilesY, [&](size_t begin, size_t end)
+        {
+            for (size_t ty = begin; ty < end; ty++)
+            {
+                const UINT top = (UINT)ty * s_tileSize;
+                const UINT bottom = std::min(top + s_tileSize, img.height);
+
+                for (UINT tx = 0; tx < tilesX; tx++)
+                {
+                    const size_t left = 4ull * tx * s_tileSize;
+                    const size_t bytes = 4ull * std::min(s_tileSize, img.width - tx * s_tileSize);
+
+                    for (UINT i = top; i < bottom; i++)
+                    {
+                        if (memcmp(img[i] + left, m_previous[i] + left, bytes) != 0)
+                        {
+                            changed[ty * tilesX + tx] = 1;
+                            break;
+                        }
+                    }
+                }
+            }
+        });
+
+        // The position of each changed tile in the column
+        std::vector<UINT> slots(changed.size());
+        UINT changedCount = 0;
+        delta.changedTiles.resize((changed.size() + 7) / 8);
+
+        for (size_t t = 0; t < changed.size(); t++)
+        {
+            if (changed[t])
+            {
+                slots[t] = changedCount++;
+                delta.changedTiles[t / 8] |= (BYTE)(1 << (t % 8));
+            }
+        }
+
+        delta.pixels = ImageData(s_tileSize, changedCount * s_tileSize);
+
+        ParallelForBands(changed.size(), [&](size_t begin, size_t end)
+        {
+            for (size_t t = begin; t < end; t++)
+            {
+                if (!changed[t])
+                {
+                    continue;
+                }
+
+                const UINT left = (UINT)(t % tilesX) * s_tileSize;
+                const UINT top = (UINT)(t / tilesX) * s_tileSize;
+                const size_t bytes = 4ull * std::min(s_tileSize, img.width - left);
+                const UINT rows = std::min(s_tileSize, img.height - top);
+
+                for (UINT i = 0; i < rows; i++)
+                {
+                    memcpy(delta.pixels[(size_t)slots[t] * s_tileSize + i], img[top + i] + 4ull * left, bytes);
+                }
+            }
+        }, 16);
+
+        m_previous = std::move(img);
+        return delta;
+    }
+
+    HRESULT EncodeFrameDelta(const FrameDelta& delta, std::vector<BYTE>& out)
+    {
+        if (delta.keyframe)
+        {
+            return EncodeFrame(delta.pixels, out);
+        }
+
+        FrameDeltaHeader header{ FrameDeltaHeader::s_magic, delta.width, delta.height, s_tileSize };
+        const size_t prefixSize = sizeof(header) + delta.changedTiles.size();
+
+        try
+        {
+            std::vector<BYTE> tiles;
+            if (delta.pixels.height > 0)
+            {
+                HRESULT result = EncodeFrame(delta.pixels, tiles);
+                if (FAILED(result))
+                {
+                    return result;
+                }
+            }
+
+            out.resize(prefixSize + tiles.size());
+            memcpy(out.data(), &header, sizeof(header));
+            std::copy(delta.changedTiles.begin(), delta.changedTiles.end(), out.begin() + sizeof(header));
+            std::copy(tiles.begin(), tiles.end(), out.begin() + prefixSize);
+        }
+        catch (std::bad_alloc)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        return S_OK;
+    }
+
+    FrameDeltaDecoder::FrameDeltaDecoder() :
+        m_frame(0, 0),
+        m_tiles(0, 0),
+        m_synchronized(false)
+    {
+    }
+
+    HRESULT FrameDeltaDecoder::Decode(const BYTE* data, size_t size)
+    {
+        HRESULT result = DecodeDelta(data, size);
+        m_synchronized = SUCCEEDED(result);
+        return result;
+    }
+
+    void FrameDeltaDecoder::SkipFrame()
+    {
+        m_synchronized = false;
+    }
+
+    HRESULT FrameDeltaDecoder::DecodeDelta(const BYTE* data, size_t size)
+    {
+        FrameDeltaHeader header;
+        if (!data || size < sizeof(header))
+        {
+            return E_FAIL;
+        }
+
+        memcpy(&header, data, sizeof(header));
+
+        // A keyframe replaces the frame once it's fully decoded
+        if (header.magic == FrameCodecHeader::s_magic)
+        {
+            HRESULT result = DecodeFrame(m_tiles, data, size);
+            if (SUCCEEDED(result))
+            {
+                std::swap(m_frame, m_tiles);
+            }
+
+            return result;
+        }
+
+        if (!m_synchronized || header.magic != FrameDeltaHeader::s_magic || header.tileSize != s_tileSize ||
+            header.width != m_frame.width || header.height != m_frame.height)
+        {
+            return E_FAIL;
+        }
+
+        const UINT tilesX = TileCount(header.width);
+        const UINT tilesY = TileCount(header.height);
+        const size_t tileCount = (size_t)tilesX * tilesY;
+        const size_t prefixSize = sizeof(header) + (tileCount + 7) / 8;
+
+        if (size < prefixSize)
+        {
+            return E_FAIL;
+        }
+
+        const BYTE* changedTiles = data + sizeof(header);
+        size_t changedCount = 0;
+        for (size_t t = 0; t < tileCount; t++)
+        {
+            changedCount += changedTiles[t / 8] >> (t % 8) & 1;
+        }
+
+        if (changedCount == 0)
+        {
+            return size == prefixSize ? S_OK : E_FAIL;
+        }
+
+        HRESULT result = DecodeFrame(m_tiles, data + prefixSize, size - prefixSize);
+        if (FAILED(result))
+        {
+            return result;
+        }
+
+        if (m_tiles.width != s_tileSize || m_tiles.height != changedCount * s_tileSize)
+        {
+            return E_FAIL;
+        }
+
+        size_t slot = 0;
+        for (size_t t = 0; t < tileCount; t++)
+        {
+            if (!(changedTiles[t / 8] >> (t % 8) & 1))
+            {
+                continue;
+            }
+
+            const UINT left = (UINT)(t % tilesX) * s_tileSize;
+            const UINT top = (UINT)(t / tilesX) * s_tileSize;
+            const size_t bytes = 4ull * std::min(s_tileSize, m_frame.width - left);
+            const UINT rows = std::min(s_tileSize, m_frame.height - top);
+
+            for (UINT i = 0; i < rows; i++)
+            {
+                memcpy(m_frame[top + i] + 4ull * left, m_tiles[slot * s_tileSize + i], bytes);
+            }
+
+            slot++;
+        }
+
+        return S_OK;
+    }
+
+    const ImageData& FrameDeltaDecoder::Frame() const
+    {
+        return m_frame;
+    }
+}
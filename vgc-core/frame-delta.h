@@ -0,0 +1,111 @@
+#pragma once
+
+#include "pch.h"
+#include "image-data.h"
+#include "frame-codec.h"
+
+namespace vgc
+{
+    /*
+     * Frames stored as differences from the previous frame. Frames are divided into a
+     * grid of s_tileSize by s_tileSize tiles, the last row and column of which may be
+     * smaller. Keyframes hold the whole frame, and are encoded with EncodeFrame. Other
+     * frames start with a FrameDeltaHeader, followed by a bitmask of the tiles which
+     * changed, in row-major order with the lowest bit first, then by the changed tiles,
+     * stacked in a column s_tileSize pixels wide and encoded with EncodeFrame. Tiles of
+     * the last row and column are padded with zeros. When nothing changed, there are
+     * no tiles.
+     */
+    struct FrameDeltaHeader
+    {
+        // "VGCD" in the file
+        static constexpr uint32_t s_magic = 0x44434756;
+        static constexpr uint32_t s_tileSize = 64;
+
+        uint32_t magic;
+        uint32_t width;
+        uint32_t height;
+        uint32_t tileSize;
+    };
+
+    /*
+     * A frame, as found by FrameDeltaEncoder, before it's compressed.
+     */
+    struct FrameDelta
+    {
+        bool keyframe = false;
+        UINT width = 0;
+        UINT height = 0;
+
+        // The whole frame for keyframes, otherwise the column of changed tiles
+        ImageData pixels = ImageData(0, 0);
+
+        // One bit per tile, set if the tile changed. Empty for keyframes.
+        std::vector<BYTE> changedTiles;
+    };
+
+    /*
+     * Finds the tiles which changed in each frame. Frames must be given in order, but
+     * the resulting deltas may be compressed in any order, e.g. in parallel.
+     */
+    class FrameDeltaEncoder
+    {
+        ImageData m_previous;
+        UINT m_keyframeInterval;
+        UINT m_framesSinceKeyframe;
+
+    public:
+        /*
+         * Every keyframeInterval-th frame is a keyframe, starting with the first one, as
+         * well as frames whose size changed.
+         */
+        FrameDeltaEncoder(UINT keyframeInterval = 60);
+
+        /*
+         * Returns the changes from the previous frame. The frame is kept to find the
+         * changes of the next one.
+         */
+        FrameDelta ComputeDelta(ImageData&& img);
+    };
+
+    /*
+     * Encodes a delta into the given byte buffer, replacing its contents.
+     */
+    HRESULT EncodeFrameDelta(const FrameDelta& delta, std::vector<BYTE>& out);
+
+    /*
+     * Reconstructs frames from their encoded deltas, which must be given in order,
+     * starting with a keyframe.
+     */
+    class FrameDeltaDecoder
+    {
+        ImageData m_frame;
+        ImageData m_tiles;
+
+        // Whether the frame is the one the next delta applies to
+        bool m_synchronized;
+
+        HRESULT DecodeDelta(const BYTE* data, size_t size);
+
+    public:
+        FrameDeltaDecoder();
+
+        /*
+         * Applies the next encoded delta. Returns E_FAIL if the data is invalid, or if
+         * it doesn't follow a keyframe of the same size, and keeps the previous frame.
+         * After a failure, deltas are rejected until the next keyframe.
+         */
+        HRESULT Decode(const BYTE* data, size_t size);
+
+        /*
+         * Tells the decoder that a delta is missing, e.g. because it couldn't be saved.
+         * The frame is kept, and deltas are rejected until the next keyframe.
+         */
+        void SkipFrame();
+
+        /*
+         * The last decoded frame.
+         */
+        const ImageData& Frame() const;
+    };
+}
@@ -0,0 +1,154 @@
+#include "frame-pool.h"
+
+namespace vgc
+{
+    static constexpr size_t s_pageSize = 4096;
+    static constexpr size_t s_cacheLineSize = 64;
+
+    struct PooledBuffer
+    {
+        void* buffer;
+        size_t size;
+    };
+
+    struct FrameBufferPoolState
+    {
+        std::mutex mutex;
+
+        // All pooled buffers, the least recently released first
+        std::list<PooledBuffer> buffers;
+
+        // The pooled buffers of each size, in the same order
+        std::map<size_t, std::vector<std::list<PooledBuffer>::iterator>> buffersBySize;
+
+        FrameBufferPool::Statistics statistics;
+    };
+
+    // Never destroyed, so buffers can be released during static destruction
+    static FrameBufferPoolState& PoolState()
+    {
+        static FrameBufferPoolState* state = new FrameBufferPoolState();
+        return *state;
+    }
+
+    static std::align_val_t AlignmentFor(size_t size)
+    {
+        return std::align_val_t(size >= FrameBufferPool::s_minPooledSize ? s_pageSize : s_cacheLineSize);
+    }
+
+    void* FrameBufferPool::Allocate(size_t size)
+    {
+        if (size >= s_minPooledSize)
+        {
+            auto& state = PoolState();
+            std::lock_guard lock(state.mutex);
+
+            auto entry = state.buffersBySize.find(size);
+            if (entry != state.buffersBySize.end())
+            {
+                auto pooled = entry->second.back();
+                void* buffer = pooled->buffer;
+
+                entry->second.pop_back();
+                if (entry->second.empty())
+                {
+                    state.buffersBySize.erase(entry);
+                }
+
+                state.buffers.erase(pooled);
+                state.statistics.hits++;
+                state.statistics.pooledBuffers--;
+                state.statistics.pooledBytes -= size;
+                return buffer;
+            }
+
+            state.statistics.misses++;
+        }
+
+        return ::operator new(std::max<size_t>(size, 1), AlignmentFor(size));
+    }
+
+    void FrameBufferPool::Release(void* buffer, size_t size) noexcept
+    {
+        if (!buffer)
+        {
+            return;
+        }
+
+        if (size >= s_minPooledSize)
+        {
+            auto& state = PoolState();
+            std::lock_guard lock(state.mutex);
+
+            if (size <= s_maxPooledBytes)
+            {
+                // Make room by freeing the buffers which were released the longest ago,
+                // so sizes which stopped being used don't keep the current ones out
+                while (state.statistics.pooledBytes + size > s_maxPooledBytes)
+                {
+                    PooledBuffer oldest = state.buffers.front();
+
+                    auto entry = state.buffersBySize.find(oldest.size);
+                    entry->second.erase(entry->second.begin());
+                    if (entry->second.empty())
+                    {
+                        state.buffersBySize.erase(entry);
+                    }
+
+                    state.buffers.pop_front();
+                    ::operator delete(oldest.buffer, AlignmentFor(oldest.size));
+
+                    state.statistics.evictions++;
+                    state.statistics.pooledBuffers--;
+                    state.statistics.pooledBytes -= oldest.size;
+                }
+
+                try
+                {
+                    auto& sameSize = state.buffersBySize[size];
+                    sameSize.reserve(sameSize.size() + 1);
+                    state.buffers.push_back({ buffer, size });
+                    sameSize.push_back(std::prev(state.buffers.end()));
+
+                    state.statistics.pooledBuffers++;
+                    state.statistics.pooledBytes += size;
+                    return;
+                }
+                catch (std::bad_alloc)
+                {
+                    // Free the buffer instead
+                    auto entry = state.buffersBySize.find(size);
+                    if (entry != state.buffersBySize.end() && entry->second.empty())
+                    {
+                        state.buffersBySize.erase(entry);
+                    }
+                }
+            }
+        }
+
+        ::operator delete(buffer, AlignmentFor(size));
+    }
+
+    FrameBufferPool::Statistics FrameBufferPool::GetStatistics()
+    {
+        auto& state = PoolState();
+        std::lock_guard lock(state.mutex);
+        return state.statistics;
+    }
+
+    void FrameBufferPool::Trim()
+    {
+        auto& state = PoolState();
+        std::lock_guard lock(state.mutex);
+
+        for (auto& pooled : state.buffers)
+        {
+            ::operator delete(pooled.buffer, AlignmentFor(pooled.size));
+        }
+
+        state.buffers.clear();
+        state.buffersBySize.clear();
+        state.statistics.pooledBuffers = 0;
+        state.statistics.pooledBytes = 0;
+    }
+}
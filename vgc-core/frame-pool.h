@@ -0,0 +1,107 @@
+#pragma once
+
+#include "pch.h"
+
+namespace vgc
+{
+    /*
+     * A process-wide pool of frame-sized buffers. Released buffers of at least
+     * s_minPooledSize bytes are kept, up to s_maxPooledBytes in total, and handed out
+     * again to allocations of the same size, so recording and exporting frames of a
+     * fixed size only allocates while the pipeline fills up. When the pool is full, the
+     * buffers released the longest ago are freed first, so buffers of one-off sizes
+     * don't keep frame-sized ones out. Pooled buffers are page-aligned; smaller ones
+     * are only aligned to cache lines, and aren't pooled.
+     *
+     * All functions are thread safe.
+     */
+    class FrameBufferPool
+    {
+    public:
+        static constexpr size_t s_minPooledSize = 1 << 20;
+        static constexpr size_t s_maxPooledBytes = 512ull << 20;
+
+        struct Statistics
+        {
+            // Allocations of pooled sizes which reused a buffer, and which didn't
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+
+            // Pooled buffers which were freed to make room for others
+            uint64_t evictions = 0;
+
+            // Buffers currently kept for reuse
+            size_t pooledBuffers = 0;
+            size_t pooledBytes = 0;
+
+            double HitRate() const
+            {
+                return hits + misses ? (double)hits / (hits + misses) : 0;
+            }
+        };
+
+        /*
+         * Returns an uninitialized buffer of the given size. Throws std::bad_alloc.
+         */
+        static void* Allocate(size_t size);
+
+        /*
+         * Returns a buffer obtained from Allocate with the same size to the pool.
+         */
+        static void Release(void* buffer, size_t size) noexcept;
+
+        static Statistics GetStatistics();
+
+        /*
+         * Frees all buffers kept for reuse, e.g. once a recording is exported.
+         */
+        static void Trim();
+    };
+
+    /*
+     * A standard allocator which takes its memory from FrameBufferPool. Elements are
+     * default-initialized rather than value-initialized, so resizing a vector of bytes
+     * doesn't zero them.
+     */
+    template<class T>
+    struct FrameAllocator
+    {
+        using value_type = T;
+        using is_always_equal = std::true_type;
+
+        FrameAllocator() = default;
+
+        template<class U>
+        FrameAllocator(const FrameAllocator<U>&) noexcept
+        {
+        }
+
+        T* allocate(size_t count)
+        {
+            return static_cast<T*>(FrameBufferPool::Allocate(count * sizeof(T)));
+        }
+
+        void deallocate(T* buffer, size_t count) noexcept
+        {
+            FrameBufferPool::Release(buffer, count * sizeof(T));
+        }
+
+        template<class U>
+        void construct(U* pointer) noexcept(std::is_nothrow_default_constructible_v<U>)
+        {
+            ::new (static_cast<void*>(pointer)) U;
+        }
+
+        template<class U, class... Args>
+        void construct(U* pointer, Args&&... args)
+        {
+            ::new (static_cast<void*>(pointer)) U(std::forward<Args>(args)...);
+        }
+
+        template<class U>
+        bool operator== (const FrameAllocator<U>&) const noexcept
+        {
+            return true;
+        }
+    };
+}
@@ -0,0 +1,319 @@
+#include "frame-store.h"
+
+namespace vgc
+{
+    static uint64_t PaddedSize(uint64_t size)
+    {
+        return (size + 7) & ~7ull;
+    }
+
+    FrameStoreWriter::FrameStoreWriter(LPCWSTR path, UINT width, UINT height) :
+        m_file(nullptr),
+        m_size(sizeof(FrameStoreHeader)),
+        m_allocatedSize(0),
+        m_header{ FrameStoreHeader::s_magic, FrameStoreHeader::s_version, width, height, 0, 0 }
+    {
+        // Readers can open the file while it's being written
+        m_file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+        {
+            throw HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        try
+        {
+            Reserve(s_allocationChunk);
+            WriteAt(0, &m_header, sizeof(m_header));
+        }
+        catch (HRESULT)
+        {
+            CloseHandle(m_file);
+            throw;
+        }
+    }
+
+    void FrameStoreWriter::Reserve(uint64_t size)
+    {
+        if (size <= m_allocatedSize)
+        {
+            return;
+        }
+
+        size = std::max(size, m_allocatedSize + s_allocationChunk);
+
+        LARGE_INTEGER position;
+        position.QuadPart = (LONGLONG)size;
+        if (!SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN) || !SetEndOfFile(m_file))
+        {
+            throw HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        m_allocatedSize = size;
+    }
+
+    void FrameStoreWriter::WriteAt(uint64_t offset, const void* data, size_t size)
+    {
+        LARGE_INTEGER position;
+        position.QuadPart = (LONGLONG)offset;
+        if (!SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN))
+        {
+            throw HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        const BYTE* bytes = static_cast<const BYTE*>(data);
+        while (size > 0)
+        {
+            DWORD written = 0;
+            if (!WriteFile(m_file, bytes, (DWORD)std::min<size_t>(size, 1 << 30), &written, nullptr))
+            {
+                throw HRESULT_FROM_WIN32(GetLastError());
+            }
+
+            bytes += written;
+            size -= written;
+        }
+    }
+
+    void FrameStoreWriter::Append(UINT number, Timestamp timestamp, const BYTE* data, size_t size)
+    {
+        std::unique_lock lock(m_mutex);
+
+        if (!m_file)
+        {
+            throw E_FAIL;
+        }
+
+        const uint64_t offset = m_size;
+        const uint64_t padding = PaddedSize(size) - size;
+        Reserve(offset + sizeof(FrameStoreRecord) + size + padding);
+
+        // The payload is written before its header, so walking the records never
+        // reaches a record whose payload is incomplete
+        static const BYTE zeros[8] = {};
+        WriteAt(offset + sizeof(FrameStoreRecord), data, size);
+        WriteAt(offset + sizeof(FrameStoreRecord) + size, zeros, (size_t)padding);
+
+        FrameStoreRecord record{ FrameStoreRecord::s_magic, number, timestamp, size };
+        WriteAt(offset, &record, sizeof(record));
+
+        m_index.push_back({ offset + sizeof(FrameStoreRecord), size, timestamp, number, 0 });
+        m_size = offset + sizeof(FrameStoreRecord) + size + padding;
+    }
+
+    void FrameStoreWriter::Close()
+    {
+        std::unique_lock lock(m_mutex);
+
+        if (!m_file)
+        {
+            return;
+        }
+
+        try
+        {
+            WriteAt(m_size, m_index.data(), m_index.size() * sizeof(FrameStoreEntry));
+
+            m_header.indexOffset = m_size;
+            m_header.frameCount = m_index.size();
+            WriteAt(0, &m_header, sizeof(m_header));
+
+            // May fail while a reader maps the file, which only wastes the space
+            LARGE_INTEGER position;
+            position.QuadPart = (LONGLONG)(m_size + m_index.size() * sizeof(FrameStoreEntry));
+            if (SetFilePointerEx(m_file, position, nullptr, FILE_BEGIN))
+            {
+                SetEndOfFile(m_file);
+            }
+        }
+        catch (HRESULT)
+        {
+            // Without an index, readers walk the records
+        }
+
+        CloseHandle(m_file);
+        m_file = nullptr;
+    }
+
+    FrameStoreWriter::~FrameStoreWriter()
+    {
+        Close();
+    }
+
+    FrameStoreReader::FrameStoreReader(LPCWSTR path) :
+        m_file(nullptr),
+        m_mapping(nullptr),
+        m_view(nullptr),
+        m_fileSize(0),
+        m_width(0),
+        m_height(0)
+    {
+        // The writer may still have the file open
+        m_file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE)
+        {
+            m_file = nullptr;
+            throw HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        try
+        {
+            LARGE_INTEGER fileSize;
+            if (!GetFileSizeEx(m_file, &fileSize))
+            {
+                throw HRESULT_FROM_WIN32(GetLastError());
+            }
+
+            m_fileSize = (uint64_t)fileSize.QuadPart;
+            if (m_fileSize < sizeof(FrameStoreHeader) || m_fileSize > std::numeric_limits<size_t>::max())
+            {
+                throw E_FAIL;
+            }
+
+            m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!m_mapping)
+            {
+                throw HRESULT_FROM_WIN32(GetLastError());
+            }
+
+            m_view = static_cast<const BYTE*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0));
+            if (!m_view)
+            {
+                throw HRESULT_FROM_WIN32(GetLastError());
+            }
+
+            FrameStoreHeader header;
+            memcpy(&header, m_view, sizeof(header));
+            if (header.magic != FrameStoreHeader::s_magic || header.version != FrameStoreHeader::s_version)
+            {
+                throw E_FAIL;
+            }
+
+            m_width = header.width;
+            m_height = header.height;
+
+            if (!ReadIndex(header))
+            {
+                ScanRecords();
+            }
+        }
+        catch (HRESULT)
+        {
+            Release();
+            throw;
+        }
+
+        std::stable_sort(m_index.begin(), m_index.end(), [](const FrameStoreEntry& a, const FrameStoreEntry& b)
+        {
+            return a.number < b.number;
+        });
+    }
+
+    bool FrameStoreReader::ReadIndex(const FrameStoreHeader& header)
+    {
+        if (header.indexOffset == 0 || header.indexOffset > m_fileSize ||
+            header.frameCount > (m_fileSize - header.indexOffset) / sizeof(FrameStoreEntry))
+        {
+            return false;
+        }
+
+        std::vector<FrameStoreEntry> index((size_t)header.frameCount);
+        memcpy(index.data(), m_view + header.indexOffset, index.size() * sizeof(FrameStoreEntry));
+
+        for (auto& entry : index)
+        {
+            if (entry.offset > header.indexOffset || entry.size > header.indexOffset - entry.offset)
+            {
+                return false;
+            }
+        }
+
+        m_index = std::move(index);
+        return true;
+    }
+
+    void FrameStoreReader::ScanRecords()
+    {
+        uint64_t offset = sizeof(FrameStoreHeader);
+
+        while (m_fileSize - offset >= sizeof(FrameStoreRecord))
+        {
+            FrameStoreRecord record;
+            memcpy(&record, m_view + offset, sizeof(record));
+
+            // The preallocated space after the last record is zeroed
+            const uint64_t payload = offset + sizeof(FrameStoreRecord);
+            if (record.magic != FrameStoreRecord::s_magic || record.size > m_fileSize - payload)
+            {
+                break;
+            }
+
+            m_index.push_back({ payload, record.size, record.timestamp, record.number, 0 });
+            offset = payload + PaddedSize(record.size);
+
+            if (offset > m_fileSize)
+            {
+                break;
+            }
+        }
+    }
+
+    UINT FrameStoreReader::Width() const
+    {
+        return m_width;
+    }
+
+    UINT FrameStoreReader::Height() const
+    {
+        return m_height;
+    }
+
+    size_t FrameStoreReader::FrameCount() const
+    {
+        return m_index.size();
+    }
+
+    StoredFrame FrameStoreReader::Frame(size_t i) const
+    {
+        auto& entry = m_index[i];
+        return { m_view + entry.offset, (size_t)entry.size, entry.timestamp, entry.number };
+    }
+
+    std::vector<Timestamp> FrameStoreReader::Timestamps() const
+    {
+        std::vector<Timestamp> timestamps;
+        timestamps.reserve(m_index.size());
+
+        for (auto& entry : m_index)
+        {
+            timestamps.push_back(entry.timestamp);
+        }
+
+        return timestamps;
+    }
+
+    void FrameStoreReader::Release()
+    {
+        if (m_view)
+        {
+            UnmapViewOfFile(m_view);
+            m_view = nullptr;
+        }
+
+        if (m_mapping)
+        {
+            CloseHandle(m_mapping);
+            m_mapping = nullptr;
+        }
+
+        if (m_file)
+        {
+            CloseHandle(m_file);
+            m_file = nullptr;
+        }
+    }
+
+    FrameStoreReader::~FrameStoreReader()
+    {
+        Release();
+    }
+}
@@ -0,0 +1,151 @@
+#pragma once
+
+#include "pch.h"
+#include "image-data.h"
+
+namespace vgc
+{
+    /*
+     * The layout of a frame store file. All values are little endian.
+     *
+     * The file starts with a FrameStoreHeader, followed by one record per frame, in the
+     * order they were appended: a FrameStoreRecord, then the payload, padded to a
+     * multiple of 8 bytes. When the store is closed, an index with one FrameStoreEntry
+     * per frame follows the last record, and the header is updated to point to it.
+     */
+    struct FrameStoreHeader
+    {
+        // "VGCS" in the file
+        static constexpr uint32_t s_magic = 0x53434756;
+        static constexpr uint32_t s_version = 1;
+
+        uint32_t magic;
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+
+        // Zero until the store is closed
+        uint64_t indexOffset;
+        uint64_t frameCount;
+    };
+
+    struct FrameStoreRecord
+    {
+        // "VGCR" in the file
+        static constexpr uint32_t s_magic = 0x52434756;
+
+        uint32_t magic;
+        uint32_t number;
+        Timestamp timestamp;
+        uint64_t size;
+    };
+
+    struct FrameStoreEntry
+    {
+        // The offset of the payload in the file
+        uint64_t offset;
+        uint64_t size;
+        Timestamp timestamp;
+        uint32_t number;
+        uint32_t reserved;
+    };
+
+    /*
+     * Writes recorded frames to a single append-only file. Space is preallocated in
+     * large chunks, so appending a frame doesn't grow the file most of the time, and
+     * the frames of a recording aren't scattered across the disk. Frames may be
+     * appended from several threads, in any order: each one carries its number, and
+     * readers sort them by it.
+     */
+    class FrameStoreWriter
+    {
+        HANDLE m_file;
+        uint64_t m_size;
+        uint64_t m_allocatedSize;
+        FrameStoreHeader m_header;
+        std::vector<FrameStoreEntry> m_index;
+        std::mutex m_mutex;
+
+        void Reserve(uint64_t size);
+        void WriteAt(uint64_t offset, const void* data, size_t size);
+
+    public:
+        static constexpr uint64_t s_allocationChunk = 64ull << 20;
+
+        /*
+         * Creates the file, or replaces it. Throws an HRESULT on failure.
+         */
+        FrameStoreWriter(LPCWSTR path, UINT width, UINT height);
+        FrameStoreWriter(const FrameStoreWriter&) = delete;
+        FrameStoreWriter& operator= (const FrameStoreWriter&) = delete;
+
+        /*
+         * Appends the payload of a frame. The record is complete once this returns, so
+         * a reader opened afterwards finds it even if the store is never closed. Thread
+         * safe. Throws an HRESULT on failure.
+         */
+        void Append(UINT number, Timestamp timestamp, const BYTE* data, size_t size);
+
+        /*
+         * Writes the index, and releases the preallocated space after it. Nothing can be
+         * appended afterwards. It's also called by the destructor.
+         */
+        void Close();
+
+        ~FrameStoreWriter();
+    };
+
+    /*
+     * A frame of a FrameStoreReader. The payload points into the mapped file, and
+     * stays valid as long as the reader.
+     */
+    struct StoredFrame
+    {
+        const BYTE* data;
+        size_t size;
+        Timestamp timestamp;
+        UINT number;
+    };
+
+    /*
+     * Reads a file written by FrameStoreWriter through a read-only memory mapping, so
+     * payloads are used in place instead of being copied. Frames are sorted by number.
+     * If the store wasn't closed, e.g. because it's still being written or because
+     * the recording crashed, the frames are found by walking the records instead.
+     */
+    class FrameStoreReader
+    {
+        HANDLE m_file;
+        HANDLE m_mapping;
+        const BYTE* m_view;
+        uint64_t m_fileSize;
+        UINT m_width;
+        UINT m_height;
+        std::vector<FrameStoreEntry> m_index;
+
+        bool ReadIndex(const FrameStoreHeader& header);
+        void ScanRecords();
+        void Release();
+
+    public:
+        /*
+         * Opens and maps the file. Throws an HRESULT on failure, or E_FAIL if it isn't
+         * a frame store.
+         */
+        FrameStoreReader(LPCWSTR path);
+        FrameStoreReader(const FrameStoreReader&) = delete;
+        FrameStoreReader& operator= (const FrameStoreReader&) = delete;
+
+        UINT Width() const;
+        UINT Height() const;
+        size_t FrameCount() const;
+        StoredFrame Frame(size_t i) const;
+
+        /*
+         * Returns the timestamps of all frames, in order.
+         */
+        std::vector<Timestamp> Timestamps() const;
+
+        ~FrameStoreReader();
+    };
+}
@@ -0,0 +1,455 @@
+#include "gif-decoder.h"
+
+namespace vgc
+{
+    void DecompressLZW(const std::vector<BYTE>& data, UINT minCodeSize, std::vector<BYTE>& pixels)
+    {
+        // Every code stands for a string which was already written to the output, so
+        // the table only stores where. A string is then decoded with a single copy.
+        struct Entry
+        {
+            size_t offset;
+            size_t length;
+        };
+
+        std::vector<Entry> table(4096);
+
+        const UINT clearCode = 1u << minCodeSize;
+        const UINT endOfInput = clearCode + 1;
+        UINT codeSize = minCodeSize + 1;
+        UINT nextCode = clearCode + 2;
+
+        Entry previous{};
+        bool hasPrevious = false;
+
+        uint64_t bits = 0;
+        UINT bitCount = 0;
+        size_t bytePos = 0;
+
+        const size_t size = pixels.size();
+        size_t pos = 0;
+
+        while (pos < size)
+        {
+            while (bitCount < codeSize && bytePos < data.size())
+            {
+                bits |= (uint64_t)data[bytePos++] << bitCount;
+                bitCount += 8;
+            }
+
+            if (bitCount < codeSize)
+            {
+                break;
+            }
+
+            UINT code = (UINT)bits & ((1u << codeSize) - 1);
+            bits >>= codeSize;
+            bitCount -= codeSize;
+
+            if (code == clearCode)
+            {
+                codeSize = minCodeSize + 1;
+                nextCode = clearCode + 2;
+                hasPrevious = false;
+                continue;
+            }
+
+            if (code == endOfInput)
+            {
+                break;
+            }
+
+            Entry current{ pos, 0 };
+
+            if (code < clearCode)
+            {
+                pixels[pos] = (BYTE)code;
+                current.length = 1;
+            }
+            else if (code < nextCode)
+            {
+                const Entry& entry = table[code];
+                current.length = std::min(entry.length, size - pos);
+                memcpy(&pixels[pos], &pixels[entry.offset], current.length);
+            }
+            else if (code == nextCode && hasPrevious)
+            {
+                // The code which is being defined: the previous string and its first byte
+                current.length = std::min(previous.length + 1, size - pos);
+                memcpy(&pixels[pos], &pixels[previous.offset], std::min(previous.length, current.length));
+                if (current.length > previous.length)
+                {
+                    pixels[pos + previous.length] = pixels[previous.offset];
+                }
+            }
+            else
+            {
+                // Corrupted data
+                break;
+            }
+
+            if (hasPrevious && nextCode < 4096)
+            {
+                table[nextCode++] = Entry{ previous.offset, previous.length + 1 };
+
+                if (nextCode == 1u << codeSize && codeSize < 12)
+                {
+                    codeSize++;
+                }
+            }
+
+            previous = current;
+            hasPrevious = true;
+            pos += current.length;
+        }
+
+        std::fill(pixels.begin() + pos, pixels.end(), (BYTE)0);
+    }
+
+    GifDecoder::GifDecoder(size_t cacheCapacity) :
+        m_width(0),
+        m_height(0),
+        m_cacheCapacity(cacheCapacity),
+        m_useCounter(0)
+    {
+    }
+
+    void GifDecoder::ReadBytes(size_t offset, void* out, size_t size)
+    {
+        m_fileStream.clear();
+        m_fileStream.seekg(offset);
+        m_fileStream.read(reinterpret_cast<char*>(out), size);
+
+        if (!m_fileStream)
+        {
+            throw E_FAIL;
+        }
+    }
+
+    size_t GifDecoder::SkipSubBlocks(size_t offset)
+    {
+        BYTE length;
+
+        do
+        {
+            ReadBytes(offset, &length, 1);
+            offset += 1 + length;
+        } while (length);
+
+        return offset;
+    }
+
+    void GifDecoder::BuildIndex()
+    {
+        BYTE header[13];
+        ReadBytes(0, header, sizeof header);
+
+        if (memcmp(header, "GIF87a", 6) && memcmp(header, "GIF89a", 6))
+        {
+            throw E_FAIL;
+        }
+
+        m_width = header[6] | (header[7] << 8);
+        m_height = header[8] | (header[9] << 8);
+        size_t offset = sizeof header;
+
+        if (header[10] & 0x80)
+        {
+            m_globalPalette.resize(2ull << (header[10] & 7));
+            ReadBytes(offset, m_globalPalette.data(), 3 * m_globalPalette.size());
+            offset += 3 * m_globalPalette.size();
+        }
+
+        // Blocks following the header. A truncated frame ends the index.
+        try
+        {
+            FrameInfo frame;
+
+            while (1)
+            {
+                BYTE introducer;
+                ReadBytes(offset++, &introducer, 1);
+
+                if (introducer == 0x21)
+                {
+                    BYTE label;
+                    ReadBytes(offset++, &label, 1);
+
+                    if (label == 0xf9)
+                    {
+                        // Graphics control extension
+                        BYTE extension[5];
+                        ReadBytes(offset, extension, sizeof extension);
+
+                        frame.disposal = (extension[1] >> 2) & 7;
+                        frame.hasTransparency = extension[1] & 1;
+                        frame.delay = extension[2] | (extension[3] << 8);
+                        frame.transparentColor = extension[4];
+                    }
+
+                    offset = SkipSubBlocks(offset);
+                }
+                else if (introducer == 0x2c)
+                {
+                    BYTE descriptor[9];
+                    ReadBytes(offset, descriptor, sizeof descriptor);
+                    offset += sizeof descriptor;
+
+                    frame.left = descriptor[0] | (descriptor[1] << 8);
+                    frame.top = descriptor[2] | (descriptor[3] << 8);
+                    frame.width = descriptor[4] | (descriptor[5] << 8);
+                    frame.height = descriptor[6] | (descriptor[7] << 8);
+                    frame.interlaced = descriptor[8] & 0x40;
+
+                    if (descriptor[8] & 0x80)
+                    {
+                        frame.paletteOffset = offset;
+                        frame.paletteSize = 2u << (descriptor[8] & 7);
+                        offset += 3ull * frame.paletteSize;
+                    }
+
+                    ReadBytes(offset++, &frame.minCodeSize, 1);
+                    frame.dataOffset = offset;
+                    offset = SkipSubBlocks(offset);
+                    frame.dataSize = offset - frame.dataOffset;
+
+                    if (frame.minCodeSize == 0 || frame.minCodeSize > 11)
+                    {
+                        throw E_FAIL;
+                    }
+
+                    m_frames.push_back(frame);
+                    frame = FrameInfo{};
+                }
+                else
+                {
+                    // The trailer, or an unknown block
+                    break;
+                }
+            }
+        }
+        catch (HRESULT)
+        {
+        }
+    }
+
+    HRESULT GifDecoder::Open(LPCWSTR path)
+    {
+        if (!path)
+        {
+            return E_INVALIDARG;
+        }
+
+        m_fileStream.close();
+        m_fileStream.clear();
+        m_width = 0;
+        m_height = 0;
+        m_globalPalette.clear();
+        m_frames.clear();
+        m_cache.clear();
+
+        m_fileStream.open(path, std::ios::binary);
+        if (!m_fileStream)
+        {
+            return E_FAIL;
+        }
+
+        try
+        {
+            BuildIndex();
+        }
+        catch (HRESULT hr)
+        {
+            m_frames.clear();
+            return hr;
+        }
+
+        return S_OK;
+    }
+
+    void GifDecoder::DecodePixels(const FrameInfo& frame)
+    {
+        // Read all sub-blocks at once, then remove their length prefixes
+        m_blocks.resize(frame.dataSize);
+        ReadBytes(frame.dataOffset, m_blocks.data(), m_blocks.size());
+
+        m_lzwData.clear();
+        for (size_t pos = 0; pos < m_blocks.size() && m_blocks[pos]; pos += 1 + m_blocks[pos])
+        {
+            m_lzwData.insert(m_lzwData.end(), m_blocks.begin() + pos + 1, m_blocks.begin() + pos + 1 + m_blocks[pos]);
+        }
+
+        m_pixels.resize((size_t)frame.width * frame.height);
+        DecompressLZW(m_lzwData, frame.minCodeSize, m_pixels);
+    }
+
+    void GifDecoder::DrawFrame(ImageData& canvas, size_t index)
+    {
+        const FrameInfo& frame = m_frames[index];
+        DecodePixels(frame);
+
+        std::vector<PaletteColor> localPalette;
+        if (frame.paletteOffset)
+        {
+            localPalette.resize(frame.paletteSize);
+            ReadBytes(frame.paletteOffset, localPalette.data(), 3 * localPalette.size());
+        }
+
+        const auto& palette = frame.paletteOffset ? localPalette : m_globalPalette;
+
+        // The order in which interlaced rows are stored
+        const UINT passStart[] = { 0, 4, 2, 1 };
+        const UINT passStep[] = { 8, 8, 4, 2 };
+        UINT pass = 0, row = 0;
+
+        for (UINT i = 0; i < frame.height; i++)
+        {
+            if (frame.interlaced)
+            {
+                if (i > 0)
+                {
+                    row += passStep[pass];
+                }
+
+                while (row >= frame.height)
+                {
+                    pass++;
+                    row = passStart[pass];
+                }
+            }
+            else
+            {
+                row = i;
+            }
+
+            UINT y = frame.top + row;
+            if (y >= m_height)
+            {
+                continue;
+            }
+
+            const BYTE* source = &m_pixels[(size_t)i * frame.width];
+            BYTE* target = canvas[y];
+
+            for (UINT j = 0; j < frame.width && frame.left + j < m_width; j++)
+            {
+                BYTE colorIndex = source[j];
+                if (frame.hasTransparency && colorIndex == frame.transparentColor)
+                {
+                    continue;
+                }
+
+                PaletteColor color = colorIndex < palette.size() ? palette[colorIndex] : PaletteColor{};
+                BYTE* pixel = target + 4 * (frame.left + j);
+                pixel[0] = color.b;
+                pixel[1] = color.g;
+                pixel[2] = color.r;
+                pixel[3] = 255;
+            }
+        }
+    }
+
+    void GifDecoder::DisposeFrame(ImageData& canvas, ImageData* savedCanvas, size_t index)
+    {
+        const FrameInfo& frame = m_frames[index];
+
+        UINT left = std::min<UINT>(frame.left, m_width);
+        UINT right = std::min<UINT>(frame.left + frame.width, m_width);
+        UINT bottom = std::min<UINT>(frame.top + frame.height, m_height);
+
+        for (UINT y = frame.top; y < bottom; y++)
+        {
+            if (frame.disposal == 2)
+            {
+                // Restore to background, which we consider transparent
+                std::fill(canvas[y] + 4 * left, canvas[y] + 4 * right, (BYTE)0);
+            }
+            else if (frame.disposal == 3 && savedCanvas)
+            {
+                // Restore to previous
+                std::copy((*savedCanvas)[y] + 4 * left, (*savedCanvas)[y] + 4 * right, canvas[y] + 4 * left);
+            }
+        }
+    }
+
+    void GifDecoder::AddToCache(size_t index, const ImageData& canvas)
+    {
+        if (m_cacheCapacity == 0)
+        {
+            return;
+        }
+
+        auto& entry = m_cache.insert_or_assign(index, CachedCanvas{ canvas, 0 }).first->second;
+        entry.lastUse = ++m_useCounter;
+
+        if (m_cache.size() > m_cacheCapacity)
+        {
+            auto leastRecentlyUsed = std::min_element(m_cache.begin(), m_cache.end(), [](const auto& a, const auto& b)
+            {
+                return a.second.lastUse < b.second.lastUse;
+            });
+            m_cache.erase(leastRecentlyUsed);
+        }
+    }
+
+    HRESULT GifDecoder::ReadFrame(size_t index, ImageData& img)
+    {
+        if (index >= m_frames.size())
+        {
+            return E_INVALIDARG;
+        }
+
+        try
+        {
+            // Start from the closest cached canvas at or before the frame, or from
+            // an empty canvas.
+            ImageData canvas(m_width, m_height);
+            size_t start = 0;
+
+            auto cached = m_cache.upper_bound(index);
+            if (cached != m_cache.begin())
+            {
+                --cached;
+                start = cached->first;
+                canvas = cached->second.canvas;
+                cached->second.lastUse = ++m_useCounter;
+            }
+
+            std::unique_ptr<ImageData> savedCanvas;
+
+            for (size_t i = start; i <= index; i++)
+            {
+                if (m_frames[i].disposal == 3)
+                {
+                    savedCanvas = std::make_unique<ImageData>(canvas);
+                }
+
+                DrawFrame(canvas, i);
+
+                if (i == index)
+                {
+                    img = canvas;
+                }
+
+                DisposeFrame(canvas, savedCanvas.get(), i);
+
+                // Keep the canvas for the next frame for sequential reads, and keyframes
+                // for seeking
+                if (i == index || (i + 1) % s_keyframeInterval == 0)
+                {
+                    AddToCache(i + 1, canvas);
+                }
+            }
+        }
+        catch (std::bad_alloc)
+        {
+            return E_OUTOFMEMORY;
+        }
+        catch (HRESULT hr)
+        {
+            return hr;
+        }
+
+        return S_OK;
+    }
+}
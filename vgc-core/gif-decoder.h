@@ -0,0 +1,131 @@
+#pragma once
+
+#include "pch.h"
+#include "image-data.h"
+#include "quantization.h"
+
+namespace vgc
+{
+    /*
+     * Decodes GIF files into ImageData, one composited frame at a time.
+     *
+     * Open() reads only the block headers of the file, and builds an index of the byte
+     * offsets of all frames. ReadFrame() then seeks directly to the frames it needs.
+     * As a frame can depend on all frames before it (unchanged pixels are transparent in
+     * delta-encoded files), composited canvases are kept in a small LRU cache: every
+     * s_keyframeInterval-th frame, and the frame following the last one read, so both
+     * sequential playback and random seeks only decode a few frames.
+     *
+     * Concurrent access to a single GifDecoder object is not supported.
+     */
+    class GifDecoder
+    {
+        static constexpr size_t s_keyframeInterval = 16;
+
+        struct FrameInfo
+        {
+            // Byte offset of the first data sub-block, after the LZW minimum code size,
+            // and the size of all sub-blocks including the terminator
+            size_t dataOffset = 0;
+            size_t dataSize = 0;
+
+            // Byte offset of the local color table, or 0 if the frame uses the global one
+            size_t paletteOffset = 0;
+            UINT paletteSize = 0;
+
+            USHORT left = 0;
+            USHORT top = 0;
+            USHORT width = 0;
+            USHORT height = 0;
+            BYTE minCodeSize = 0;
+            bool interlaced = false;
+
+            // From the graphics control extension
+            USHORT delay = 0;
+            BYTE disposal = 0;
+            bool hasTransparency = false;
+            BYTE transparentColor = 0;
+        };
+
+        struct CachedCanvas
+        {
+            ImageData canvas;
+            uint64_t lastUse;
+        };
+
+        std::ifstream m_fileStream;
+        UINT m_width;
+        UINT m_height;
+        std::vector<PaletteColor> m_globalPalette;
+        std::vector<FrameInfo> m_frames;
+
+        // Canvases ready for drawing the frame with the given index, that is, with all
+        // previous frames drawn and disposed of.
+        std::map<size_t, CachedCanvas> m_cache;
+        size_t m_cacheCapacity;
+        uint64_t m_useCounter;
+
+        // Buffers reused between frames
+        std::vector<BYTE> m_blocks;
+        std::vector<BYTE> m_lzwData;
+        std::vector<BYTE> m_pixels;
+
+        void ReadBytes(size_t offset, void* out, size_t size);
+        size_t SkipSubBlocks(size_t offset);
+        void BuildIndex();
+        void DecodePixels(const FrameInfo& frame);
+        void DrawFrame(ImageData& canvas, size_t index);
+        void DisposeFrame(ImageData& canvas, ImageData* savedCanvas, size_t index);
+        void AddToCache(size_t index, const ImageData& canvas);
+
+    public:
+
+        /*
+         * The cache capacity is the number of composited canvases kept in memory.
+         */
+        GifDecoder(size_t cacheCapacity = 8);
+
+        /*
+         * Open the GIF file with the given path and index its frames. Returns E_FAIL if
+         * it isn't a GIF file. If the file is truncated, the complete frames are kept.
+         */
+        HRESULT Open(LPCWSTR path);
+
+        UINT Width() const
+        {
+            return m_width;
+        }
+
+        UINT Height() const
+        {
+            return m_height;
+        }
+
+        size_t FrameCount() const
+        {
+            return m_frames.size();
+        }
+
+        /*
+         * Returns the delay of the frame with the given index, in hundredths of a second.
+         */
+        USHORT FrameDelay(size_t index) const
+        {
+            return m_frames[index].delay;
+        }
+
+        /*
+         * Store the canvas as it is displayed after drawing the frame with the given
+         * index into the given ImageData object. Pixels which no frame covered so far
+         * are fully transparent.
+         */
+        HRESULT ReadFrame(size_t index, ImageData& img);
+    };
+
+    /*
+     * Decompresses GIF LZW data with the given minimum code size, which has already been
+     * taken out of its sub-blocks. Exactly pixels.size() pixels are written; any missing
+     * at the end of the data are set to 0.
+     */
+    void DecompressLZW(const std::vector<BYTE>& data, UINT minCodeSize, std::vector<BYTE>& pixels);
+}
@@ -2,6 +2,229 @@
 
 namespace vgc
 {
+	void WriteGifHeader(ByteBuffer& out, USHORT width, USHORT height, const std::vector<PaletteColor>& globalPalette)
+	{
+		BitStream bitStream([&](BYTE b) { out.push_back(b); });
+
+		// GIF Magic number
+		for (char c : std::string_view("GIF89a"))
+		{
+			bitStream << c;
+		}
+
+		// Image dimensions
+		bitStream << width << height;
+
+		if (globalPalette.empty())
+		{
+			// Dummy global palette
+			bitStream << '\xf0';
+			for (int i = 0; i < 8; i++)
+			{
+				bitStream << '\0';
+			}
+		}
+		else
+		{
+			// Global palette, with no background color and aspect ratio
+			UINT bits = 1;
+			while ((1u << bits) < globalPalette.size())
+			{
+				bits++;
+			}
+
+			bitStream << (BYTE)(0xef + bits) << '\0' << '\0';
+			for (auto color : globalPalette)
+			{
+				bitStream << color.r << color.g << color.b;
+			}
+		}
+
+		// Set up the animation
+		bitStream << '\x21' << '\xff' << '\x0b';
+		for (char c : std::string_view("NETSCAPE2.0"))
+		{
+			bitStream << c;
+		}
+		bitStream << '\x03' << '\x01' << '\0' << '\0' << '\0';
+	}
+
+	void WriteGifFrame(ByteBuffer& out, const QuantizationOutput& quantization, GifFrameRect rect, USHORT delay, const GifEncoderOptions& options)
+	{
+		BitStream bitStream([&](BYTE b) { out.push_back(b); });
+
+		// Graphics control extension header. The previous frame is not disposed of,
+		// so transparent pixels show it.
+		bitStream << '\x21' << '\xf9' << '\x04' << '\x05' << delay << quantization.transparentColor << '\0';
+
+		// Image descriptor block
+		bitStream << '\x2c';
+
+		// This sets up the (left, top) coordinate of the new portion
+		bitStream << rect.left << rect.top;
+
+		// This sets up the size
+		bitStream << rect.width << rect.height;
+
+		if (!options.globalPalette.empty() && quantization.palette == options.globalPalette)
+		{
+			// No local color table
+			bitStream << '\0';
+		}
+		else
+		{
+			// Color table size
+			bitStream << (BYTE)(0x7f + quantization.bitsPerPixel);
+
+			for (auto color : quantization.palette)
+			{
+				bitStream << color.r << color.g << color.b;
+			}
+		}
+
+		// LZW minimum code size, which GIF requires to be at least 2, even for
+		// palettes of 2 colors
+		const UINT codeSize = std::max(2u, quantization.bitsPerPixel);
+		bitStream << (BYTE)codeSize;
+
+		const bool parallel = options.parallelLzwMinPixels && quantization.pixels.size() >= options.parallelLzwMinPixels;
+		const auto compress = parallel ? CompressLZWBlocksParallel : CompressLZWBlocks;
+
+		if (options.lossyTolerance == 0)
+		{
+			compress(quantization.pixels, codeSize, out, options.lzwClearMode, nullptr);
+		}
+		else
+		{
+			auto substitutes = FindSimilarColors(quantization.palette, quantization.transparentColor, options.lossyTolerance);
+			compress(quantization.pixels, codeSize, out, options.lzwClearMode, &substitutes);
+		}
+		bitStream << '\0';
+	}
+
+	LzwSubstitutes FindSimilarColors(const std::vector<PaletteColor>& palette, BYTE transparentColor, UINT tolerance)
+	{
+		LzwSubstitutes substitutes(palette.size());
+		const UINT maxDistance = tolerance * tolerance;
+
+		auto distance = [&](size_t i, size_t j)
+		{
+			int dr = palette[i].r - palette[j].r;
+			int dg = palette[i].g - palette[j].g;
+			int db = palette[i].b - palette[j].b;
+			return (UINT)(dr * dr + dg * dg + db * db);
+		};
+
+		for (size_t i = 0; i < palette.size(); i++)
+		{
+			if (i == transparentColor)
+			{
+				continue;
+			}
+
+			for (size_t j = 0; j < palette.size(); j++)
+			{
+				if (j != i && j != transparentColor && distance(i, j) <= maxDistance)
+				{
+					substitutes[i].push_back((BYTE)j);
+				}
+			}
+
+			std::stable_sort(substitutes[i].begin(), substitutes[i].end(), [&](BYTE a, BYTE b)
+			{
+				return distance(i, a) < distance(i, b);
+			});
+		}
+
+		return substitutes;
+	}
+
+	void WriteGifTrailer(ByteBuffer& out)
+	{
+		out.push_back('\x3b');
+	}
+
+	GifFrameRect FindChangedRect(ImageView previous, ImageView current)
+	{
+		const UINT width = current.width;
+		const UINT height = current.height;
+		const size_t rowBytes = 4ull * width;
+
+		auto pixelsDiffer = [&](UINT row, UINT column)
+		{
+			return memcmp(previous[row] + 4ull * column, current[row] + 4ull * column, 4) != 0;
+		};
+
+		UINT top = 0;
+		while (top < height && memcmp(previous[top], current[top], rowBytes) == 0)
+		{
+			top++;
+		}
+
+		if (top == height)
+		{
+			return GifFrameRect{};
+		}
+
+		UINT bottom = height - 1;
+		while (memcmp(previous[bottom], current[bottom], rowBytes) == 0)
+		{
+			bottom--;
+		}
+
+		// Only the columns outside of the current horizontal bounds need to be checked
+		UINT left = width;
+		UINT right = 0;
+
+		for (UINT i = top; i <= bottom; i++)
+		{
+			for (UINT j = 0; j < left; j++)
+			{
+				if (pixelsDiffer(i, j))
+				{
+					left = j;
+					break;
+				}
+			}
+
+			for (UINT j = width - 1; j > right; j--)
+			{
+				if (pixelsDiffer(i, j))
+				{
+					right = j;
+					break;
+				}
+			}
+		}
+
+		// A single changed column leaves right below left
+		right = std::max(left, right);
+
+		return GifFrameRect{ (USHORT)left, (USHORT)top, (USHORT)(right - left + 1), (USHORT)(bottom - top + 1) };
+	}
+
+	ImageData CropImage(ImageView img, GifFrameRect rect)
+	{
+		return ImageData(img.Subview(rect.left, rect.top, rect.width, rect.height));
+	}
+
+	void MakeUnchangedPixelsTransparent(QuantizationOutput& quantization, ImageView previous, ImageView current, GifFrameRect rect)
+	{
+		for (UINT i = 0, k = 0; i < rect.height; i++)
+		{
+			auto previousRow = reinterpret_cast<const uint32_t*>(previous[(size_t)rect.top + i]) + rect.left;
+			auto currentRow = reinterpret_cast<const uint32_t*>(current[(size_t)rect.top + i]) + rect.left;
+
+			for (UINT j = 0; j < rect.width; j++, k++)
+			{
+				if (previousRow[j] == currentRow[j])
+				{
+					quantization.pixels[k] = quantization.transparentColor;
+				}
+			}
+		}
+	}
+
 	std::vector<USHORT> TimestampsToGifDelays(const std::vector<Timestamp>& timestamps, Timestamp stopTime)
 	{
 		if (timestamps.empty())
@@ -5,52 +5,365 @@
 #include "image-data.h"
 #include "quantization.h"
 #include "lzw.h"
+#include "resample.h"
 
 namespace vgc
 {
+    /*
+     * Options for SimpleGifEncoder and ParallelGifEncoder.
+     */
+    struct GifEncoderOptions
+    {
+        // Encode only the bounding rectangle of the pixels which changed since the previous
+        // frame. Unchanged pixels inside the rectangle are made transparent, and the
+        // previous frame is left in place underneath.
+        //
+        // Frames are compared with the previous input frame, not with the composited
+        // output, which rarely matches the input exactly once it's quantized. So an
+        // unchanged pixel keeps the color it was quantized to in an earlier frame, even
+        // if the palette changed since, or if dithering would now map it differently.
+        // Dithering only covers the changed rectangle, so its pattern may not line up
+        // with the pixels around it.
+        bool deltaFrames = false;
+
+        // When to clear the LZW dictionary. Deferred clearing keeps using a full dictionary
+        // while it compresses well.
+        LzwClearMode lzwClearMode = LzwClearMode::WhenFull;
+
+        // Lossy compression quality knob: the maximum distance in RGB space between the
+        // palette color of a pixel and the color encoded in its place, which lets the LZW
+        // encoder find longer matches. 0 means lossless. Transparent pixels are kept exact.
+        UINT lossyTolerance = 0;
+
+        // If not empty, this is written as the global color table, and frames quantized to
+        // exactly this palette are written without a local color table. Its size must be
+        // a power of two between 2 and 256. See PaletteBuilder and FixedPaletteQuantizer.
+        std::vector<PaletteColor> globalPalette;
+
+        // Drop the palette entries which a frame doesn't use, to write smaller color tables
+        // and LZW codes (see CompactPalette). Frames using the global palette are kept.
+        bool compactPalette = true;
+
+        // The filter used to resize frames whose size differs from the size of the GIF,
+        // so that large captures can be exported as smaller GIFs. Quantization and
+        // compression only see the resized frames. See ResizeImage.
+        ResampleFilter resampleFilter = ResampleFilter::Box;
+
+        // Maximum number of frames encoded ahead of the file writes by ParallelGifEncoder,
+        // or 0 to use the number of hardware threads.
+        UINT maxFramesInFlight = 0;
+
+        // Frames or changed rectangles of at least this many pixels are LZW-compressed in
+        // strips on separate threads, which makes them slightly larger (see
+        // CompressLZWBlocksParallel). This speeds up large frames, such as 1440p and 4K
+        // captures, which would otherwise be compressed on a single thread. 0 compresses
+        // every frame on a single thread.
+        UINT parallelLzwMinPixels = 1 << 21;
+    };
+
+    /*
+     * A rectangular region of the GIF canvas, covered by a single frame.
+     */
+    struct GifFrameRect
+    {
+        USHORT left = 0;
+        USHORT top = 0;
+        USHORT width = 0;
+        USHORT height = 0;
+    };
+
+    /*
+     * Append the GIF file header, the global palette (a dummy one if the given palette is
+     * empty) and the animation extension block to the given byte buffer.
+     */
+    void WriteGifHeader(ByteBuffer& out, USHORT width, USHORT height, const std::vector<PaletteColor>& globalPalette);
+
+    /*
+     * Append a frame covering the given rectangle to the given byte buffer: its graphics
+     * control extension, image descriptor, local color table and the LZW compressed pixels,
+     * divided into sub-blocks. The delay is given in hundredths of a second. The local
+     * color table is omitted if the frame's palette is options.globalPalette.
+     */
+    void WriteGifFrame(ByteBuffer& out, const QuantizationOutput& quantization, GifFrameRect rect, USHORT delay, const GifEncoderOptions& options);
+
+    /*
+     * Returns, for each palette index, the other indices whose colors are within the given
+     * distance of its color, closest first. The transparent color has no substitutes,
+     * and is never a substitute.
+     */
+    LzwSubstitutes FindSimilarColors(const std::vector<PaletteColor>& palette, BYTE transparentColor, UINT tolerance);
+
+    /*
+     * Append the GIF file trailer to the given byte buffer.
+     */
+    void WriteGifTrailer(ByteBuffer& out);
+
+    /*
+     * Returns the bounding rectangle of the pixels which differ between two images of
+     * the same size. If the images are equal, the returned rectangle is empty.
+     */
+    GifFrameRect FindChangedRect(ImageView previous, ImageView current);
+
+    /*
+     * Returns a copy of the given rectangle of the image.
+     */
+    ImageData CropImage(ImageView img, GifFrameRect rect);
+
+    /*
+     * Replace the quantized pixels of the given rectangle which are equal in both images
+     * with the transparent color, so the previous frame shows through.
+     */
+    void MakeUnchangedPixelsTransparent(QuantizationOutput& quantization, ImageView previous, ImageView current, GifFrameRect rect);
+
+    /*
+     * Returns the quantizer of the next frame of a sequence. Quantizers whose palette
+     * depends on the previous frames, such as TemporalQuantizer, have a ForFrame function,
+     * which is called with the whole frame, in frame order. Other quantizers are used
+     * as they are.
+     */
+    template<class Quantizer>
+    auto QuantizerForFrame(const Quantizer& quantizer, ImageView img)
+    {
+        if constexpr (requires { quantizer.ForFrame(img); })
+        {
+            return quantizer.ForFrame(img);
+        }
+        else
+        {
+            return std::cref(quantizer);
+        }
+    }
+
+    /*
+     * Quantize the image and append it to the given byte buffer as a GIF frame. If the
+     * previous image is given, only the region which changed since it is encoded (see
+     * GifEncoderOptions::deltaFrames). It's the previous input image, not the decoded
+     * GIF frame. Returns the encoded region.
+     */
+    template<class Quantizer>
+    GifFrameRect EncodeGifFrame(ByteBuffer& out, Quantizer& quantizer, ImageView img, const ImageData* previous, USHORT delay, const GifEncoderOptions& options)
+    {
+        if (!previous)
+        {
+            GifFrameRect rect{ 0, 0, (USHORT)img.width, (USHORT)img.height };
+            QuantizationOutput quantization = quantizer(img);
+            if (options.compactPalette && quantization.palette != options.globalPalette)
+            {
+                CompactPalette(quantization);
+            }
+            WriteGifFrame(out, quantization, rect, delay, options);
+            return rect;
+        }
+
+        GifFrameRect rect = FindChangedRect(*previous, img);
+
+        if (rect.width == 0)
+        {
+            // Nothing changed, but we still need a frame to keep the delay.
+            // It will consist of a single transparent pixel.
+            rect = GifFrameRect{ 0, 0, 1, 1 };
+        }
+
+        QuantizationOutput quantization = quantizer(img.Subview(rect.left, rect.top, rect.width, rect.height));
+        MakeUnchangedPixelsTransparent(quantization, *previous, img, rect);
+        if (options.compactPalette && quantization.palette != options.globalPalette)
+        {
+            CompactPalette(quantization);
+        }
+        WriteGifFrame(out, quantization, rect, delay, options);
+        return rect;
+    }
+
     /*
      * A straightforward, single-threaded implementation of the GIF standard.
      */
     template<class Quantizer>
     class SimpleGifEncoder
     {
-        struct FileStreamFunc
+        // The output is collected in memory and written to the file in large chunks.
+        static constexpr size_t s_flushThreshold = 1 << 22;
+
+        std::ofstream m_fileStream;
+        ByteBuffer m_buffer;
+        USHORT m_width;
+        USHORT m_height;
+        Quantizer m_quantizer;
+        GifEncoderOptions m_options;
+        bool m_finished;
+
+        // The previous input frame, only kept when encoding delta frames
+        ImageData m_previousFrame;
+        bool m_hasPreviousFrame;
+
+        void Flush()
+        {
+            m_fileStream.write(reinterpret_cast<const char*>(m_buffer.data()), m_buffer.size());
+            m_buffer.clear();
+        }
+
+    public:
+
+        /*
+         * Construct a new GIF encoder. It will record the Gif in a file with the given
+         * path. You must also specify the size of the Gif beforehand.
+         */
+        SimpleGifEncoder(const std::wstring filePath, UINT width, UINT height, GifEncoderOptions options = {}) :
+            SimpleGifEncoder(filePath, width, height, Quantizer(), std::move(options))
+        {
+        }
+
+        /*
+         * Construct a new GIF encoder which uses the given quantizer instance, e.g.
+         * a FixedPaletteQuantizer.
+         */
+        SimpleGifEncoder(const std::wstring filePath, UINT width, UINT height, Quantizer quantizer, GifEncoderOptions options = {}) :
+            m_fileStream(filePath, std::ios::binary),
+            m_width(width),
+            m_height(height),
+            m_quantizer(std::move(quantizer)),
+            m_options(std::move(options)),
+            m_finished(false),
+            m_previousFrame(0, 0),
+            m_hasPreviousFrame(false)
+        {
+            WriteGifHeader(m_buffer, m_width, m_height, m_options.globalPalette);
+        }
+
+        /*
+         * Add a frame to the GIF frame sequence, using the given delay.
+         * The delay is given in hundredths of a second, and it must be at least two,
+         * as most GIF viewers don't support the value 1.
+         * The frame is processed using the quantizer given as a template parameter.
+         * The image is only read during the call, so it may be a view of a mapped buffer.
+         * Images of a different size are first resized with options.resampleFilter.
+         */
+        void AddFrame(ImageView img, USHORT delay)
         {
-            std::ofstream& ofs;
+            if (!img.width || !img.height || m_finished)
+            {
+                // TODO log unexpected error?
+                return;
+            }
+
+            if (img.width != m_width || img.height != m_height)
+            {
+                AddFrame(ResizeImage(img, m_width, m_height, m_options.resampleFilter), delay);
+                return;
+            }
 
-            FileStreamFunc(std::ofstream& ofs) : ofs(ofs) {}
+            auto quantizer = QuantizerForFrame(m_quantizer, img);
+
+            if (!m_options.deltaFrames)
+            {
+                EncodeGifFrame(m_buffer, quantizer, img, nullptr, delay, m_options);
+            }
+            else if (!m_hasPreviousFrame)
+            {
+                EncodeGifFrame(m_buffer, quantizer, img, nullptr, delay, m_options);
+                m_previousFrame = ImageData(img);
+                m_hasPreviousFrame = true;
+            }
+            else
+            {
+                GifFrameRect rect = EncodeGifFrame(m_buffer, quantizer, img, &m_previousFrame, delay, m_options);
+
+                // Pixels outside of the changed rectangle are already equal
+                for (UINT i = rect.top; i < (UINT)rect.top + rect.height; i++)
+                {
+                    std::copy(img[i] + 4 * rect.left, img[i] + 4 * (rect.left + rect.width), m_previousFrame[i] + 4 * rect.left);
+                }
+            }
+
+            if (m_buffer.size() >= s_flushThreshold)
+            {
+                Flush();
+            }
+        }
 
-            void operator() (BYTE b)
+        /*
+         * Proclaim that there are no more frames to be written. This adds the GIF footer and
+         * closes the file stream. It's also called by the destructor. Calling it again
+         * does nothing.
+         */
+        void Finish()
+        {
+            if (!m_finished)
             {
-                ofs << b;
+                m_finished = true;
+                WriteGifTrailer(m_buffer);
+                Flush();
+                m_fileStream.close();
             }
-        };
+        }
 
+        ~SimpleGifEncoder()
+        {
+            Finish();
+        }
+    };
+
+    /*
+     * A GIF encoder with the same interface as SimpleGifEncoder, which quantizes and
+     * compresses frames on worker threads. Up to options.maxFramesInFlight frames are
+     * encoded ahead of the file writes; when that many frames are pending, AddFrame waits
+     * for the oldest one. Encoded frames are always written to the file in the order
+     * they were added.
+     *
+     * The quantizer's call operator is invoked concurrently from multiple threads. Its
+     * ForFrame function, if it has one, is called by AddFrame (see QuantizerForFrame).
+     *
+     * If a frame can't be encoded, e.g. for lack of memory, or the file can't be written,
+     * the error is kept and returned by Finish. That frame and the following ones are
+     * dropped, so the file holds the frames added before it.
+     */
+    template<class Quantizer>
+    class ParallelGifEncoder
+    {
         std::ofstream m_fileStream;
-        BitStream<FileStreamFunc> m_bitStream;
         USHORT m_width;
         USHORT m_height;
-        Quantizer m_quantizer{};
+        Quantizer m_quantizer;
+        GifEncoderOptions m_options;
+        size_t m_maxFramesInFlight;
+        std::deque<std::future<ByteBuffer>> m_pendingFrames;
+        HRESULT m_result;
         bool m_finished;
 
-        void WriteGifHeaders()
-        {
-            // GIF Magic number
-            m_fileStream << "GIF89a";
+        // The previous input frame, only kept when encoding delta frames
+        std::shared_ptr<const ImageData> m_previousFrame;
 
-            // Image dimensions
-            m_bitStream << m_width << m_height;
+        void Write(const ByteBuffer& bytes)
+        {
+            m_fileStream.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
 
-            // Dummy global palette
-            m_fileStream << '\xf0';
-            for (int i = 0; i < 8; i++)
+            if (!m_fileStream && SUCCEEDED(m_result))
             {
-                m_fileStream << '\0';
+                m_result = E_FAIL;
             }
+        }
+
+        // Waits for the oldest pending frame, and writes it unless an error occurred
+        void CommitOldestFrame()
+        {
+            auto pending = std::move(m_pendingFrames.front());
+            m_pendingFrames.pop_front();
 
-            // Set up the animation
-            m_fileStream << '\x21' << '\xff' << '\x0b' << "NETSCAPE2.0" << '\x03';
-            m_fileStream << '\x01' << '\0' << '\0' << '\0';
+            try
+            {
+                auto frame = pending.get();
+                if (SUCCEEDED(m_result))
+                {
+                    Write(frame);
+                }
+            }
+            catch (std::bad_alloc)
+            {
+                m_result = SUCCEEDED(m_result) ? E_OUTOFMEMORY : m_result;
+            }
+            catch (HRESULT hr)
+            {
+                m_result = SUCCEEDED(m_result) ? hr : m_result;
+            }
         }
 
     public:
@@ -59,80 +372,133 @@ namespace vgc
          * Construct a new GIF encoder. It will record the Gif in a file with the given
          * path. You must also specify the size of the Gif beforehand.
          */
-        SimpleGifEncoder(const std::wstring filePath, UINT width, UINT height) :
+        ParallelGifEncoder(const std::wstring filePath, UINT width, UINT height, GifEncoderOptions options = {}) :
+            ParallelGifEncoder(filePath, width, height, Quantizer(), std::move(options))
+        {
+        }
+
+        /*
+         * Construct a new GIF encoder which uses the given quantizer instance.
+         */
+        ParallelGifEncoder(const std::wstring filePath, UINT width, UINT height, Quantizer quantizer, GifEncoderOptions options = {}) :
             m_fileStream(filePath, std::ios::binary),
-            m_bitStream(FileStreamFunc(m_fileStream)),
             m_width(width),
             m_height(height),
+            m_quantizer(std::move(quantizer)),
+            m_options(std::move(options)),
+            m_maxFramesInFlight(m_options.maxFramesInFlight ? m_options.maxFramesInFlight : std::max(1u, std::thread::hardware_concurrency())),
+            m_result(S_OK),
             m_finished(false)
         {
-            WriteGifHeaders();
+            ByteBuffer header;
+            WriteGifHeader(header, m_width, m_height, m_options.globalPalette);
+            Write(header);
         }
 
         /*
-         * Add a frame to the GIF frame sequence, using the given delay.
-         * The delay is given in hundredths of a second, and it must be at least two,
-         * as most GIF viewers don't support the value 1.
-         * The frame is processed using the quantizer given as a template parameter.
+         * Add a frame to the GIF frame sequence, using the given delay. See SimpleGifEncoder::AddFrame.
+         * The image is copied, or resized, so the caller may reuse it as soon as this returns.
          */
-        void AddFrame(const ImageData& img, USHORT delay)
+        void AddFrame(ImageView img, USHORT delay)
         {
-            if (img.width != m_width || img.height != m_height || m_finished)
+            if (!img.width || !img.height || m_finished || FAILED(m_result))
             {
-                // TODO log unexpected error?
                 return;
             }
 
-            QuantizationOutput quantization = m_quantizer(img);
+            try
+            {
+                if (img.width != m_width || img.height != m_height)
+                {
+                    AddFrame(ResizeImage(img, m_width, m_height, m_options.resampleFilter), delay);
+                    return;
+                }
 
-            // Graphics control extension header
-            m_bitStream << '\x21' << '\xf9' << '\x04' << '\x05' << delay << '\0' << '\0';
+                AddFrame(ImageData(img), delay);
+            }
+            catch (std::bad_alloc)
+            {
+                m_result = E_OUTOFMEMORY;
+            }
+        }
 
-            // Image descriptor block
-            m_bitStream << '\x2c';
+        /*
+         * Add a frame to the GIF frame sequence, taking ownership of the image.
+         */
+        void AddFrame(ImageData&& img, USHORT delay)
+        {
+            // Empty images are ignored, as by the ImageView overload
+            if (!img.width || !img.height || m_finished || FAILED(m_result))
+            {
+                return;
+            }
 
-            // GIF allows us to only redraw a portion of the image, but we'll
-            // draw the entire canvas each time.
+            if (img.width != m_width || img.height != m_height)
+            {
+                try
+                {
+                    img = ResizeImage(img, m_width, m_height, m_options.resampleFilter);
+                }
+                catch (std::bad_alloc)
+                {
+                    m_result = E_OUTOFMEMORY;
+                    return;
+                }
+            }
 
-            // This sets up the (left, top) coordinate of the new portion
-            m_bitStream << (USHORT)0 << (USHORT)0;
+            if (m_pendingFrames.size() >= m_maxFramesInFlight)
+            {
+                CommitOldestFrame();
+                if (FAILED(m_result))
+                {
+                    return;
+                }
+            }
 
-            // This sets up the size
-            m_bitStream << m_width << m_height;
+            auto image = std::make_shared<const ImageData>(std::move(img));
+            auto previous = m_previousFrame;
+            auto quantizer = QuantizerForFrame(m_quantizer, *image);
 
-            // Color table size
-            m_bitStream << (BYTE)(0x7f + quantization.bitsPerPixel);
+            m_pendingFrames.push_back(std::async(std::launch::async, [this, image, previous, delay, quantizer]()
+            {
+                ByteBuffer frame;
+                EncodeGifFrame(frame, quantizer, *image, previous.get(), delay, m_options);
+                return frame;
+            }));
 
-            for (auto color : quantization.palette)
+            if (m_options.deltaFrames)
             {
-                m_bitStream << color.r << color.g << color.b;
+                m_previousFrame = image;
             }
-
-            // Bits per pixel, initialize the encoder/decoder
-            m_bitStream << (BYTE)(quantization.bitsPerPixel);
-
-            std::vector<BYTE> lzwOutput = CompressLZW(quantization.pixels, quantization.bitsPerPixel);
-            InsertByteLengthHeaders(lzwOutput);
-            m_fileStream.write(reinterpret_cast<char*>(lzwOutput.data()), lzwOutput.size());
-            m_bitStream << '\0';
         }
 
         /*
-         * Proclaim that there are no more frames to be written. This adds the GIF footer and
-         * closes the file stream. It's also called by the destructor. Calling it again
-         * does nothing.
+         * Wait for all pending frames, then add the GIF footer and close the file stream.
+         * It's also called by the destructor. Calling it again does nothing. Returns S_OK,
+         * or the first error: E_OUTOFMEMORY if a frame couldn't be encoded for lack of
+         * memory, or E_FAIL if the file couldn't be written.
          */
-        void Finish()
+        HRESULT Finish()
         {
             if (!m_finished)
             {
                 m_finished = true;
-                m_bitStream << '\x3b';
+
+                while (!m_pendingFrames.empty())
+                {
+                    CommitOldestFrame();
+                }
+
+                ByteBuffer trailer;
+                WriteGifTrailer(trailer);
+                Write(trailer);
                 m_fileStream.close();
             }
+
+            return m_result;
         }
 
-        ~SimpleGifEncoder()
+        ~ParallelGifEncoder()
         {
             Finish();
         }
@@ -2,8 +2,32 @@
 
 namespace vgc
 {
-    ImageData::ImageData(UINT width, UINT height) : width(width), height(height), buffer((size_t)4 * width * height)
+    ImageData::ImageData(UINT width, UINT height, Initialization initialization) :
+        width(width),
+        height(height),
+        buffer((size_t)4 * width * height)
     {
+        if (initialization == Zeroed)
+        {
+            std::fill(buffer.begin(), buffer.end(), (BYTE)0);
+        }
+    }
+
+    ImageData::ImageData(ImageView view) :
+        ImageData(view.width, view.height, Uninitialized)
+    {
+        const size_t rowBytes = 4ull * width;
+
+        if (view.pitch == rowBytes)
+        {
+            std::copy(view.data, view.data + rowBytes * height, buffer.data());
+            return;
+        }
+
+        for (UINT i = 0; i < height; i++)
+        {
+            std::copy(view[i], view[i] + rowBytes, (*this)[i]);
+        }
     }
 
     BYTE* ImageData::operator[] (SIZE_T row)
@@ -15,4 +39,9 @@ namespace vgc
     {
         return buffer.data() + row * width * 4;
     }
+
+    ImageView::ImageView(const ImageData& img) :
+        ImageView(img.buffer.data(), img.width, img.height, 4ull * img.width)
+    {
+    }
 }
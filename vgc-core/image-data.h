@@ -1,6 +1,8 @@
 #pragma once
 
 #include "pch.h"
+#include "frame-pool.h"
+#include "image-view.h"
 
 namespace vgc
 {
@@ -11,14 +13,31 @@ namespace vgc
      * top-down. Each row is a sequence of pixels, from the left to the right. Each
      * pixel consists of 4 bytes, in order, they represent Blue, Green, Red and Alpha
      * channels.
+     *
+     * Buffers come from FrameBufferPool, so images of the same size reuse the memory of
+     * released ones.
      */
     struct ImageData
     {
+        // Whether the pixels of a new image are set to 0, or left uninitialized for code
+        // which overwrites all of them
+        enum Initialization
+        {
+            Zeroed,
+            Uninitialized,
+        };
+
         UINT width = 0;
         UINT height = 0;
-        std::vector<BYTE> buffer;
+        std::vector<BYTE, FrameAllocator<BYTE>> buffer;
+
+        ImageData(UINT width, UINT height, Initialization initialization = Zeroed);
+
+        /*
+         * Copies the pixels of the given view into a tightly packed image.
+         */
+        explicit ImageData(ImageView view);
 
-        ImageData(UINT width, UINT height);
         BYTE* operator[] (SIZE_T row);
         const BYTE* operator[] (SIZE_T row) const;
     };
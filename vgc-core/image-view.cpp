@@ -0,0 +1,22 @@
+#include "image-view.h"
+
+namespace vgc
+{
+    ImageView::ImageView(const unsigned char* data, unsigned int width, unsigned int height, size_t pitch) :
+        data(data),
+        width(width),
+        height(height),
+        pitch(pitch)
+    {
+    }
+
+    const unsigned char* ImageView::operator[] (size_t row) const
+    {
+        return data + row * pitch;
+    }
+
+    ImageView ImageView::Subview(unsigned int left, unsigned int top, unsigned int width, unsigned int height) const
+    {
+        return ImageView((*this)[top] + 4ull * left, width, height, pitch);
+    }
+}
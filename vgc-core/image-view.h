@@ -0,0 +1,39 @@
+#pragma once
+
+// Unlike the other headers, this one doesn't include pch.h, so that code which only
+// reads pixels in memory can be built and tested without the Windows SDK. The types
+// are the ones behind BYTE, UINT and SIZE_T.
+#include <cstddef>
+
+namespace vgc
+{
+    struct ImageData;
+
+    /*
+     * A read-only view of BGRA pixels owned by someone else, such as an ImageData, a
+     * mapped texture or a memory-mapped file. Rows are pitch bytes apart, which may be
+     * more than 4 * width. Functions which only read an image take a view, so they can
+     * process such buffers in place instead of copying them into an ImageData first.
+     * The pixels must outlive the view.
+     */
+    struct ImageView
+    {
+        const unsigned char* data = nullptr;
+        unsigned int width = 0;
+        unsigned int height = 0;
+        size_t pitch = 0;
+
+        ImageView() = default;
+        ImageView(const unsigned char* data, unsigned int width, unsigned int height, size_t pitch);
+
+        // Defined with ImageData, in image-data.cpp
+        ImageView(const ImageData& img);
+
+        const unsigned char* operator[] (size_t row) const;
+
+        /*
+         * Returns a view of the given rectangle, which must lie within this view.
+         */
+        ImageView Subview(unsigned int left, unsigned int top, unsigned int width, unsigned int height) const;
+    };
+}
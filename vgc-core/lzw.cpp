@@ -1,6 +1,39 @@
 #include "lzw.h"
+#include "parallel.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define VGC_SSE2
+#endif
 
 namespace vgc {
+
+    size_t CountRun(const BYTE* data, size_t size, BYTE value)
+    {
+        size_t i = 0;
+
+#ifdef VGC_SSE2
+        const __m128i pattern = _mm_set1_epi8((char)value);
+
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            UINT mismatches = ~(UINT)_mm_movemask_epi8(_mm_cmpeq_epi8(block, pattern)) & 0xffff;
+
+            if (mismatches)
+            {
+                return i + std::countr_zero(mismatches);
+            }
+        }
+#endif
+
+        while (i < size && data[i] == value)
+        {
+            i++;
+        }
+
+        return i;
+    }
     
     /*
      * LZW class wrapper. Compresses the input byte sequence using the Lempel-Ziv-Welch algorithm,
@@ -18,15 +51,276 @@ namespace vgc {
         BitStream chunkBitStream([&](BYTE b) { lzwOutput.push_back(b); });
 
         // Compress the pixel sequence and write it out
-        LZW lzw([&](UINT num, UINT bits) { chunkBitStream.WriteBits(num, bits); }, bitDepth);
+        auto writeCode = [&](UINT num, UINT bits) { chunkBitStream.WriteBits(num, bits); };
+        LZW<decltype(writeCode), LzwHashDictionary> lzw(writeCode, bitDepth);
+        lzw.Append(inBytes.data(), inBytes.size());
 
-        for (auto byte : inBytes)
+        lzw.Finish();
+        chunkBitStream.Flush();
+        return lzwOutput;
+    }
+
+    /*
+     * Inserts the values into the LZW object. If substitutes are given, the compression
+     * is lossy (see CompressLZWBlocks).
+     */
+    template<class Lzw>
+    static void AppendValues(Lzw& lzw, const BYTE* values, size_t count, const LzwSubstitutes* substitutes)
+    {
+        if (!substitutes)
+        {
+            lzw.Append(values, count);
+            return;
+        }
+
+        for (size_t i = 0; i < count; i++)
         {
-            lzw += byte;
+            BYTE byte = values[i];
+
+            if (lzw.TryExtend(byte))
+            {
+                continue;
+            }
+
+            // The match can't be extended with the exact value, so look for a
+            // similar one which extends it, and end the match only if there's none.
+            bool extended = false;
+            for (auto substitute : (*substitutes)[byte])
+            {
+                if (lzw.TryExtend(substitute))
+                {
+                    extended = true;
+                    break;
+                }
+            }
+
+            if (!extended)
+            {
+                lzw += byte;
+            }
         }
+    }
+
+    template<class ResetPolicy>
+    static void CompressLZWBlocksWithPolicy(const std::vector<BYTE>& inBytes, UINT bitDepth, ByteBuffer& out, const LzwSubstitutes* substitutes)
+    {
+        SubBlockBitStream blockBitStream(out);
+
+        auto writeCode = [&](UINT num, UINT bits) { blockBitStream.WriteBits(num, bits); };
+        LZW<decltype(writeCode), LzwHashDictionary, ResetPolicy> lzw(writeCode, bitDepth);
+
+        AppendValues(lzw, inBytes.data(), inBytes.size(), substitutes);
 
         lzw.Finish();
-        chunkBitStream.Flush();
-        return lzwOutput;
+        blockBitStream.Finish();
+    }
+
+    /*
+     * Compresses the input byte sequence like CompressLZW, but the output is appended to
+     * the given buffer, already divided into GIF data sub-blocks (see SubBlockBitStream).
+     * The block terminator is not written. The clear mode selects the LZW reset policy.
+     *
+     * If substitutes are given, the compression is lossy: whenever the current match
+     * can't be extended with the next symbol, one of its substitutes which extends the
+     * match is encoded instead. This gives longer matches and fewer codes.
+     */
+    void CompressLZWBlocks(const std::vector<BYTE>& inBytes, UINT bitDepth, ByteBuffer& out, LzwClearMode clearMode, const LzwSubstitutes* substitutes)
+    {
+        if (clearMode == LzwClearMode::Deferred)
+        {
+            CompressLZWBlocksWithPolicy<LzwDeferredClear>(inBytes, bitDepth, out, substitutes);
+        }
+        else
+        {
+            CompressLZWBlocksWithPolicy<LzwClearWhenFull>(inBytes, bitDepth, out, substitutes);
+        }
+    }
+
+    // The LZW output of a part of the input, which generally doesn't end on a byte boundary
+    struct LzwStrip
+    {
+        std::vector<BYTE> bytes;
+
+        // Number of valid bits in the last byte, or 0 if it's complete
+        UINT tailBits = 0;
+    };
+
+    /*
+     * Splits the input into the given number of strips of about the same size, and
+     * compresses them on separate threads. Each strip starts with an empty dictionary.
+     * Every strip but the first continues after the clear code written by the previous
+     * one, so the code sizes line up at the seams, and only the last one is finished.
+     */
+    template<class ResetPolicy>
+    static std::vector<LzwStrip> CompressLZWStrips(const std::vector<BYTE>& inBytes, UINT bitDepth, size_t stripCount, const LzwSubstitutes* substitutes)
+    {
+        std::vector<LzwStrip> strips(stripCount);
+
+        ParallelForBands(stripCount, [&](size_t firstStrip, size_t endStrip)
+        {
+            for (size_t index = firstStrip; index < endStrip; index++)
+            {
+                size_t begin = inBytes.size() * index / stripCount;
+                size_t end = inBytes.size() * (index + 1) / stripCount;
+
+                LzwStrip& strip = strips[index];
+                BitStream bitStream([&](BYTE b) { strip.bytes.push_back(b); });
+
+                auto writeCode = [&](UINT num, UINT bits) { bitStream.WriteBits(num, bits); };
+                LZW<decltype(writeCode), LzwHashDictionary, ResetPolicy> lzw(writeCode, bitDepth, index == 0);
+
+                AppendValues(lzw, inBytes.data() + begin, end - begin, substitutes);
+
+                if (index + 1 == stripCount)
+                {
+                    lzw.Finish();
+                }
+                else
+                {
+                    lzw.Reset();
+                }
+
+                strip.tailBits = bitStream.Offset();
+                bitStream.Flush();
+            }
+        });
+
+        return strips;
+    }
+
+    static size_t StripBits(const LzwStrip& strip)
+    {
+        return 8 * strip.bytes.size() - (strip.tailBits ? 8 - strip.tailBits : 0);
+    }
+
+    /*
+     * Joins the strips into a single bit stream. They generally don't end on a byte
+     * boundary, so the following strips are shifted, 64 bits at a time. The unused bits
+     * of the last byte of each strip are zeros, as BitStream::Flush leaves them.
+     */
+    static std::vector<BYTE> JoinStrips(const std::vector<LzwStrip>& strips)
+    {
+        size_t totalBits = 0;
+        for (const LzwStrip& strip : strips)
+        {
+            totalBits += StripBits(strip);
+        }
+
+        // Each strip writes one byte past its end, which the next one starts with
+        std::vector<BYTE> joined((totalBits + 7) / 8 + 1);
+        size_t position = 0;
+
+        for (const LzwStrip& strip : strips)
+        {
+            const BYTE* bytes = strip.bytes.data();
+            const size_t size = strip.bytes.size();
+            const UINT shift = position % 8;
+            BYTE* dest = joined.data() + position / 8;
+
+            // The bits of the previous strip in the first byte
+            uint64_t carry = dest[0];
+            size_t i = 0;
+
+            for (; i + 8 <= size; i += 8)
+            {
+                uint64_t word;
+                memcpy(&word, bytes + i, 8);
+
+                uint64_t shifted = carry | word << shift;
+                memcpy(dest + i, &shifted, 8);
+                carry = shift ? word >> (64 - shift) : 0;
+            }
+
+            for (; i < size; i++)
+            {
+                UINT value = (UINT)carry | (UINT)bytes[i] << shift;
+                dest[i] = (BYTE)value;
+                carry = value >> 8;
+            }
+
+            dest[size] = (BYTE)carry;
+            position += StripBits(strip);
+        }
+
+        joined.resize((totalBits + 7) / 8);
+        return joined;
+    }
+
+    // The minimum number of symbols in each strip of CompressLZWBlocksParallel. Strips
+    // of this size span many dictionary clears anyway, so they make the output at most
+    // about 1.5% larger, on nearly flat frames, and a few tenths of a percent on others.
+    static constexpr size_t s_blockStripSize = 1 << 19;
+
+    template<class ResetPolicy>
+    static void CompressLZWBlocksParallelWithPolicy(const std::vector<BYTE>& inBytes, UINT bitDepth, ByteBuffer& out, size_t stripCount, const LzwSubstitutes* substitutes)
+    {
+        auto joined = JoinStrips(CompressLZWStrips<ResetPolicy>(inBytes, bitDepth, stripCount, substitutes));
+
+        // Divide the stream into sub-blocks, as SubBlockBitStream does
+        out.reserve(out.size() + joined.size() + (joined.size() + 254) / 255);
+
+        for (size_t i = 0; i < joined.size(); i += 255)
+        {
+            size_t blockSize = std::min(joined.size() - i, size_t(255));
+            out.push_back((BYTE)blockSize);
+            out.insert(out.end(), joined.begin() + i, joined.begin() + i + blockSize);
+        }
+    }
+
+    /*
+     * Compresses the input byte sequence like CompressLZWBlocks, splitting it into strips
+     * of at least s_blockStripSize symbols which are compressed on separate threads.
+     * Each strip starts with an empty dictionary, so the output is usually slightly larger
+     * than the output of CompressLZWBlocks. The strips only depend on the input size, so
+     * the output doesn't depend on the number of hardware threads. Inputs which make a
+     * single strip are passed to CompressLZWBlocks.
+     */
+    void CompressLZWBlocksParallel(const std::vector<BYTE>& inBytes, UINT bitDepth, ByteBuffer& out, LzwClearMode clearMode, const LzwSubstitutes* substitutes)
+    {
+        const size_t stripCount = inBytes.size() / s_blockStripSize;
+
+        if (stripCount <= 1)
+        {
+            CompressLZWBlocks(inBytes, bitDepth, out, clearMode, substitutes);
+        }
+        else if (clearMode == LzwClearMode::Deferred)
+        {
+            CompressLZWBlocksParallelWithPolicy<LzwDeferredClear>(inBytes, bitDepth, out, stripCount, substitutes);
+        }
+        else
+        {
+            CompressLZWBlocksParallelWithPolicy<LzwClearWhenFull>(inBytes, bitDepth, out, stripCount, substitutes);
+        }
+    }
+
+    /*
+     * Compresses the input byte sequence like CompressLZW, splitting it into strips which
+     * are compressed on separate threads. Each strip starts with an empty dictionary,
+     * so the output is usually slightly larger than the output of CompressLZW.
+     * Parameters:
+     * * inBytes - a vector of bytes, each byte should have value between 0 and 2^bitDepth - 1
+     * * bitDepth - the number of bits in each code word - a number between 1 and 8.
+     * * stripCount - the number of strips, or 0 to use one strip per hardware thread.
+     * Returns the compressed byte sequence, in the same format as CompressLZW. GIF frames
+     * use CompressLZWBlocksParallel instead.
+     */
+    std::vector<BYTE> CompressLZWParallel(const std::vector<BYTE>& inBytes, UINT bitDepth, UINT stripCount)
+    {
+        // Smaller strips don't make up for the thread startup and the dictionary resets
+        const size_t minStripSize = 1 << 16;
+
+        if (stripCount == 0)
+        {
+            stripCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        stripCount = (UINT)std::clamp(inBytes.size() / minStripSize, size_t(1), size_t(stripCount));
+
+        if (stripCount == 1)
+        {
+            return CompressLZW(inBytes, bitDepth);
+        }
+
+        return JoinStrips(CompressLZWStrips<LzwClearWhenFull>(inBytes, bitDepth, stripCount, nullptr));
     }
 }
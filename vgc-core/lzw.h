@@ -6,21 +6,11 @@
 namespace vgc
 {
     /*
-     * Compresses the input byte sequence using the Lempel-Ziv-Welch algorithm,
-     * adapted for use with the Graphics Interchange Format (GIF).
-     * Construct this with two arguments:
-     * * func - A function which receievs two arguments:
-     * * * the produced code word (as a UINT)
-     * * * the length of the code word (as a UINT)
-     * * bitDepth - the number of bits in each code word - a number between 1 and 8.
-     * After construction, call the += operator to insert a codeword.
-     * The compression footer will be added after calling Finish() or when the
-     * destructor is invoked.
-     *
-     * Concurrent access to a single LZW object is not supported.
+     * LZW dictionary which stores the code tree as an array of nodes, each holding
+     * the destination codes for all 256 possible labels. A lookup is a single array
+     * access, but a full dictionary takes about 2 MB and clearing it touches every node.
      */
-    template<class CodewordFunc>
-    class LZW
+    class LzwTreeDictionary
     {
         struct CodeTreeNode {
             USHORT next[256];
@@ -36,12 +26,272 @@ namespace vgc
             }
         };
 
+        // The code tree, stored as an array for efficiency.
+        std::vector<CodeTreeNode> m_codeTree;
+
+    public:
+
+        /*
+         * Returns the code reached from the given code by appending the given label,
+         * or 0 if there is no such code.
+         */
+        USHORT Find(UINT source, BYTE label) const
+        {
+            return m_codeTree[source].next[label];
+        }
+
+        /*
+         * Adds a new code to the dictionary. Codes must be added in increasing order.
+         */
+        void Insert(UINT source, BYTE label, USHORT destination)
+        {
+            m_codeTree[source].next[label] = destination;
+            m_codeTree.emplace_back();
+        }
+
+        /*
+         * Removes all codes from the dictionary, leaving the given number of empty
+         * root codes.
+         */
+        void Clear(UINT usedCodes)
+        {
+            m_codeTree.resize(usedCodes);
+            for (auto& node : m_codeTree)
+            {
+                node.Clear();
+            }
+        }
+    };
+
+    /*
+     * LZW dictionary which stores the (code, label) -> code edges in an open-addressed
+     * hash table with linear probing. The whole table takes 64 KB, so it stays in the
+     * L2 cache. Each slot is tagged with the generation in which it was written, which
+     * makes clearing the dictionary O(1): bumping the generation invalidates every slot.
+     */
+    class LzwHashDictionary
+    {
+        // 8192 slots keep the load factor at or below 1/2 for the 4096 GIF codes.
+        static constexpr UINT s_tableBits = 13;
+        static constexpr UINT s_tableMask = (1u << s_tableBits) - 1;
+
+        struct Slot
+        {
+            uint32_t key;
+            USHORT code;
+            USHORT generation;
+        };
+
+        std::vector<Slot> m_slots;
+
+        // Slots with a different generation are considered empty.
+        USHORT m_generation;
+
+        static uint32_t Key(UINT source, BYTE label)
+        {
+            return (source << 8) | label;
+        }
+
+        static UINT Hash(uint32_t key)
+        {
+            // Fibonacci hashing, keeping the highest bits of the product
+            return (key * 2654435761u) >> (32 - s_tableBits);
+        }
+
+    public:
+
+        LzwHashDictionary() : m_slots(1u << s_tableBits, Slot{}), m_generation(1) {}
+
+        /*
+         * Returns the code reached from the given code by appending the given label,
+         * or 0 if there is no such code.
+         */
+        USHORT Find(UINT source, BYTE label) const
+        {
+            uint32_t key = Key(source, label);
+
+            for (UINT i = Hash(key);; i = (i + 1) & s_tableMask)
+            {
+                const Slot& slot = m_slots[i];
+
+                if (slot.generation != m_generation)
+                {
+                    return 0;
+                }
+
+                if (slot.key == key)
+                {
+                    return slot.code;
+                }
+            }
+        }
+
+        /*
+         * Adds a new code to the dictionary. The (source, label) pair must not be
+         * present in the dictionary already.
+         */
+        void Insert(UINT source, BYTE label, USHORT destination)
+        {
+            uint32_t key = Key(source, label);
+            UINT i = Hash(key);
+
+            while (m_slots[i].generation == m_generation)
+            {
+                i = (i + 1) & s_tableMask;
+            }
+
+            m_slots[i] = Slot{ key, destination, m_generation };
+        }
+
+        /*
+         * Removes all codes from the dictionary. The number of root codes is implicit,
+         * as they're never stored in the table.
+         */
+        void Clear(UINT)
+        {
+            if (++m_generation == 0)
+            {
+                // The generation counter wrapped around, so old slots could look valid again.
+                std::fill(m_slots.begin(), m_slots.end(), Slot{});
+                m_generation = 1;
+            }
+        }
+    };
+
+    /*
+     * Returns the number of leading elements of the array which are equal to the value.
+     * Vectorized with SSE2 where available.
+     */
+    size_t CountRun(const BYTE* data, size_t size, BYTE value);
+
+    /*
+     * LZW reset policy which clears the dictionary as soon as it's full.
+     */
+    struct LzwClearWhenFull
+    {
+        static constexpr bool s_freezeWhenFull = false;
+
+        void Reset() {}
+
+        bool Update(UINT, UINT, bool)
+        {
+            return false;
+        }
+    };
+
+    /*
+     * LZW reset policy which keeps using the full dictionary without adding new codes
+     * (the GIF "deferred clear"). The compression ratio of the frozen dictionary is
+     * measured over windows of windowSize input symbols, and the dictionary is cleared
+     * as soon as a window compresses worse than the dictionary did, on average, while
+     * it was being built.
+     */
+    class LzwDeferredClear
+    {
+        UINT m_windowSize;
+
+        // Input symbols and output bits of the current window, or since the last clear
+        // while the dictionary isn't full
+        UINT m_symbols;
+        UINT m_bits;
+
+        // Output bits per input symbol while the dictionary was being built
+        double m_referenceRatio;
+
+    public:
+        static constexpr bool s_freezeWhenFull = true;
+
+        LzwDeferredClear(UINT windowSize = 256) :
+            m_windowSize(windowSize)
+        {
+            Reset();
+        }
+
+        void Reset()
+        {
+            m_symbols = 0;
+            m_bits = 0;
+            m_referenceRatio = 0;
+        }
+
+        /*
+         * Called for each written code, with the number of input symbols it represents,
+         * its length in bits and whether the dictionary is full. Returns true if the full
+         * dictionary should be cleared.
+         */
+        bool Update(UINT symbols, UINT bits, bool full)
+        {
+            m_symbols += symbols;
+            m_bits += bits;
+
+            if (!full)
+            {
+                return false;
+            }
+
+            if (m_referenceRatio == 0)
+            {
+                // The dictionary just became full
+                m_referenceRatio = (double)m_bits / m_symbols;
+                m_symbols = 0;
+                m_bits = 0;
+                return false;
+            }
+
+            if (m_symbols < m_windowSize)
+            {
+                return false;
+            }
+
+            double ratio = (double)m_bits / m_symbols;
+            m_symbols = 0;
+            m_bits = 0;
+            return ratio > m_referenceRatio;
+        }
+    };
+
+    /*
+     * Compresses the input byte sequence using the Lempel-Ziv-Welch algorithm,
+     * adapted for use with the Graphics Interchange Format (GIF).
+     * Construct this with two arguments:
+     * * func - A function which receievs two arguments:
+     * * * the produced code word (as a UINT)
+     * * * the length of the code word (as a UINT)
+     * * bitDepth - the number of bits in each code word - a number between 1 and 8.
+     * After construction, call the += operator to insert a codeword, or Append to insert
+     * a whole array of them. Append follows runs of equal values along the dictionary
+     * in bulk, but its output is identical.
+     * The compression footer will be added after calling Finish() or when the
+     * destructor is invoked.
+     *
+     * The dictionary engine is chosen with the second template parameter. It can be
+     * LzwTreeDictionary or LzwHashDictionary; both produce identical output.
+     * The third template parameter decides what happens when the dictionary is full,
+     * it can be LzwClearWhenFull or LzwDeferredClear.
+     *
+     * Concurrent access to a single LZW object is not supported.
+     */
+    template<class CodewordFunc, class Dictionary = LzwTreeDictionary, class ResetPolicy = LzwClearWhenFull>
+    class LZW
+    {
         // The callback which receives the new code word.
         CodewordFunc m_func;
 
         // Current position in the dictionary tree, or -1 if it's undefined.
         int m_treePos;
 
+        // Number of input symbols represented by m_treePos.
+        UINT m_matchLength;
+
+        // If the current match is a run of a single value, that value and the length
+        // of the run (equal to m_matchLength). Otherwise, m_runLength is 0.
+        BYTE m_runValue;
+        UINT m_runLength;
+
+        // For each value, the codes of the runs of it which are in the dictionary:
+        // m_runCodes[value][k] is the code of value repeated k + 1 times.
+        std::vector<std::vector<USHORT>> m_runCodes;
+
         // Number of bits in each sample in the input stream
         const UINT m_bitDepth;
 
@@ -51,8 +301,11 @@ namespace vgc
         // Number of used code words = size of the code tree.
         UINT m_usedCodes;
 
-        // The code tree, stored as an array for efficiency.
-        std::vector<CodeTreeNode> m_codeTree;
+        // Maps (code, label) pairs to longer codes.
+        Dictionary m_dictionary;
+
+        // Decides when a full dictionary is cleared.
+        ResetPolicy m_resetPolicy;
 
         // Whether we finished the encoding. Used to stop the destructor
         // from adding the compression footer if Finish() is called. 
@@ -60,12 +313,7 @@ namespace vgc
 
         USHORT Next(int source, int label)
         {
-            return m_codeTree[source].next[label];
-        }
-
-        bool HasNext(int source, int label)
-        {
-            return Next(source, label) != 0;
+            return m_dictionary.Find(source, label);
         }
 
         UINT CodewordClear()
@@ -81,70 +329,211 @@ namespace vgc
         void ClearDictionary()
         {
             m_func(CodewordClear(), m_codeSize);
+            ResetDictionary();
+        }
+
+        void ResetDictionary()
+        {
             m_codeSize = m_bitDepth + 1;
             m_usedCodes = CodewordEndOfInput() + 1;
 
-            m_codeTree.resize(m_usedCodes);
-            for (auto& node : m_codeTree)
+            m_dictionary.Clear(m_usedCodes);
+            m_resetPolicy.Reset();
+
+            m_runCodes.resize(1ull << m_bitDepth);
+            for (UINT value = 0; value < m_runCodes.size(); value++)
             {
-                node.Clear();
+                m_runCodes[value].assign(1, (USHORT)value);
             }
 
             m_treePos = -1;
+            m_runLength = 0;
         }
 
-        UINT CreateCode()
+        UINT CreateCode(int source, int label)
         {
-            m_codeTree.emplace_back();
+            if (m_runLength && m_runValue == label)
+            {
+                // The new code extends the longest known run of the label
+                m_runCodes[label].push_back((USHORT)m_usedCodes);
+            }
+
+            m_dictionary.Insert(source, label, m_usedCodes);
             return m_usedCodes++;
         }
 
-        void SetDestination(int source, int label, USHORT destination)
+        void StartMatch(BYTE value)
         {
-            m_codeTree[source].next[label] = destination;
+            m_treePos = value;
+            m_matchLength = 1;
+            m_runValue = value;
+            m_runLength = 1;
+        }
+
+        void ExtendMatch(USHORT next, BYTE value)
+        {
+            m_treePos = next;
+            m_matchLength++;
+            m_runLength = m_runLength && m_runValue == value ? m_runLength + 1 : 0;
+        }
+
+        // Writes out the current match, which can't be extended with the value,
+        // and starts a new one with it.
+        void EndMatch(BYTE value)
+        {
+            m_func((UINT)m_treePos, m_codeSize);
+
+            bool full = m_usedCodes == 4096;
+            bool clear = m_resetPolicy.Update(m_matchLength, m_codeSize, full);
+
+            if (!full)
+            {
+                UINT destination = CreateCode(m_treePos, value);
+
+                if (destination == 1u << m_codeSize)
+                {
+                    m_codeSize++;
+                }
+
+                if (m_usedCodes == 4096 && !ResetPolicy::s_freezeWhenFull)
+                {
+                    ClearDictionary();
+                }
+            }
+            else if (clear)
+            {
+                // The dictionary is frozen, and it stopped compressing well
+                ClearDictionary();
+            }
+
+            StartMatch(value);
+        }
+
+        // Writes out the current match before a clear code. Decoders add a code when
+        // they read it, the one the encoder created last, and they widen the codes if it
+        // fills the current size, so the clear code must be written at the new size.
+        void WritePendingCode()
+        {
+            m_func((UINT)m_treePos, m_codeSize);
+
+            if (m_usedCodes == 1u << m_codeSize && m_codeSize < 12)
+            {
+                m_codeSize++;
+            }
         }
 
     public:
 
-        LZW(CodewordFunc func, UINT bitDepth) :
+        /*
+         * If writeClear is false, the leading clear code is omitted. This is used when the
+         * output is appended to a stream which already ends with a clear code (see Reset).
+         */
+        LZW(CodewordFunc func, UINT bitDepth, bool writeClear = true, ResetPolicy resetPolicy = ResetPolicy()) :
             m_func(func),
             m_treePos(-1),
+            m_matchLength(0),
+            m_runValue(0),
+            m_runLength(0),
             m_bitDepth(bitDepth),
+            m_codeSize(bitDepth + 1),
+            m_resetPolicy(resetPolicy),
             m_finished(false)
         {
-            ClearDictionary();
+            if (writeClear)
+            {
+                ClearDictionary();
+            }
+            else
+            {
+                ResetDictionary();
+            }
         }
 
         LZW& operator+= (BYTE value)
         {
             if (m_treePos == -1)
             {
-                m_treePos = value;
+                StartMatch(value);
             }
-            else if (HasNext(m_treePos, value))
+            else if (USHORT next = Next(m_treePos, value))
             {
-                m_treePos = Next(m_treePos, value);
+                ExtendMatch(next, value);
             }
             else
             {
-                m_func((UINT)m_treePos, m_codeSize);
-                UINT destination = CreateCode();
-                SetDestination(m_treePos, value, destination);
+                EndMatch(value);
+            }
 
-                if (destination == 1u << m_codeSize)
-                {
-                    m_codeSize++;
-                }
+            return *this;
+        }
+
+        /*
+         * Insert the given values, in order. Equivalent to calling the += operator for
+         * each of them.
+         */
+        void Append(const BYTE* values, size_t count)
+        {
+            size_t i = 0;
 
-                if (m_usedCodes == 4096)
+            while (i < count)
+            {
+                BYTE value = values[i];
+
+                if (m_runLength && value == m_runValue)
                 {
-                    ClearDictionary();
+                    // The match is a run, and it continues in the input. Skip to the longest
+                    // run of the value in the dictionary, as far as the input allows.
+                    const auto& runCodes = m_runCodes[value];
+                    size_t known = runCodes.size() - m_runLength;
+
+                    if (known)
+                    {
+                        size_t step = CountRun(values + i, std::min(known, count - i), value);
+                        m_runLength += (UINT)step;
+                        m_matchLength += (UINT)step;
+                        m_treePos = runCodes[m_runLength - 1];
+                        i += step;
+                        continue;
+                    }
                 }
 
-                m_treePos = value;
+                *this += value;
+                i++;
             }
+        }
 
-            return *this;
+        /*
+         * Append the value to the current match if the dictionary has a code for the
+         * result, and return true. Otherwise, nothing is changed and false is returned.
+         * Used by the lossy mode to try substitutes for a value.
+         */
+        bool TryExtend(BYTE value)
+        {
+            if (m_treePos == -1)
+            {
+                return false;
+            }
+
+            if (USHORT next = Next(m_treePos, value))
+            {
+                ExtendMatch(next, value);
+                return true;
+            }
+
+            return false;
+        }
+
+        /*
+         * Write out the pending code followed by a clear code. The following input
+         * is encoded using an empty dictionary, with the initial code size.
+         */
+        void Reset()
+        {
+            if (!m_finished && m_treePos != -1)
+            {
+                WritePendingCode();
+                ClearDictionary();
+            }
         }
 
         void Finish()
@@ -152,7 +541,7 @@ namespace vgc
             if (!m_finished && m_treePos != -1)
             {
                 m_finished = true;
-                m_func((UINT)m_treePos, m_codeSize);
+                WritePendingCode();
                 m_func(CodewordClear(), m_codeSize);
                 m_func(CodewordEndOfInput(), m_bitDepth + 1);
             }
@@ -165,4 +554,28 @@ namespace vgc
     };
 
     std::vector<BYTE> CompressLZW(const std::vector<BYTE>& inBytes, UINT bitDepth);
+
+    /*
+     * Selects the LZW reset policy used by CompressLZWBlocks.
+     */
+    enum class LzwClearMode
+    {
+        // See LzwClearWhenFull
+        WhenFull,
+
+        // See LzwDeferredClear
+        Deferred
+    };
+
+    /*
+     * For each symbol, the other symbols which the lossy LZW mode may encode in its
+     * place, closest first.
+     */
+    using LzwSubstitutes = std::vector<std::vector<BYTE>>;
+
+    void CompressLZWBlocks(const std::vector<BYTE>& inBytes, UINT bitDepth, ByteBuffer& out, LzwClearMode clearMode = LzwClearMode::WhenFull, const LzwSubstitutes* substitutes = nullptr);
+
+    void CompressLZWBlocksParallel(const std::vector<BYTE>& inBytes, UINT bitDepth, ByteBuffer& out, LzwClearMode clearMode = LzwClearMode::WhenFull, const LzwSubstitutes* substitutes = nullptr);
+
+    std::vector<BYTE> CompressLZWParallel(const std::vector<BYTE>& inBytes, UINT bitDepth, UINT stripCount = 0);
 }
@@ -0,0 +1,388 @@
+#include "quantization.h"
+#include "parallel.h"
+#include <array>
+
+namespace vgc
+{
+    /*
+     * The NeuQuant network. The constants and the structure of the algorithm follow
+     * the original implementation; see "Kohonen neural networks for optimal colour
+     * quantization" by Anthony Dekker, 1994.
+     */
+    class NeuQuantNetwork
+    {
+        // Index 0 of the palette is reserved for the transparent color
+        static constexpr int s_netSize = 255;
+
+        // Primes near 500, used to step through the image while sampling it
+        static constexpr int s_primes[] = { 499, 491, 487, 503 };
+
+        static constexpr int s_cycles = 100;
+
+        static constexpr int s_netBiasShift = 4;
+        static constexpr int s_intBiasShift = 16;
+        static constexpr int s_intBias = 1 << s_intBiasShift;
+        static constexpr int s_gammaShift = 10;
+        static constexpr int s_betaShift = 10;
+        static constexpr int s_beta = s_intBias >> s_betaShift;
+        static constexpr int s_betaGamma = s_intBias << (s_gammaShift - s_betaShift);
+
+        static constexpr int s_initRad = s_netSize >> 3;
+        static constexpr int s_radiusBiasShift = 6;
+        static constexpr int s_radiusBias = 1 << s_radiusBiasShift;
+        static constexpr int s_initRadius = s_initRad * s_radiusBias;
+        static constexpr int s_radiusDec = 30;
+
+        static constexpr int s_alphaBiasShift = 10;
+        static constexpr int s_initAlpha = 1 << s_alphaBiasShift;
+        static constexpr int s_radBiasShift = 8;
+        static constexpr int s_radBias = 1 << s_radBiasShift;
+        static constexpr int s_alphaRadBias = 1 << (s_alphaBiasShift + s_radBiasShift);
+
+        // b, g, r, and the original neuron index after sorting
+        std::array<int, 4> m_network[s_netSize];
+
+        // First neuron with each green value, after sorting by green
+        int m_netIndex[256];
+
+        int m_bias[s_netSize];
+        int m_freq[s_netSize];
+        int m_radPower[s_initRad];
+
+        int Contest(int b, int g, int r)
+        {
+            // Finds the closest neuron, and the closest one with the bias applied, which
+            // favors neurons that rarely win. Updates the frequencies and biases.
+            int bestDistance = std::numeric_limits<int>::max();
+            int bestBiasDistance = bestDistance;
+            int bestPos = -1;
+            int bestBiasPos = -1;
+
+            for (int i = 0; i < s_netSize; i++)
+            {
+                int* n = m_network[i].data();
+                int distance = std::abs(n[0] - b) + std::abs(n[1] - g) + std::abs(n[2] - r);
+
+                if (distance < bestDistance)
+                {
+                    bestDistance = distance;
+                    bestPos = i;
+                }
+
+                int biasDistance = distance - (m_bias[i] >> (s_intBiasShift - s_netBiasShift));
+                if (biasDistance < bestBiasDistance)
+                {
+                    bestBiasDistance = biasDistance;
+                    bestBiasPos = i;
+                }
+
+                int betaFreq = m_freq[i] >> s_betaShift;
+                m_freq[i] -= betaFreq;
+                m_bias[i] += betaFreq << s_gammaShift;
+            }
+
+            m_freq[bestPos] += s_beta;
+            m_bias[bestPos] -= s_betaGamma;
+            return bestBiasPos;
+        }
+
+        void AlterSingle(int alpha, int i, int b, int g, int r)
+        {
+            int* n = m_network[i].data();
+            n[0] -= (alpha * (n[0] - b)) / s_initAlpha;
+            n[1] -= (alpha * (n[1] - g)) / s_initAlpha;
+            n[2] -= (alpha * (n[2] - r)) / s_initAlpha;
+        }
+
+        void AlterNeighbours(int rad, int i, int b, int g, int r)
+        {
+            int lo = std::max(i - rad, -1);
+            int hi = std::min(i + rad, s_netSize);
+
+            for (int j = i + 1, k = i - 1, m = 1; j < hi || k > lo; m++)
+            {
+                int a = m_radPower[m];
+
+                if (j < hi)
+                {
+                    int* n = m_network[j++].data();
+                    n[0] -= (a * (n[0] - b)) / s_alphaRadBias;
+                    n[1] -= (a * (n[1] - g)) / s_alphaRadBias;
+                    n[2] -= (a * (n[2] - r)) / s_alphaRadBias;
+                }
+
+                if (k > lo)
+                {
+                    int* n = m_network[k--].data();
+                    n[0] -= (a * (n[0] - b)) / s_alphaRadBias;
+                    n[1] -= (a * (n[1] - g)) / s_alphaRadBias;
+                    n[2] -= (a * (n[2] - r)) / s_alphaRadBias;
+                }
+            }
+        }
+
+        void UpdateRadPower(int rad, int alpha)
+        {
+            for (int i = 0; i < rad; i++)
+            {
+                m_radPower[i] = alpha * (((rad * rad - i * i) * s_radBias) / (rad * rad));
+            }
+        }
+
+    public:
+
+        NeuQuantNetwork()
+        {
+            for (int i = 0; i < s_netSize; i++)
+            {
+                int value = (i << (s_netBiasShift + 8)) / s_netSize;
+                m_network[i][0] = m_network[i][1] = m_network[i][2] = value;
+                m_freq[i] = s_intBias / s_netSize;
+                m_bias[i] = 0;
+            }
+        }
+
+        void Learn(ImageView img, UINT samplingFactor)
+        {
+            const size_t pixelCount = (size_t)img.width * img.height;
+            if (pixelCount == 0)
+            {
+                return;
+            }
+
+            // Small images are always fully sampled
+            if (pixelCount < (size_t)s_primes[3])
+            {
+                samplingFactor = 1;
+            }
+
+            const int alphaDec = 30 + (samplingFactor - 1) / 3;
+            const size_t samplePixels = pixelCount / samplingFactor;
+            const size_t delta = std::max<size_t>(samplePixels / s_cycles, 1);
+
+            int alpha = s_initAlpha;
+            int radius = s_initRadius;
+            int rad = radius >> s_radiusBiasShift;
+            if (rad <= 1)
+            {
+                rad = 0;
+            }
+            UpdateRadPower(rad, alpha);
+
+            // A step which is coprime with the pixel count visits pixels all over the image
+            size_t step = s_primes[3];
+            for (int prime : s_primes)
+            {
+                if (pixelCount % prime)
+                {
+                    step = prime;
+                    break;
+                }
+            }
+
+            size_t pos = 0;
+
+            for (size_t i = 1; i <= samplePixels; i++)
+            {
+                const BYTE* pixel = img[pos / img.width] + 4 * (pos % img.width);
+                int b = pixel[0] << s_netBiasShift;
+                int g = pixel[1] << s_netBiasShift;
+                int r = pixel[2] << s_netBiasShift;
+
+                int j = Contest(b, g, r);
+                AlterSingle(alpha, j, b, g, r);
+                if (rad)
+                {
+                    AlterNeighbours(rad, j, b, g, r);
+                }
+
+                pos = (pos + step) % pixelCount;
+
+                if (i % delta == 0)
+                {
+                    alpha -= alpha / alphaDec;
+                    radius -= radius / s_radiusDec;
+                    rad = radius >> s_radiusBiasShift;
+                    if (rad <= 1)
+                    {
+                        rad = 0;
+                    }
+                    UpdateRadPower(rad, alpha);
+                }
+            }
+        }
+
+        /*
+         * Converts the neurons to colors, and prepares them for Map.
+         */
+        std::vector<PaletteColor> BuildPalette()
+        {
+            std::vector<PaletteColor> palette(256);
+
+            for (int i = 0; i < s_netSize; i++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    int value = (m_network[i][c] + (1 << (s_netBiasShift - 1))) >> s_netBiasShift;
+                    m_network[i][c] = std::clamp(value, 0, 255);
+                }
+
+                m_network[i][3] = i;
+                palette[i + 1] = PaletteColor{ (BYTE)m_network[i][2], (BYTE)m_network[i][1], (BYTE)m_network[i][0] };
+            }
+
+            // Sort the neurons by green, and index the first one with each green value
+            std::sort(std::begin(m_network), std::end(m_network), [](const auto& a, const auto& b)
+            {
+                return a[1] < b[1];
+            });
+
+            int previousGreen = 0, start = 0;
+            for (int i = 0; i < s_netSize; i++)
+            {
+                int green = m_network[i][1];
+                if (green != previousGreen)
+                {
+                    m_netIndex[previousGreen] = (start + i) >> 1;
+                    for (int j = previousGreen + 1; j < green; j++)
+                    {
+                        m_netIndex[j] = i;
+                    }
+                    previousGreen = green;
+                    start = i;
+                }
+            }
+
+            m_netIndex[previousGreen] = (start + s_netSize - 1) >> 1;
+            for (int j = previousGreen + 1; j < 256; j++)
+            {
+                m_netIndex[j] = s_netSize - 1;
+            }
+
+            return palette;
+        }
+
+        /*
+         * Returns the palette index of the closest neuron, searching outwards from
+         * the neurons with the same green value.
+         */
+        BYTE Map(int b, int g, int r) const
+        {
+            int bestDistance = 1000;
+            int best = 0;
+            int i = m_netIndex[g];
+            int j = i - 1;
+
+            while (i < s_netSize || j >= 0)
+            {
+                if (i < s_netSize)
+                {
+                    const int* n = m_network[i].data();
+                    int distance = n[1] - g;
+
+                    if (distance >= bestDistance)
+                    {
+                        i = s_netSize;
+                    }
+                    else
+                    {
+                        i++;
+                        distance += std::abs(n[0] - b);
+                        if (distance < bestDistance)
+                        {
+                            distance += std::abs(n[2] - r);
+                            if (distance < bestDistance)
+                            {
+                                bestDistance = distance;
+                                best = n[3];
+                            }
+                        }
+                    }
+                }
+
+                if (j >= 0)
+                {
+                    const int* n = m_network[j].data();
+                    int distance = g - n[1];
+
+                    if (distance >= bestDistance)
+                    {
+                        j = -1;
+                    }
+                    else
+                    {
+                        j--;
+                        distance += std::abs(n[0] - b);
+                        if (distance < bestDistance)
+                        {
+                            distance += std::abs(n[2] - r);
+                            if (distance < bestDistance)
+                            {
+                                bestDistance = distance;
+                                best = n[3];
+                            }
+                        }
+                    }
+                }
+            }
+
+            return (BYTE)(best + 1);
+        }
+    };
+
+    NeuralQuantizer::NeuralQuantizer(UINT samplingFactor) : m_samplingFactor(std::clamp(samplingFactor, 1u, 30u))
+    {
+    }
+
+    std::vector<PaletteColor> NeuralQuantizer::BuildPalette(ImageView img) const
+    {
+        auto network = std::make_unique<NeuQuantNetwork>();
+        network->Learn(img, m_samplingFactor);
+        return network->BuildPalette();
+    }
+
+    QuantizationOutput NeuralQuantizer::operator() (ImageView img) const
+    {
+        // The network is local, so concurrent calls are safe
+        auto network = std::make_unique<NeuQuantNetwork>();
+        network->Learn(img, m_samplingFactor);
+
+        QuantizationOutput output;
+        output.bitsPerPixel = 8;
+        output.palette = network->BuildPalette();
+        output.pixels.resize((size_t)img.width * img.height);
+
+        ParallelForBands(img.height, [&](size_t begin, size_t end)
+        {
+            // Screen content has few distinct colors, so recent lookups are cached.
+            // The key never matches an empty slot, as it has only 24 bits.
+            struct CacheEntry
+            {
+                uint32_t color;
+                BYTE index;
+            };
+            std::vector<CacheEntry> cache(1 << 12, CacheEntry{ 0xffffffff, 0 });
+
+            for (size_t i = begin; i < end; i++)
+            {
+                const BYTE* row = img[i];
+                BYTE* out = &output.pixels[i * img.width];
+
+                for (UINT j = 0; j < img.width; j++)
+                {
+                    uint32_t color = row[4 * j + 0] | (row[4 * j + 1] << 8) | (row[4 * j + 2] << 16);
+                    CacheEntry& entry = cache[(color * 2654435761u) >> 20];
+
+                    if (entry.color != color)
+                    {
+                        entry = CacheEntry{ color, network->Map(row[4 * j + 0], row[4 * j + 1], row[4 * j + 2]) };
+                    }
+
+                    out[j] = entry.index;
+                }
+            }
+        }, 16);
+
+        return output;
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "pch.h"
+
+namespace vgc
+{
+    /*
+     * Divides the range [0, count) into contiguous bands of at least minBandSize elements,
+     * at most one per hardware thread, and calls func(begin, end) for each of them.
+     * The last band is processed on the calling thread, and the function returns when
+     * all bands are done.
+     */
+    template<class Func>
+    void ParallelForBands(size_t count, Func func, size_t minBandSize = 1)
+    {
+        size_t threads = std::max(1u, std::thread::hardware_concurrency());
+        size_t bands = std::max<size_t>(1, std::min(threads, count / std::max<size_t>(minBandSize, 1)));
+
+        std::vector<std::future<void>> tasks;
+
+        for (size_t band = 0; band + 1 < bands; band++)
+        {
+            size_t begin = count * band / bands;
+            size_t end = count * (band + 1) / bands;
+            tasks.push_back(std::async(std::launch::async, [&func, begin, end]() { func(begin, end); }));
+        }
+
+        func(count * (bands - 1) / bands, count);
+
+        for (auto& task : tasks)
+        {
+            task.get();
+        }
+    }
+}
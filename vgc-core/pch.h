@@ -17,5 +17,9 @@
 #include <functional>
 #include <future>
 #include <map>
+#include <deque>
+#include <list>
+#include <limits>
+#include <bit>
 
 #include "com-utils.h"
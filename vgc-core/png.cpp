@@ -2,77 +2,59 @@
 
 namespace vgc
 {
-    HRESULT SaveImageAsPngFileW(ImageData& img, LPCWSTR path)
+    /*
+     * Encode the image as a PNG file into the given stream. Throws an HRESULT on failure.
+     */
+    static void EncodePng(IWICImagingFactory* factory, IStream* stream, ImageView img)
     {
-        if (!img.buffer.size() || !path)
-        {
-            return E_INVALIDARG;
-        }
-
-        IWICImagingFactory* factory = nullptr;
         IWICBitmapEncoder* encoder = nullptr;
         IWICBitmapFrameEncode* frame = nullptr;
-        IWICStream* stream = nullptr;
         GUID pixelFormat = GUID_WICPixelFormat32bppBGRA;
-        HRESULT result = S_OK;
 
         try
         {
-            CheckResult(CoInitialize(NULL));
-            CheckResult(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory)));
-            CheckResult(factory->CreateStream(&stream));
-            CheckResult(stream->InitializeFromFilename(path, GENERIC_WRITE));
             CheckResult(factory->CreateEncoder(GUID_ContainerFormatPng, nullptr, &encoder));
             CheckResult(encoder->Initialize(stream, WICBitmapEncoderNoCache));
             CheckResult(encoder->CreateNewFrame(&frame, nullptr));
             CheckResult(frame->Initialize(nullptr));
             CheckResult(frame->SetSize(img.width, img.height));
             CheckResult(frame->SetPixelFormat(&pixelFormat));
-            CheckResult(frame->WritePixels(img.height, img.width * 4, (UINT)img.buffer.size(), img.buffer.data()));
+            // The last row doesn't need to be followed by padding
+            UINT bufferSize = (UINT)(img.pitch * (img.height - 1) + 4ull * img.width);
+            CheckResult(frame->WritePixels(img.height, (UINT)img.pitch, bufferSize, const_cast<BYTE*>(img.data)));
             CheckResult(frame->Commit());
             CheckResult(encoder->Commit());
         }
-        catch (HRESULT hr)
+        catch (HRESULT)
         {
-            result = hr;
+            SafeRelease(frame);
+            SafeRelease(encoder);
+            throw;
         }
 
         SafeRelease(frame);
         SafeRelease(encoder);
-        SafeRelease(stream);
-        SafeRelease(factory);
-
-        return result;
     }
 
-    HRESULT LoadImageFromPngFileW(ImageData& img, LPCWSTR path)
+    /*
+     * Decode a PNG file saved by EncodePng from the given stream. Throws an HRESULT on failure.
+     */
+    static void DecodePng(IWICImagingFactory* factory, IStream* stream, ImageData& img)
     {
-        if (!path)
-        {
-            return E_INVALIDARG;
-        }
-
-        IWICImagingFactory* factory = nullptr;
         IWICBitmapDecoder* decoder = nullptr;
         IWICBitmapFrameDecode* frame = nullptr;
-        IWICStream* stream = nullptr;
         GUID pixelFormat;
         UINT width, height;
-        HRESULT result = S_OK;
 
         try
         {
-            CheckResult(CoInitialize(NULL));
-            CheckResult(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory)));
-            CheckResult(factory->CreateStream(&stream));
-            CheckResult(stream->InitializeFromFilename(path, GENERIC_READ));
             CheckResult(factory->CreateDecoder(GUID_ContainerFormatPng, nullptr, &decoder));
             CheckResult(decoder->Initialize(stream, WICDecodeMetadataCacheOnDemand));
             CheckResult(decoder->GetFrame(0, &frame));
             CheckResult(frame->GetSize(&width, &height));
             try
             {
-                img = ImageData(width, height);
+                img = ImageData(width, height, ImageData::Uninitialized);
             }
             catch (std::bad_alloc)
             {
@@ -83,18 +65,148 @@ namespace vgc
             // The image has to be saved using this pixel format
             if (pixelFormat != GUID_WICPixelFormat32bppBGRA)
             {
-                return E_FAIL;
+                throw E_FAIL;
             }
 
             CheckResult(frame->CopyPixels(NULL, width * 4, width * height * 4, img.buffer.data()));
         }
-        catch (HRESULT hr)
+        catch (HRESULT)
         {
-            result = hr;
+            SafeRelease(frame);
+            SafeRelease(decoder);
+            throw;
         }
 
         SafeRelease(frame);
         SafeRelease(decoder);
+    }
+
+    HRESULT SaveImageAsPngFileW(ImageView img, LPCWSTR path)
+    {
+        if (!img.width || !img.height || !path)
+        {
+            return E_INVALIDARG;
+        }
+
+        IWICImagingFactory* factory = nullptr;
+        IWICStream* stream = nullptr;
+        HRESULT result = S_OK;
+
+        try
+        {
+            CheckResult(CoInitialize(NULL));
+            CheckResult(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory)));
+            CheckResult(factory->CreateStream(&stream));
+            CheckResult(stream->InitializeFromFilename(path, GENERIC_WRITE));
+            EncodePng(factory, stream, img);
+        }
+        catch (HRESULT hr)
+        {
+            result = hr;
+        }
+
+        SafeRelease(stream);
+        SafeRelease(factory);
+
+        return result;
+    }
+
+    HRESULT SaveImageAsPngToMemory(ImageView img, std::vector<BYTE>& out)
+    {
+        if (!img.width || !img.height)
+        {
+            return E_INVALIDARG;
+        }
+
+        IWICImagingFactory* factory = nullptr;
+        IStream* stream = nullptr;
+        HRESULT result = S_OK;
+
+        try
+        {
+            CheckResult(CoInitialize(NULL));
+            CheckResult(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory)));
+            CheckResult(CreateStreamOnHGlobal(nullptr, TRUE, &stream));
+            EncodePng(factory, stream, img);
+
+            STATSTG stat;
+            CheckResult(stream->Stat(&stat, STATFLAG_NONAME));
+            out.resize((size_t)stat.cbSize.QuadPart);
+
+            ULONG read = 0;
+            CheckResult(stream->Seek(LARGE_INTEGER{}, STREAM_SEEK_SET, nullptr));
+            CheckResult(stream->Read(out.data(), (ULONG)out.size(), &read));
+        }
+        catch (HRESULT hr)
+        {
+            result = hr;
+        }
+        catch (std::bad_alloc)
+        {
+            result = E_OUTOFMEMORY;
+        }
+
+        SafeRelease(stream);
+        SafeRelease(factory);
+
+        return result;
+    }
+
+    HRESULT LoadImageFromPngFileW(ImageData& img, LPCWSTR path)
+    {
+        if (!path)
+        {
+            return E_INVALIDARG;
+        }
+
+        IWICImagingFactory* factory = nullptr;
+        IWICStream* stream = nullptr;
+        HRESULT result = S_OK;
+
+        try
+        {
+            CheckResult(CoInitialize(NULL));
+            CheckResult(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory)));
+            CheckResult(factory->CreateStream(&stream));
+            CheckResult(stream->InitializeFromFilename(path, GENERIC_READ));
+            DecodePng(factory, stream, img);
+        }
+        catch (HRESULT hr)
+        {
+            result = hr;
+        }
+
+        SafeRelease(stream);
+        SafeRelease(factory);
+
+        return result;
+    }
+
+    HRESULT LoadImageFromPngMemory(ImageData& img, const BYTE* data, size_t size)
+    {
+        if (!data || !size || size > MAXDWORD)
+        {
+            return E_INVALIDARG;
+        }
+
+        IWICImagingFactory* factory = nullptr;
+        IWICStream* stream = nullptr;
+        HRESULT result = S_OK;
+
+        try
+        {
+            CheckResult(CoInitialize(NULL));
+            CheckResult(CoCreateInstance(CLSID_WICImagingFactory, nullptr, CLSCTX_INPROC_SERVER, IID_PPV_ARGS(&factory)));
+            CheckResult(factory->CreateStream(&stream));
+            // The stream only reads the memory
+            CheckResult(stream->InitializeFromMemory(const_cast<BYTE*>(data), (DWORD)size));
+            DecodePng(factory, stream, img);
+        }
+        catch (HRESULT hr)
+        {
+            result = hr;
+        }
+
         SafeRelease(stream);
         SafeRelease(factory);
 
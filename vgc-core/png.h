@@ -7,9 +7,16 @@ namespace vgc
 {
 	/*
      * Save an image using the Portable Network Graphics format
-     * to a given file path.
+     * to a given file path. Rows are written straight from the view,
+     * so padded buffers don't need to be packed first.
      */
-	HRESULT SaveImageAsPngFileW(ImageData& img, LPCWSTR path);
+	HRESULT SaveImageAsPngFileW(ImageView img, LPCWSTR path);
+
+	/*
+	 * Save an image using the Portable Network Graphics format
+	 * into the given byte buffer, replacing its contents.
+	 */
+	HRESULT SaveImageAsPngToMemory(ImageView img, std::vector<BYTE>& out);
 
 	/*
 	 * Load an image using the Portable Network Graphics format
@@ -18,4 +25,10 @@ namespace vgc
 	 * using SaveImageAsPngFileW.
 	 */
 	HRESULT LoadImageFromPngFileW(ImageData& img, LPCWSTR path);
+
+	/*
+	 * Load an image saved using SaveImageAsPngToMemory, or a PNG
+	 * file read into memory, into the given ImageData object.
+	 */
+	HRESULT LoadImageFromPngMemory(ImageData& img, const BYTE* data, size_t size);
 }
@@ -1,46 +1,924 @@
 #include "quantization.h"
+#include "parallel.h"
+#include <array>
+#include <atomic>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define VGC_SSE2
+#endif
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VGC_AVX2
+#ifdef _MSC_VER
+#include <intrin.h>
+#define VGC_TARGET_AVX2
+#else
+#define VGC_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 namespace vgc
 {
-    QuantizationOutput SimpleQuantizer::operator() (const ImageData& img) const
+    // The transparent color, followed by the 6x6x6 color cube, in the order of
+    // the indices computed by the kernels below
+    static constexpr auto s_simplePalette = []()
+    {
+        std::array<PaletteColor, 256> palette{};
+
+        for (UINT i = 0; i < 216; i++)
+        {
+            palette[i + 1] = PaletteColor{ (BYTE)(i / 36 * 51), (BYTE)(i / 6 % 6 * 51), (BYTE)(i % 6 * 51) };
+        }
+
+        return palette;
+    }();
+
+    /*
+     * Kernels converting count BGRA pixels to palette indices of the color cube. Each
+     * channel c becomes (5 * c + 130) >> 8, between 0 and 5, and the index is
+     * r * 36 + g * 6 + b + 1. All kernels give the same results.
+     */
+    static void QuantizeToCubeScalar(const BYTE* pixels, BYTE* out, size_t count)
+    {
+        for (size_t j = 0; j < count; j++)
+        {
+            UINT b = (5 * pixels[4 * j + 0] + 130) >> 8;
+            UINT g = (5 * pixels[4 * j + 1] + 130) >> 8;
+            UINT r = (5 * pixels[4 * j + 2] + 130) >> 8;
+
+            out[j] = (BYTE)(r * 36 + g * 6 + b + 1);
+        }
+    }
+
+#ifdef VGC_SSE2
+    // Quantizes the channels of 2 pixels, widened to 16 bits, and returns
+    // b + 6 * g and 36 * r of each pixel as 32 bit integers
+    static __m128i QuantizeChannelsSse2(__m128i channels)
+    {
+        const __m128i five = _mm_set1_epi16(5);
+        const __m128i rounding = _mm_set1_epi16(130);
+        const __m128i weights = _mm_setr_epi16(1, 6, 36, 0, 1, 6, 36, 0);
+
+        __m128i levels = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(channels, five), rounding), 8);
+        return _mm_madd_epi16(levels, weights);
+    }
+
+    // Returns the indices of 4 pixels as 32 bit integers, without the offset of 1
+    static __m128i QuantizeToCubeSse2(__m128i pixels)
     {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi16(1);
+
+        __m128i low = QuantizeChannelsSse2(_mm_unpacklo_epi8(pixels, zero));
+        __m128i high = QuantizeChannelsSse2(_mm_unpackhi_epi8(pixels, zero));
+
+        // Both halves of each index fit in 16 bits, so they can be added by another madd
+        return _mm_madd_epi16(_mm_packs_epi32(low, high), ones);
+    }
+
+    static void QuantizeToCubeSse2(const BYTE* pixels, BYTE* out, size_t count)
+    {
+        const __m128i ones = _mm_set1_epi8(1);
+        size_t j = 0;
+
+        for (; j + 16 <= count; j += 16)
+        {
+            const __m128i* source = reinterpret_cast<const __m128i*>(pixels + 4 * j);
+
+            __m128i indices0 = QuantizeToCubeSse2(_mm_loadu_si128(source + 0));
+            __m128i indices1 = QuantizeToCubeSse2(_mm_loadu_si128(source + 1));
+            __m128i indices2 = QuantizeToCubeSse2(_mm_loadu_si128(source + 2));
+            __m128i indices3 = QuantizeToCubeSse2(_mm_loadu_si128(source + 3));
+
+            __m128i indices = _mm_packus_epi16(_mm_packs_epi32(indices0, indices1), _mm_packs_epi32(indices2, indices3));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j), _mm_add_epi8(indices, ones));
+        }
+
+        QuantizeToCubeScalar(pixels + 4 * j, out + j, count - j);
+    }
+#endif
+
+#ifdef VGC_AVX2
+    // The same as QuantizeToCubeSse2, for 8 pixels. Within each 128 bit lane, the
+    // unpacks and packs keep the pixels in order, so the indices are in order too.
+    VGC_TARGET_AVX2 static __m256i QuantizeToCubeAvx2(__m256i pixels)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i five = _mm256_set1_epi16(5);
+        const __m256i rounding = _mm256_set1_epi16(130);
+        const __m256i weights = _mm256_setr_epi16(1, 6, 36, 0, 1, 6, 36, 0, 1, 6, 36, 0, 1, 6, 36, 0);
+        const __m256i ones = _mm256_set1_epi16(1);
+
+        __m256i low = _mm256_unpacklo_epi8(pixels, zero);
+        __m256i high = _mm256_unpackhi_epi8(pixels, zero);
+
+        low = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(low, five), rounding), 8);
+        high = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(high, five), rounding), 8);
+
+        __m256i halves = _mm256_packs_epi32(_mm256_madd_epi16(low, weights), _mm256_madd_epi16(high, weights));
+        return _mm256_madd_epi16(halves, ones);
+    }
+
+    VGC_TARGET_AVX2 static void QuantizeToCubeAvx2(const BYTE* pixels, BYTE* out, size_t count)
+    {
+        const __m128i ones = _mm_set1_epi8(1);
+        size_t j = 0;
+
+        for (; j + 16 <= count; j += 16)
+        {
+            const __m256i* source = reinterpret_cast<const __m256i*>(pixels + 4 * j);
+
+            __m256i indices0 = QuantizeToCubeAvx2(_mm256_loadu_si256(source + 0));
+            __m256i indices1 = QuantizeToCubeAvx2(_mm256_loadu_si256(source + 1));
+
+            // Pixels 0-3, 8-11, 4-7 and 12-15, reordered across lanes
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(indices0, indices1), _MM_SHUFFLE(3, 1, 2, 0));
+            __m128i indices = _mm_packus_epi16(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + j), _mm_add_epi8(indices, ones));
+        }
+
+        QuantizeToCubeScalar(pixels + 4 * j, out + j, count - j);
+    }
+
+    static bool IsAvx2Supported()
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7)
+        {
+            return false;
+        }
+
+        // The OS must also save the AVX registers
+        __cpuid(info, 1);
+        bool osxsave = info[2] & (1 << 27);
+        bool avx = info[2] & (1 << 28);
+        if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)
+        {
+            return false;
+        }
+
+        __cpuidex(info, 7, 0);
+        return info[1] & (1 << 5);
+#else
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+    using QuantizeToCubeKernel = void (*)(const BYTE* pixels, BYTE* out, size_t count);
+
+    static QuantizeToCubeKernel SelectQuantizeToCubeKernel()
+    {
+#ifdef VGC_AVX2
+        if (IsAvx2Supported())
+        {
+            return QuantizeToCubeAvx2;
+        }
+#endif
+
+#ifdef VGC_SSE2
+        return QuantizeToCubeSse2;
+#else
+        return QuantizeToCubeScalar;
+#endif
+    }
+
+    QuantizationOutput SimpleQuantizer::operator() (ImageView img) const
+    {
+        static const QuantizeToCubeKernel s_kernel = SelectQuantizeToCubeKernel();
+
         QuantizationOutput output;
 
         output.bitsPerPixel = 8;
+        output.palette = BuildPalette(img);
+        output.pixels.resize((size_t)img.width * img.height);
+
+        for (UINT i = 0; i < img.height; i++)
+        {
+            s_kernel(img[i], &output.pixels[(size_t)i * img.width], img.width);
+        }
+
+        return output;
+    }
+
+    std::vector<PaletteColor> SimpleQuantizer::BuildPalette(ImageView) const
+    {
+        return std::vector<PaletteColor>(s_simplePalette.begin(), s_simplePalette.end());
+    }
+
+    bool TryQuantizeExactly(ImageView img, QuantizationOutput& output)
+    {
+        // Open addressing, with room for 255 colors at a load factor below 1/2. The keys
+        // are BGR colors, so an empty slot never matches.
+        constexpr UINT s_tableBits = 9;
+        constexpr uint32_t s_empty = 0xffffffff;
+
+        uint32_t keys[1 << s_tableBits];
+        BYTE values[1 << s_tableBits];
+        std::fill(std::begin(keys), std::end(keys), s_empty);
+
+        std::vector<PaletteColor> palette(1);
+        std::vector<BYTE> pixels((size_t)img.width * img.height);
+
+        // Screen content has long runs of one color, which skip the table
+        uint32_t lastColor = s_empty;
+        BYTE lastIndex = 0;
+
+        for (UINT i = 0, k = 0; i < img.height; i++)
+        {
+            const BYTE* row = img[i];
+
+            for (UINT j = 0; j < img.width; j++)
+            {
+                uint32_t color;
+                memcpy(&color, row + 4 * j, sizeof color);
+                color &= 0xffffff;
+
+                if (color != lastColor)
+                {
+                    UINT slot = (color * 2654435761u) >> (32 - s_tableBits);
+                    while (keys[slot] != color && keys[slot] != s_empty)
+                    {
+                        slot = (slot + 1) & ((1 << s_tableBits) - 1);
+                    }
+
+                    if (keys[slot] == s_empty)
+                    {
+                        if (palette.size() == 256)
+                        {
+                            return false;
+                        }
+
+                        keys[slot] = color;
+                        values[slot] = (BYTE)palette.size();
+                        palette.push_back(PaletteColor{ (BYTE)(color >> 16), (BYTE)(color >> 8), (BYTE)color });
+                    }
+
+                    lastColor = color;
+                    lastIndex = values[slot];
+                }
+
+                pixels[k++] = lastIndex;
+            }
+        }
+
+        // GIF palettes have between 2 and 256 entries, a power of two
+        output.bitsPerPixel = 1;
+        while ((1u << output.bitsPerPixel) < palette.size())
+        {
+            output.bitsPerPixel++;
+        }
+
+        palette.resize(1ull << output.bitsPerPixel);
+        output.palette = std::move(palette);
+        output.pixels = std::move(pixels);
+        output.transparentColor = 0;
+        return true;
+    }
+
+    void CompactPalette(QuantizationOutput& quantization)
+    {
+        if (quantization.transparentColor != 0 || quantization.palette.empty())
+        {
+            return;
+        }
+
+        uint32_t counts[256] = {};
+        for (BYTE index : quantization.pixels)
+        {
+            counts[index]++;
+        }
+
+        BYTE permutation[256] = {};
+        std::vector<PaletteColor> palette(1, quantization.palette[0]);
+
+        for (UINT index = 1; index < quantization.palette.size(); index++)
+        {
+            if (counts[index])
+            {
+                permutation[index] = (BYTE)palette.size();
+                palette.push_back(quantization.palette[index]);
+            }
+        }
+
+        quantization.bitsPerPixel = 1;
+        while ((1u << quantization.bitsPerPixel) < palette.size())
+        {
+            quantization.bitsPerPixel++;
+        }
+
+        palette.resize(1ull << quantization.bitsPerPixel);
+        quantization.palette = std::move(palette);
+
+        for (BYTE& index : quantization.pixels)
+        {
+            index = permutation[index];
+        }
+    }
+
+    // Expands a 5 bit channel value to 8 bits
+    static BYTE Expand5(UINT value)
+    {
+        return (BYTE)((value << 3) | (value >> 2));
+    }
+
+    static UINT HistogramIndex(const BYTE* pixel)
+    {
+        return ((pixel[2] >> 3) << 10) | ((pixel[1] >> 3) << 5) | (pixel[0] >> 3);
+    }
+
+    /*
+     * Finds the palette color closest to a 5-5-5 color, ignoring the transparent index 0.
+     * The colors are sorted by green, so the search goes outwards from the green value of
+     * the color and stops once green alone is further than the best match. Ties go to the
+     * lowest index, as with a linear search.
+     */
+    class NearestColorSearch
+    {
+        struct Entry
+        {
+            int g, r, b;
+            BYTE index;
+        };
+
+        std::vector<Entry> m_colors;
+
+    public:
+        NearestColorSearch(const std::vector<PaletteColor>& palette)
+        {
+            for (UINT k = 1; k < palette.size(); k++)
+            {
+                m_colors.push_back(Entry{ palette[k].g, palette[k].r, palette[k].b, (BYTE)k });
+            }
+
+            std::stable_sort(m_colors.begin(), m_colors.end(), [](const Entry& a, const Entry& b)
+            {
+                return a.g < b.g;
+            });
+        }
+
+        BYTE Find(UINT color) const
+        {
+            int r = Expand5((color >> 10) & 31);
+            int g = Expand5((color >> 5) & 31);
+            int b = Expand5(color & 31);
+
+            UINT bestIndex = 1, bestDistance = std::numeric_limits<UINT>::max();
+
+            auto consider = [&](const Entry& entry)
+            {
+                int dr = r - entry.r;
+                int dg = g - entry.g;
+                int db = b - entry.b;
+                UINT distance = dr * dr + dg * dg + db * db;
+
+                if (distance < bestDistance || (distance == bestDistance && entry.index < bestIndex))
+                {
+                    bestIndex = entry.index;
+                    bestDistance = distance;
+                }
+            };
+
+            const int count = (int)m_colors.size();
+            int up = (int)(std::lower_bound(m_colors.begin(), m_colors.end(), g, [](const Entry& entry, int g)
+            {
+                return entry.g < g;
+            }) - m_colors.begin());
+            int down = up - 1;
+
+            while (up < count || down >= 0)
+            {
+                if (up < count)
+                {
+                    UINT dg = m_colors[up].g - g;
+                    if (dg * dg > bestDistance)
+                    {
+                        up = count;
+                    }
+                    else
+                    {
+                        consider(m_colors[up++]);
+                    }
+                }
+
+                if (down >= 0)
+                {
+                    UINT dg = g - m_colors[down].g;
+                    if (dg * dg > bestDistance)
+                    {
+                        down = -1;
+                    }
+                    else
+                    {
+                        consider(m_colors[down--]);
+                    }
+                }
+            }
+
+            return (BYTE)bestIndex;
+        }
+    };
+
+    std::vector<BYTE> BuildInverseColorMap(const std::vector<PaletteColor>& palette)
+    {
+        NearestColorSearch search(palette);
+        std::vector<BYTE> lookup(1 << 15);
+
+        ParallelForBands(lookup.size(), [&](size_t begin, size_t end)
+        {
+            for (size_t color = begin; color < end; color++)
+            {
+                lookup[color] = search.Find((UINT)color);
+            }
+        }, 1024);
+
+        return lookup;
+    }
+
+    PaletteBuilder::PaletteBuilder() : m_histogram(1 << 15, 0)
+    {
+    }
+
+    void PaletteBuilder::AddImage(ImageView img, UINT step)
+    {
+        step = std::max(step, 1u);
+
+        for (UINT i = 0; i < img.height; i += step)
+        {
+            const BYTE* row = img[i];
+
+            for (UINT j = 0; j < img.width; j += step)
+            {
+                m_histogram[HistogramIndex(row + 4 * j)]++;
+            }
+        }
+    }
+
+    std::vector<PaletteColor> PaletteBuilder::Build(UINT maxColors) const
+    {
+        maxColors = std::min(maxColors, 255u);
+
+        // Each box of the median cut is a range of this array of used histogram indices
+        std::vector<UINT> colors;
+        for (UINT i = 0; i < m_histogram.size(); i++)
+        {
+            if (m_histogram[i])
+            {
+                colors.push_back(i);
+            }
+        }
 
-        output.palette.emplace_back(PaletteColor{});
+        auto channel = [](UINT color, UINT c)
+        {
+            return (color >> (5 * c)) & 31;
+        };
+
+        struct Box
+        {
+            size_t begin, end;
+            uint64_t pixels;
+        };
+
+        std::vector<Box> boxes;
+        if (!colors.empty())
+        {
+            uint64_t pixels = 0;
+            for (auto color : colors)
+            {
+                pixels += m_histogram[color];
+            }
+            boxes.push_back(Box{ 0, colors.size(), pixels });
+        }
 
-        for (UINT i = 0; i < 6; i++)
+        while (boxes.size() < maxColors)
         {
-            for (UINT j = 0; j < 6; j++)
+            // Split the most populated box which holds more than one color
+            auto box = std::max_element(boxes.begin(), boxes.end(), [](const Box& a, const Box& b)
+            {
+                return (a.end - a.begin > 1 ? a.pixels : 0) < (b.end - b.begin > 1 ? b.pixels : 0);
+            });
+
+            if (box == boxes.end() || box->end - box->begin < 2)
+            {
+                break;
+            }
+
+            // ...along its longest axis
+            UINT longestAxis = 0, longestRange = 0;
+            for (UINT c = 0; c < 3; c++)
             {
-                for (UINT k = 0; k < 6; k++)
+                UINT low = 31, high = 0;
+                for (size_t i = box->begin; i < box->end; i++)
+                {
+                    low = std::min(low, channel(colors[i], c));
+                    high = std::max(high, channel(colors[i], c));
+                }
+
+                if (high - low >= longestRange)
                 {
-                    output.palette.push_back(PaletteColor{ (BYTE)(i * 51), (BYTE)(j * 51), (BYTE)(k * 51) });
+                    longestAxis = c;
+                    longestRange = high - low;
                 }
             }
+
+            std::sort(colors.begin() + box->begin, colors.begin() + box->end, [&](UINT a, UINT b)
+            {
+                return channel(a, longestAxis) < channel(b, longestAxis);
+            });
+
+            // ...at the median pixel, keeping at least one color on each side
+            uint64_t lowerPixels = 0;
+            size_t split = box->begin;
+            while (split < box->end - 1 && (split == box->begin || lowerPixels * 2 < box->pixels))
+            {
+                lowerPixels += m_histogram[colors[split++]];
+            }
+
+            Box upper{ split, box->end, box->pixels - lowerPixels };
+            *box = Box{ box->begin, split, lowerPixels };
+            boxes.push_back(upper);
         }
 
-        output.palette.resize(256);
+        std::vector<PaletteColor> palette(256);
 
+        for (size_t k = 0; k < boxes.size(); k++)
+        {
+            // The average color of the box, weighted by pixel count
+            uint64_t sum[3] = {};
+            for (size_t i = boxes[k].begin; i < boxes[k].end; i++)
+            {
+                for (UINT c = 0; c < 3; c++)
+                {
+                    sum[c] += Expand5(channel(colors[i], c)) * m_histogram[colors[i]];
+                }
+            }
+
+            auto average = [&](UINT c) { return (BYTE)((sum[c] + boxes[k].pixels / 2) / boxes[k].pixels); };
+            palette[k + 1] = PaletteColor{ average(2), average(1), average(0) };
+        }
+
+        return palette;
+    }
+
+    FixedPaletteQuantizer::FixedPaletteQuantizer(std::vector<PaletteColor> palette) :
+        m_palette(std::move(palette))
+    {
+        m_palette.resize(256);
+        m_lookup = BuildInverseColorMap(m_palette);
+    }
+
+    QuantizationOutput FixedPaletteQuantizer::operator() (ImageView img) const
+    {
+        QuantizationOutput output;
+
+        output.bitsPerPixel = 8;
+        output.palette = m_palette;
         output.pixels.resize((size_t)img.width * img.height);
 
         for (UINT i = 0, k = 0; i < img.height; i++)
         {
+            const BYTE* row = img[i];
+
             for (UINT j = 0; j < img.width; j++)
             {
-                UINT b = img[i][4 * j + 0];
-                UINT g = img[i][4 * j + 1];
-                UINT r = img[i][4 * j + 2];
+                output.pixels[k++] = m_lookup[HistogramIndex(row + 4 * j)];
+            }
+        }
 
-                b = (5 * b + 130) >> 8;
-                g = (5 * g + 130) >> 8;
-                r = (5 * r + 130) >> 8;
+        return output;
+    }
+
+    MedianCutQuantizer::MedianCutQuantizer(UINT sampleStep) : m_sampleStep(std::max(sampleStep, 1u))
+    {
+    }
 
-                output.pixels[k++] = r * 36 + g * 6 + b + 1;
+    std::vector<PaletteColor> MedianCutQuantizer::BuildPalette(ImageView img) const
+    {
+        PaletteBuilder paletteBuilder;
+        paletteBuilder.AddImage(img, m_sampleStep);
+        return paletteBuilder.Build();
+    }
+
+    QuantizationOutput MedianCutQuantizer::operator() (ImageView img) const
+    {
+        QuantizationOutput output;
+        output.bitsPerPixel = 8;
+        output.palette = BuildPalette(img);
+        output.pixels.resize((size_t)img.width * img.height);
+
+        // Palette index for each 5-5-5 color, or s_unknown if it wasn't needed yet
+        NearestColorSearch search(output.palette);
+        constexpr USHORT s_unknown = 0xffff;
+        std::vector<USHORT> lookup(1 << 15, s_unknown);
+
+        for (UINT i = 0, k = 0; i < img.height; i++)
+        {
+            const BYTE* row = img[i];
+
+            for (UINT j = 0; j < img.width; j++)
+            {
+                UINT color = HistogramIndex(row + 4 * j);
+
+                if (lookup[color] == s_unknown)
+                {
+                    lookup[color] = search.Find(color);
+                }
+
+                output.pixels[k++] = (BYTE)lookup[color];
             }
         }
 
         return output;
     }
+
+    // Pixels of large images are sampled on a grid, with this step in both directions
+    static UINT TemporalSampleStep(ImageView img)
+    {
+        return (size_t)img.width * img.height < (1 << 16) ? 1 : 4;
+    }
+
+    static UINT CoverageIndex(const BYTE* pixel)
+    {
+        return ((pixel[2] >> 4) << 8) | ((pixel[1] >> 4) << 4) | (pixel[0] >> 4);
+    }
+
+    static UINT SquaredError(const BYTE* pixel, PaletteColor color)
+    {
+        int db = pixel[0] - color.b;
+        int dg = pixel[1] - color.g;
+        int dr = pixel[2] - color.r;
+        return db * db + dg * dg + dr * dr;
+    }
+
+    TemporalPalette::TemporalPalette(ImageView img, std::vector<PaletteColor> palette) :
+        m_palette(std::move(palette)),
+        m_coverage(1 << 12),
+        m_referenceError(0)
+    {
+        m_lookup = BuildInverseColorMap(m_palette);
+
+        const UINT step = TemporalSampleStep(img);
+        uint64_t error = 0, samples = 0;
+
+        for (UINT i = 0; i < img.height; i += step)
+        {
+            const BYTE* row = img[i];
+
+            for (UINT j = 0; j < img.width; j += step)
+            {
+                const BYTE* pixel = row + 4 * j;
+                m_coverage[CoverageIndex(pixel)] = true;
+                error += SquaredError(pixel, m_palette[m_lookup[HistogramIndex(pixel)]]);
+                samples++;
+            }
+        }
+
+        m_referenceError = samples ? (double)error / samples : 0;
+    }
+
+    bool TemporalPalette::Fits(ImageView img, double driftThreshold) const
+    {
+        // The mean squared error may at most double, with a margin for images which
+        // the palette represents almost exactly
+        constexpr double s_errorGrowth = 2;
+        constexpr double s_errorMargin = 48;
+
+        const UINT step = TemporalSampleStep(img);
+        uint64_t error = 0, uncovered = 0, samples = 0;
+
+        for (UINT i = 0; i < img.height; i += step)
+        {
+            const BYTE* row = img[i];
+
+            for (UINT j = 0; j < img.width; j += step)
+            {
+                const BYTE* pixel = row + 4 * j;
+                uncovered += !m_coverage[CoverageIndex(pixel)];
+                error += SquaredError(pixel, m_palette[m_lookup[HistogramIndex(pixel)]]);
+                samples++;
+            }
+        }
+
+        if (samples == 0)
+        {
+            return false;
+        }
+
+        if (uncovered > driftThreshold * samples || (double)error / samples > s_errorGrowth * m_referenceError + s_errorMargin)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    QuantizationOutput TemporalPalette::Map(ImageView img) const
+    {
+        QuantizationOutput output;
+        output.bitsPerPixel = std::max(1, (int)std::bit_width(m_palette.size() - 1));
+        output.palette = m_palette;
+        output.pixels.resize((size_t)img.width * img.height);
+
+        for (UINT i = 0, k = 0; i < img.height; i++)
+        {
+            const BYTE* row = img[i];
+
+            for (UINT j = 0; j < img.width; j++)
+            {
+                output.pixels[k++] = m_lookup[HistogramIndex(row + 4 * j)];
+            }
+        }
+
+        return output;
+    }
+
+    // The nearest 5 bit level of each channel value, as truncating it would darken
+    // dithered images
+    static constexpr auto s_round5 = []()
+    {
+        std::array<BYTE, 256> levels{};
+
+        for (int value = 0; value < 256; value++)
+        {
+            levels[value] = (BYTE)((value * 31 + 127) / 255);
+        }
+
+        return levels;
+    }();
+
+    static int Round5(int value)
+    {
+        return s_round5[std::clamp(value, 0, 255)];
+    }
+
+    // Maps a pixel with the dither offsets or diffused errors already added
+    static BYTE MapDitheredPixel(const std::vector<BYTE>& lookup, int b, int g, int r)
+    {
+        return lookup[(Round5(r) << 10) | (Round5(g) << 5) | Round5(b)];
+    }
+
+    static void DitherOrdered(ImageView img, const std::vector<BYTE>& lookup, int strength, std::vector<BYTE>& pixels)
+    {
+        static constexpr BYTE s_bayer[8][8] =
+        {
+            {  0, 32,  8, 40,  2, 34, 10, 42 },
+            { 48, 16, 56, 24, 50, 18, 58, 26 },
+            { 12, 44,  4, 36, 14, 46,  6, 38 },
+            { 60, 28, 52, 20, 62, 30, 54, 22 },
+            {  3, 35, 11, 43,  1, 33,  9, 41 },
+            { 51, 19, 59, 27, 49, 17, 57, 25 },
+            { 15, 47,  7, 39, 13, 45,  5, 37 },
+            { 63, 31, 55, 23, 61, 29, 53, 21 },
+        };
+
+        // The 5 bit level of each channel value with the offset of each matrix position
+        // added, so the inner loop needs neither additions nor clamping
+        std::vector<std::array<BYTE, 256>> levels(64);
+        for (int position = 0; position < 64; position++)
+        {
+            int offset = (2 * s_bayer[position / 8][position % 8] + 1 - 64) * strength / 128;
+
+            for (int value = 0; value < 256; value++)
+            {
+                levels[position][value] = (BYTE)Round5(value + offset);
+            }
+        }
+
+        // Every pixel is independent, so rows are simply split between threads
+        ParallelForBands(img.height, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                const BYTE* row = img[i];
+                const auto* rowLevels = &levels[(i & 7) * 8];
+                BYTE* out = &pixels[i * img.width];
+
+                for (UINT j = 0; j < img.width; j++)
+                {
+                    const BYTE* level = rowLevels[j & 7].data();
+                    const BYTE* pixel = row + 4 * j;
+                    out[j] = lookup[(level[pixel[2]] << 10) | (level[pixel[1]] << 5) | level[pixel[0]]];
+                }
+            }
+        }, 16);
+    }
+
+    static void DitherFloydSteinberg(ImageView img, const std::vector<PaletteColor>& palette, const std::vector<BYTE>& lookup, std::vector<BYTE>& pixels)
+    {
+        // Rows are handed out to the threads in turn. The row above diffuses errors down
+        // to the left, down, and down to the right, so a row can process a chunk of
+        // pixels, including the error it passes to the right of it, once the row above
+        // is done with the two pixels following the chunk.
+        constexpr UINT s_chunkSize = 64;
+
+        // The minimum number of pixels per thread, a few milliseconds of work, as for the
+        // bands of ParallelForBands. Smaller images are dithered on the calling thread.
+        constexpr size_t s_minThreadPixels = 1 << 16;
+
+        const UINT width = img.width;
+        const UINT height = img.height;
+        const size_t threads = std::clamp<size_t>(std::thread::hardware_concurrency(), 1,
+            std::max<size_t>(std::min<size_t>(height, (size_t)width * height / s_minThreadPixels), 1));
+
+        // Errors diffused into each row, in sixteenths, with a margin of one pixel on
+        // each side. A thread finishes a row before starting the next one, threads rows
+        // below, so threads + 1 buffers are enough.
+        const size_t errorStride = 3 * ((size_t)width + 2);
+        std::vector<int> errors((threads + 1) * errorStride);
+        std::vector<std::atomic<UINT>> progress(height);
+
+        auto processRows = [&](size_t first)
+        {
+            for (size_t i = first; i < height; i += threads)
+            {
+                int* current = &errors[i % (threads + 1) * errorStride] + 3;
+                int* below = &errors[(i + 1) % (threads + 1) * errorStride] + 3;
+                std::fill(below - 3, below - 3 + errorStride, 0);
+
+                const BYTE* row = img[i];
+                BYTE* out = &pixels[i * width];
+
+                for (UINT chunk = 0; chunk < width; chunk += s_chunkSize)
+                {
+                    UINT chunkEnd = std::min(chunk + s_chunkSize, width);
+
+                    if (i > 0)
+                    {
+                        UINT required = std::min(chunkEnd + 2, width);
+                        while (progress[i - 1].load(std::memory_order_acquire) < required)
+                        {
+                            std::this_thread::yield();
+                        }
+                    }
+
+                    for (UINT j = chunk; j < chunkEnd; j++)
+                    {
+                        int* error = current + 3 * j;
+                        int* errorBelow = below + 3 * j;
+                        int b = row[4 * j + 0] + ((error[0] + 8) >> 4);
+                        int g = row[4 * j + 1] + ((error[1] + 8) >> 4);
+                        int r = row[4 * j + 2] + ((error[2] + 8) >> 4);
+
+                        BYTE index = MapDitheredPixel(lookup, b, g, r);
+                        out[j] = index;
+
+                        int quantizationError[3] =
+                        {
+                            std::clamp(b, 0, 255) - palette[index].b,
+                            std::clamp(g, 0, 255) - palette[index].g,
+                            std::clamp(r, 0, 255) - palette[index].r,
+                        };
+
+                        for (int c = 0; c < 3; c++)
+                        {
+                            int e = quantizationError[c];
+                            error[c + 3] += 7 * e;
+                            errorBelow[c - 3] += 3 * e;
+                            errorBelow[c] += 5 * e;
+                            errorBelow[c + 3] += e;
+                        }
+                    }
+
+                    progress[i].store(chunkEnd, std::memory_order_release);
+                }
+            }
+        };
+
+        std::vector<std::future<void>> tasks;
+        for (size_t t = 1; t < threads; t++)
+        {
+            tasks.push_back(std::async(std::launch::async, processRows, t));
+        }
+
+        processRows(0);
+
+        for (auto& task : tasks)
+        {
+            task.get();
+        }
+    }
+
+    void DitherToPalette(ImageView img, DitherMode mode, UINT strength, QuantizationOutput& output)
+    {
+        DitherToPalette(img, mode, strength, BuildInverseColorMap(output.palette), output);
+    }
+
+    void DitherToPalette(ImageView img, DitherMode mode, UINT strength, const std::vector<BYTE>& lookup, QuantizationOutput& output)
+    {
+        output.pixels.resize((size_t)img.width * img.height);
+
+        if (mode == DitherMode::Ordered)
+        {
+            DitherOrdered(img, lookup, (int)std::min(strength, 255u), output.pixels);
+        }
+        else
+        {
+            DitherFloydSteinberg(img, output.palette, lookup, output.pixels);
+        }
+    }
 }
@@ -11,6 +11,8 @@ namespace vgc
     struct PaletteColor
     {
         BYTE r, g, b;
+
+        bool operator== (const PaletteColor&) const = default;
     };
 
     /*
@@ -25,14 +27,396 @@ namespace vgc
         UINT bitsPerPixel = 8;
         std::vector<PaletteColor> palette;
         std::vector<BYTE> pixels;
-        BYTE transparentColor;
+        BYTE transparentColor = 0;
     };
 
     /*
-     * A simple and very fast quantizer, useful for testing.
+     * A simple and very fast quantizer, useful for testing. It maps every pixel to the
+     * nearest color of a fixed 6x6x6 color cube, using SSE2 or AVX2 when available.
      */
     struct SimpleQuantizer
     {
-        QuantizationOutput operator() (const ImageData& img) const;
+        QuantizationOutput operator() (ImageView img) const;
+
+        /*
+         * Returns the palette of the color cube, without mapping the image to it.
+         */
+        std::vector<PaletteColor> BuildPalette(ImageView img) const;
+    };
+
+    /*
+     * If the image has at most 255 distinct colors, stores an exact palette with them
+     * (after the transparent index 0) and returns true. The palette has the smallest size
+     * which fits them, so bitsPerPixel may be anywhere from 1 to 8. Returns false as soon
+     * as a 256th color is found.
+     */
+    bool TryQuantizeExactly(ImageView img, QuantizationOutput& output);
+
+    /*
+     * A quantizer for screen content such as terminals, editors and slides, which often
+     * have few colors: frames with at most 255 colors are stored exactly, with fewer bits
+     * per pixel if possible. Other frames are quantized by the fallback quantizer.
+     */
+    template<class Fallback = SimpleQuantizer>
+    class ExactPaletteQuantizer
+    {
+        Fallback m_fallback;
+
+    public:
+        ExactPaletteQuantizer(Fallback fallback = Fallback()) :
+            m_fallback(std::move(fallback))
+        {
+        }
+
+        QuantizationOutput operator() (ImageView img) const
+        {
+            QuantizationOutput output;
+            if (TryQuantizeExactly(img, output))
+            {
+                return output;
+            }
+
+            return m_fallback(img);
+        }
+    };
+
+    /*
+     * Removes the palette entries after the transparent color which no pixel uses, and
+     * reduces bitsPerPixel to the smallest size which fits the rest. The remaining entries
+     * keep their order, and the pixels are renumbered through a table. The transparent
+     * color keeps index 0, even if no pixel uses it. Ordering the entries otherwise, e.g.
+     * by use, wouldn't help: LZW output doesn't depend on which index a color has.
+     */
+    void CompactPalette(QuantizationOutput& quantization);
+
+    /*
+     * A quantizer based on the NeuQuant neural network algorithm by Anthony Dekker (the
+     * one used by ScreenToGif's NeuralQuantizer). A network of 255 neurons is trained on
+     * a sample of the image, one pixel out of every samplingFactor (between 1 and 30;
+     * higher is faster, lower gives better colors). The pixels are then mapped to the
+     * nearest neuron in parallel, in bands of rows. Index 0 stays the transparent color.
+     */
+    class NeuralQuantizer
+    {
+        UINT m_samplingFactor;
+
+    public:
+        NeuralQuantizer(UINT samplingFactor = 10);
+
+        QuantizationOutput operator() (ImageView img) const;
+
+        /*
+         * Trains the network on the image and returns its palette, without mapping the
+         * image to it.
+         */
+        std::vector<PaletteColor> BuildPalette(ImageView img) const;
+    };
+
+    /*
+     * Builds a single palette for a sequence of images, such as all frames of a recording.
+     * The colors of the added images are collected in a histogram with 5 bits per channel,
+     * which is then divided with the median cut algorithm.
+     */
+    class PaletteBuilder
+    {
+        // Number of pixels of each 5-5-5 color, indexed by (r << 10) | (g << 5) | b
+        std::vector<uint64_t> m_histogram;
+
+    public:
+        PaletteBuilder();
+
+        /*
+         * Add the colors of the image to the histogram. Only every step-th pixel of
+         * every step-th row is sampled.
+         */
+        void AddImage(ImageView img, UINT step = 1);
+
+        /*
+         * Returns a palette of 256 entries. Index 0 is reserved for the transparent color,
+         * and up to maxColors (at most 255) of the following entries hold the colors
+         * found by the median cut. Unused entries are black.
+         */
+        std::vector<PaletteColor> Build(UINT maxColors = 255) const;
+    };
+
+    /*
+     * An adaptive quantizer, which builds a palette for each image with the median cut
+     * algorithm (see PaletteBuilder), from every sampleStep-th pixel of every
+     * sampleStep-th row. Pixels are then mapped through a 5-5-5 inverse color map,
+     * whose entries are computed the first time a color needs them.
+     */
+    class MedianCutQuantizer
+    {
+        UINT m_sampleStep;
+
+    public:
+        MedianCutQuantizer(UINT sampleStep = 2);
+
+        QuantizationOutput operator() (ImageView img) const;
+
+        /*
+         * Returns the palette built for the image, without mapping the image to it.
+         */
+        std::vector<PaletteColor> BuildPalette(ImageView img) const;
+    };
+
+    /*
+     * A quantizer which maps every image to the same given palette, so all frames share
+     * their colors. The palette must have 256 entries, and index 0 is never used for
+     * opaque pixels. The nearest palette color of each 5-5-5 color is precomputed.
+     */
+    class FixedPaletteQuantizer
+    {
+        std::vector<PaletteColor> m_palette;
+
+        // Palette index for each 5-5-5 color, indexed like PaletteBuilder's histogram
+        std::vector<BYTE> m_lookup;
+
+    public:
+        FixedPaletteQuantizer(std::vector<PaletteColor> palette);
+
+        QuantizationOutput operator() (ImageView img) const;
+
+        const std::vector<PaletteColor>& Palette() const
+        {
+            return m_palette;
+        }
+
+        std::vector<PaletteColor> BuildPalette(ImageView) const
+        {
+            return m_palette;
+        }
+    };
+
+    /*
+     * Returns the palette which the quantizer would use for the image, with bitsPerPixel
+     * set but no pixels. Quantizers which can choose a palette without mapping the image
+     * to it have a BuildPalette function; the image is quantized with the other ones.
+     */
+    template<class Quantizer>
+    QuantizationOutput QuantizePalette(const Quantizer& quantizer, ImageView img)
+    {
+        QuantizationOutput output;
+
+        if constexpr (requires { quantizer.BuildPalette(img); })
+        {
+            output.palette = quantizer.BuildPalette(img);
+            output.bitsPerPixel = std::max(1, (int)std::bit_width(output.palette.size() - 1));
+        }
+        else
+        {
+            output = quantizer(img);
+            output.pixels.clear();
+        }
+
+        return output;
+    }
+
+    /*
+     * Returns the nearest palette index of each 5-5-5 color, indexed like PaletteBuilder's
+     * histogram. The transparent index 0 is never used.
+     */
+    std::vector<BYTE> BuildInverseColorMap(const std::vector<PaletteColor>& palette);
+
+    /*
+     * A palette, with its inverse color map and statistics of the image it was built for.
+     * Another image fits it unless it drifted too far: when more than driftThreshold of
+     * its pixels have colors which the reference image didn't have (compared on a 4-4-4
+     * grid), or when the mean quantization error grows well beyond the one of the
+     * reference image. Both are estimated from a sample of pixels.
+     */
+    class TemporalPalette
+    {
+        std::vector<PaletteColor> m_palette;
+        std::vector<BYTE> m_lookup;
+
+        // Whether each 4-4-4 color occurs in the sample of the reference image
+        std::vector<bool> m_coverage;
+        double m_referenceError;
+
+    public:
+        TemporalPalette(ImageView img, std::vector<PaletteColor> palette);
+
+        bool Fits(ImageView img, double driftThreshold) const;
+
+        /*
+         * Maps the pixels of the image to the palette, whether it fits or not.
+         */
+        QuantizationOutput Map(ImageView img) const;
+    };
+
+    /*
+     * A quantizer which maps images to a given TemporalPalette.
+     */
+    class TemporalPaletteQuantizer
+    {
+        std::shared_ptr<const TemporalPalette> m_palette;
+
+    public:
+        TemporalPaletteQuantizer(std::shared_ptr<const TemporalPalette> palette) :
+            m_palette(std::move(palette))
+        {
+        }
+
+        QuantizationOutput operator() (ImageView img) const
+        {
+            return m_palette->Map(img);
+        }
+    };
+
+    /*
+     * A quantizer which keeps the palette built by another quantizer for the following
+     * frames, as long as they don't drift from it (see TemporalPalette), and only maps
+     * their pixels. This saves rebuilding palettes for frames which barely change, and
+     * keeps the indices stable between frames, which helps LZW and delta frames. Only
+     * the palette of the other quantizer is computed (see QuantizePalette).
+     *
+     * The GIF encoders call ForFrame with each whole frame, in order, and quantize the
+     * frame or its changed rectangle with the result, possibly on another thread. So the
+     * palettes don't depend on how threads are scheduled, and the small rectangles of
+     * delta frames don't cause rebuilds.
+     */
+    template<class Quantizer>
+    class TemporalQuantizer
+    {
+        // Smaller images, such as the placeholder pixel of an unchanged delta frame,
+        // are too small to tell a drift, and are mapped to the current palette
+        static constexpr size_t s_minDriftPixels = 1024;
+
+        struct State
+        {
+            std::mutex mutex;
+            std::shared_ptr<const TemporalPalette> palette;
+            size_t rebuilds = 0;
+        };
+
+        Quantizer m_quantizer;
+        double m_driftThreshold;
+        std::unique_ptr<State> m_state;
+
+    public:
+        TemporalQuantizer(Quantizer quantizer = Quantizer(), double driftThreshold = 0.02) :
+            m_quantizer(std::move(quantizer)),
+            m_driftThreshold(driftThreshold),
+            m_state(std::make_unique<State>())
+        {
+        }
+
+        /*
+         * Chooses the palette of the next frame: the current one, unless the image
+         * drifted from it, otherwise a new one built for the image. Returns a quantizer
+         * which maps the image, or a part of it, to that palette.
+         */
+        TemporalPaletteQuantizer ForFrame(ImageView img) const
+        {
+            std::lock_guard lock(m_state->mutex);
+
+            const bool tiny = (size_t)img.width * img.height < s_minDriftPixels;
+            if (!m_state->palette || (!tiny && !m_state->palette->Fits(img, m_driftThreshold)))
+            {
+                m_state->palette = std::make_shared<const TemporalPalette>(img, QuantizePalette(m_quantizer, img).palette);
+                m_state->rebuilds++;
+            }
+
+            return TemporalPaletteQuantizer(m_state->palette);
+        }
+
+        /*
+         * Quantizes the image as the next frame, see ForFrame.
+         */
+        QuantizationOutput operator() (ImageView img) const
+        {
+            return ForFrame(img)(img);
+        }
+
+        /*
+         * Returns how many times the palette was built by the wrapped quantizer.
+         */
+        size_t PaletteRebuilds() const
+        {
+            std::lock_guard lock(m_state->mutex);
+            return m_state->rebuilds;
+        }
+    };
+
+    enum class DitherMode
+    {
+        // An 8x8 Bayer matrix, whose offsets are strength wide. Rows are mapped in parallel.
+        Ordered,
+
+        // Floyd-Steinberg error diffusion. Rows are processed as a wavefront, each thread
+        // following the row above it two pixels behind, so the result doesn't depend on
+        // the number of threads.
+        FloydSteinberg,
+    };
+
+    /*
+     * Maps the pixels of the image again to the palette of the given quantization output,
+     * with dithering. Index 0 stays unused.
+     */
+    void DitherToPalette(ImageView img, DitherMode mode, UINT strength, QuantizationOutput& output);
+
+    /*
+     * Same as above, with the inverse color map of the palette already built by
+     * BuildInverseColorMap.
+     */
+    void DitherToPalette(ImageView img, DitherMode mode, UINT strength, const std::vector<BYTE>& lookup, QuantizationOutput& output);
+
+    /*
+     * A quantizer which uses the palette of another quantizer, and dithers the image to it.
+     * For example, SimpleGifEncoder<Dithered<MedianCutQuantizer>>. The strength only
+     * applies to ordered dithering; the default suits palettes with a few dozen levels
+     * per channel, and the color cube of SimpleQuantizer (51 apart) may use more.
+     *
+     * Only the palette of the other quantizer is computed (see QuantizePalette). The
+     * inverse color map of the last palette is kept, so quantizers with a fixed palette
+     * only build it once.
+     */
+    template<class Quantizer, DitherMode mode = DitherMode::FloydSteinberg>
+    class Dithered
+    {
+        struct LookupCache
+        {
+            std::mutex mutex;
+            std::vector<PaletteColor> palette;
+            std::shared_ptr<const std::vector<BYTE>> lookup;
+        };
+
+        Quantizer m_quantizer;
+        UINT m_strength;
+        std::unique_ptr<LookupCache> m_cache;
+
+        std::shared_ptr<const std::vector<BYTE>> Lookup(const std::vector<PaletteColor>& palette) const
+        {
+            {
+                std::lock_guard lock(m_cache->mutex);
+                if (m_cache->lookup && m_cache->palette == palette)
+                {
+                    return m_cache->lookup;
+                }
+            }
+
+            auto lookup = std::make_shared<const std::vector<BYTE>>(BuildInverseColorMap(palette));
+
+            std::lock_guard lock(m_cache->mutex);
+            m_cache->palette = palette;
+            m_cache->lookup = lookup;
+            return lookup;
+        }
+
+    public:
+        Dithered(Quantizer quantizer = Quantizer(), UINT strength = 32) :
+            m_quantizer(std::move(quantizer)),
+            m_strength(strength),
+            m_cache(std::make_unique<LookupCache>())
+        {
+        }
+
+        QuantizationOutput operator() (ImageView img) const
+        {
+            auto output = QuantizePalette(m_quantizer, img);
+            DitherToPalette(img, mode, m_strength, *Lookup(output.palette), output);
+            return output;
+        }
     };
 }
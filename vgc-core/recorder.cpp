@@ -2,33 +2,62 @@
 
 namespace vgc
 {
-	void PrimaryScreenRecorder::PersistImage(ImageData& image)
+	void PrimaryScreenRecorder::PersistImage(ImageData& image, UINT number, Timestamp timestamp)
 	{
 		// This was done to avoid copies of ImageData
 		// Very explicit lifetime control is needed.
 		ImageData* imageLocal = new ImageData(0, 0);
 		std::swap(image, *imageLocal);
 
+		// Changes are found in the order frames are captured, only their compression
+		// is done in parallel
+		FrameDelta* deltaLocal = nullptr;
+		if (m_format == IntermediateFormat::FrameDeltas)
+		{
+			deltaLocal = new FrameDelta(m_deltaEncoder.ComputeDelta(std::move(*imageLocal)));
+		}
+
+		// Frames are compressed in parallel, so they may be appended out of order
 		auto task = [=]()
 		{
-			WCHAR pathBuffer[MAX_PATH];
-			WCHAR fileNameBuffer[MAX_PATH];
-			GetTempPathW(MAX_PATH, pathBuffer);
-			UINT status = GetTempFileNameW(pathBuffer, L"vgc", 0, fileNameBuffer);
+			std::vector<BYTE> encoded;
+			HRESULT result;
 
-			if (status == 0)
+			switch (m_format)
 			{
-				delete imageLocal;
-				return std::wstring();
+			case IntermediateFormat::Png:
+				result = SaveImageAsPngToMemory(*imageLocal, encoded);
+				break;
+			case IntermediateFormat::FrameDeltas:
+				result = EncodeFrameDelta(*deltaLocal, encoded);
+				break;
+			default:
+				result = EncodeFrame(*imageLocal, encoded);
+				break;
 			}
 
-			SaveImageAsPngFileW(*imageLocal, fileNameBuffer);
 			delete imageLocal;
+			delete deltaLocal;
 
-			return std::wstring(fileNameBuffer);
+			try
+			{
+				if (SUCCEEDED(result))
+				{
+					m_storeWriter->Append(number, timestamp, encoded.data(), encoded.size());
+				}
+			}
+			catch (HRESULT hr)
+			{
+				result = hr;
+			}
+
+			if (FAILED(result))
+			{
+				std::cerr << "Failed to save frame " << number << '\n';
+			}
 		};
 
-		m_persistFileNames.push_back(std::async(task));
+		m_pendingFrames.push_back(std::async(task));
 	}
 
 	void PrimaryScreenRecorder::SaveFrame()
@@ -37,7 +66,7 @@ namespace vgc
 		m_screenCapture.OutputSubregion(m_texture, m_area, 0, 0);
 		auto image = D3D11::TextureToImage(m_texture);
 		std::cerr << "Saving frame " << m_frameTimestamps.size() << '\n';
-		PersistImage(image);
+		PersistImage(image, (UINT)m_frameTimestamps.size(), m_screenCapture.GetLastFrameTime());
 		m_frameTimestamps.emplace_back(m_screenCapture.GetLastFrameTime());
 	}
 
@@ -73,14 +102,25 @@ namespace vgc
 		}
 	}
 
-	PrimaryScreenRecorder::PrimaryScreenRecorder(RECT area, double fpsLimit) :
+	PrimaryScreenRecorder::PrimaryScreenRecorder(RECT area, double fpsLimit, IntermediateFormat format) :
 		m_area(area),
 		m_screenCapture(0),
 		m_state(Idle),
 		m_recordingStartTime(-1),
 		m_fpsLimit(fpsLimit),
+		m_format(format),
 		m_stopTime(0)
 	{
+		WCHAR pathBuffer[MAX_PATH];
+		WCHAR fileNameBuffer[MAX_PATH];
+		GetTempPathW(MAX_PATH, pathBuffer);
+		if (GetTempFileNameW(pathBuffer, L"vgc", 0, fileNameBuffer) == 0)
+		{
+			throw HRESULT_FROM_WIN32(GetLastError());
+		}
+
+		m_storePath = fileNameBuffer;
+		m_storeWriter = std::make_unique<FrameStoreWriter>(m_storePath.c_str(), area.right - area.left, area.bottom - area.top);
 		m_texture = D3D11::CreateCPUTexture(area.right - area.left, area.bottom - area.top, m_screenCapture.GetPixelFormat());
 		m_worker = std::thread([&]() { Worker(); });
 	}
@@ -105,32 +145,165 @@ namespace vgc
 		}
 	}
 
-	void PrimaryScreenRecorder::ExportToGif(LPCWSTR filePath)
+	const FrameStoreReader& PrimaryScreenRecorder::OpenFrameStore()
+	{
+		if (!m_storeReader)
+		{
+			for (auto& frame : m_pendingFrames)
+			{
+				frame.get();
+			}
+
+			m_pendingFrames.clear();
+			m_storeWriter->Close();
+			m_storeReader = std::make_unique<FrameStoreReader>(m_storePath.c_str());
+		}
+
+		return *m_storeReader;
+	}
+
+	template<class Counts, class Func>
+	void PrimaryScreenRecorder::ForEachStoredFrame(const FrameStoreReader& store, const Counts& counts, Func func) const
+	{
+		// Deltas apply to the previous frame, so with them, every frame is decoded
+		FrameDeltaDecoder deltas;
+
+		for (size_t i = 0; i < store.FrameCount(); i++)
+		{
+			auto frame = store.Frame(i);
+
+			if (m_format == IntermediateFormat::FrameDeltas)
+			{
+				// After a frame which failed to save, deltas can't be applied until the
+				// next keyframe, and the last frame is repeated in place of them
+				if (i > 0 && frame.number != store.Frame(i - 1).number + 1)
+				{
+					deltas.SkipFrame();
+				}
+
+				if (FAILED(deltas.Decode(frame.data, frame.size)))
+				{
+					std::cerr << "Failed to decode frame " << frame.number << '\n';
+				}
+
+				if (counts[i] > 0)
+				{
+					func(i, ImageView(deltas.Frame()));
+				}
+			}
+			else if (counts[i] > 0)
+			{
+				// Each frame gets its own image, so func can take it over
+				ImageData img(0, 0);
+				HRESULT result = m_format == IntermediateFormat::Png ?
+					LoadImageFromPngMemory(img, frame.data, frame.size) :
+					DecodeFrame(img, frame.data, frame.size);
+
+				if (FAILED(result))
+				{
+					std::cerr << "Failed to decode frame " << frame.number << '\n';
+					continue;
+				}
+
+				func(i, std::move(img));
+			}
+		}
+	}
+
+	void PrimaryScreenRecorder::ExportToGif(LPCWSTR filePath, bool globalPalette)
 	{
 		std::unique_lock lock(m_mutex);
 		m_cv.wait(lock, [&]() { return m_state == Stopped; });
 
-		SimpleGifEncoder<SimpleQuantizer> gif(filePath, m_area.right - m_area.left, m_area.bottom - m_area.top);
+		GifEncoderOptions options;
+		options.deltaFrames = true;
 
-		auto delays = TimestampsToGifDelays(m_frameTimestamps, m_stopTime);
+		const UINT width = m_area.right - m_area.left;
+		const UINT height = m_area.bottom - m_area.top;
 
-		for (size_t i = 0; i < m_persistFileNames.size(); i++)
+		try
 		{
-			auto fileName = m_persistFileNames[i].get();
-			if (delays[i] > 0)
+			auto& store = OpenFrameStore();
+			auto delays = TimestampsToGifDelays(store.Timestamps(), m_stopTime);
+			HRESULT result;
+
+			if (globalPalette)
 			{
-				ImageData img(0, 0);
-				auto image = LoadImageFromPngFileW(img, fileName.c_str());
-				std::wcerr << i << L" -> " << fileName << L"\n";
-				gif.AddFrame(img, delays[i]);
+				// Sample every other pixel of every other row of all exported frames
+				PaletteBuilder paletteBuilder;
+				ForEachStoredFrame(store, delays, [&](size_t i, ImageView img)
+				{
+					paletteBuilder.AddImage(img, 2);
+				});
+
+				options.globalPalette = paletteBuilder.Build();
+				FixedPaletteQuantizer quantizer(options.globalPalette);
+
+				ParallelGifEncoder<FixedPaletteQuantizer> gif(filePath, width, height, std::move(quantizer), options);
+				ForEachStoredFrame(store, delays, [&](size_t i, auto&& img)
+				{
+					gif.AddFrame(std::forward<decltype(img)>(img), delays[i]);
+				});
+
+				result = gif.Finish();
 			}
 			else
 			{
-				std::cerr << "Skipped frame " << i << '\n';
+				ParallelGifEncoder<ExactPaletteQuantizer<SimpleQuantizer>> gif(filePath, width, height, options);
+				ForEachStoredFrame(store, delays, [&](size_t i, auto&& img)
+				{
+					gif.AddFrame(std::forward<decltype(img)>(img), delays[i]);
+				});
+
+				result = gif.Finish();
+			}
+
+			if (FAILED(result))
+			{
+				std::cerr << "Failed to encode the GIF, it only holds the frames before the error\n";
 			}
-			
-			DeleteFileW(fileName.c_str());
 		}
+		catch (HRESULT)
+		{
+			std::cerr << "Failed to read the recorded frames\n";
+		}
+
+		// Nothing reuses the buffers of the exported frames until the next export
+		FrameBufferPool::Trim();
+	}
+
+	HRESULT PrimaryScreenRecorder::ExportToMp4(LPCWSTR filePath, const VideoExportOptions& options)
+	{
+		std::unique_lock lock(m_mutex);
+		m_cv.wait(lock, [&]() { return m_state == Stopped; });
+
+		const UINT width = m_area.right - m_area.left;
+		const UINT height = m_area.bottom - m_area.top;
+
+		HRESULT result = S_OK;
+
+		try
+		{
+			auto& store = OpenFrameStore();
+			auto counts = TimestampsToFrameCounts(store.Timestamps(), m_stopTime, options.frameRate);
+
+			VideoPipeEncoder video(FfmpegCommandLine(options, width, height, filePath), width, height, options.matrix);
+
+			// Decoding the next frame overlaps writing the previous one to ffmpeg
+			ForEachStoredFrame(store, counts, [&](size_t i, ImageView img)
+			{
+				video.AddFrame(img, counts[i]);
+			});
+
+			result = video.Finish();
+		}
+		catch (HRESULT hr)
+		{
+			result = hr;
+		}
+
+		FrameBufferPool::Trim();
+		return result;
 	}
 
 	PrimaryScreenRecorder::~PrimaryScreenRecorder()
@@ -139,5 +312,19 @@ namespace vgc
 		m_cv.wait(lock, [&]() { return m_state == Stopped; });
 		m_worker.join();
 		SafeRelease(m_texture);
+
+		// The frames are kept until now, so they can be exported several times
+		for (auto& frame : m_pendingFrames)
+		{
+			frame.get();
+		}
+
+		m_storeReader.reset();
+		m_storeWriter.reset();
+		DeleteFileW(m_storePath.c_str());
+
+		// Release the last frame kept by the delta encoder before emptying the pool
+		m_deltaEncoder = FrameDeltaEncoder();
+		FrameBufferPool::Trim();
 	}
 }
\ No newline at end of file
@@ -5,9 +5,26 @@
 #include "screen-capture.h"
 #include "png.h"
 #include "gif.h"
+#include "video-export.h"
+#include "frame-store.h"
+#include "frame-codec.h"
+#include "frame-delta.h"
 
 namespace vgc
 {
+	/*
+	 * How recorded frames are compressed until they're exported. All are lossless, but
+	 * deflating PNG files can't keep up with high frame rates on large screens. Frame
+	 * deltas only store the tiles which changed since the previous frame, with periodic
+	 * keyframes, which takes much less space when most of the screen is static.
+	 */
+	enum class IntermediateFormat
+	{
+		FrameCodec,
+		Png,
+		FrameDeltas,
+	};
+
 	class PrimaryScreenRecorder
 	{
 		enum RecordingState
@@ -22,6 +39,7 @@ namespace vgc
 		RecordingState m_state;
 		Timestamp m_recordingStartTime;
 		double m_fpsLimit;
+		IntermediateFormat m_format;
 		ID3D11Texture2D* m_texture;
 		Timestamp m_stopTime;
 
@@ -29,18 +47,48 @@ namespace vgc
 		std::thread m_worker;
 		std::condition_variable m_cv;
 
-		std::vector<std::future<std::wstring>> m_persistFileNames;
+		// Recorded frames are compressed into a single frame store, which is
+		// memory-mapped for exports once the recording is over
+		std::wstring m_storePath;
+		std::unique_ptr<FrameStoreWriter> m_storeWriter;
+		std::unique_ptr<FrameStoreReader> m_storeReader;
+		std::vector<std::future<void>> m_pendingFrames;
+		FrameDeltaEncoder m_deltaEncoder;
 		std::vector<Timestamp> m_frameTimestamps;
 
-		void PersistImage(ImageData& image);
+		void PersistImage(ImageData& image, UINT number, Timestamp timestamp);
 		void SaveFrame();
 		void Worker();
+		const FrameStoreReader& OpenFrameStore();
+
+		/*
+		 * Decodes the stored frames in order, and calls func(i, img) for each frame i
+		 * whose count is positive. img is a new ImageData, passed as an rvalue so func
+		 * can take it over, or an ImageView of the frame kept by the decoder of frame
+		 * deltas. Frames which fail to decode are skipped, except for deltas, where the
+		 * last decoded frame is repeated.
+		 */
+		template<class Counts, class Func>
+		void ForEachStoredFrame(const FrameStoreReader& store, const Counts& counts, Func func) const;
 
 	public:
-		PrimaryScreenRecorder(RECT area, double fpsLimit = 50);
+		PrimaryScreenRecorder(RECT area, double fpsLimit = 50, IntermediateFormat format = IntermediateFormat::FrameCodec);
 		void Start();
 		void Stop();
-		void ExportToGif(LPCWSTR filePath);
+
+		/*
+		 * Export the recorded frames to a GIF file. If globalPalette is set, the frames are
+		 * read twice: once to build a single palette for the whole recording, and once to
+		 * encode them with it, without local color tables.
+		 */
+		void ExportToGif(LPCWSTR filePath, bool globalPalette = false);
+
+		/*
+		 * Export the recorded frames to an MP4 file by streaming them to ffmpeg, at a constant
+		 * frame rate. Frames are repeated or dropped to follow their timestamps. Returns an
+		 * error if ffmpeg can't be started or fails.
+		 */
+		HRESULT ExportToMp4(LPCWSTR filePath, const VideoExportOptions& options = {});
 		~PrimaryScreenRecorder();
 	};
 }
\ No newline at end of file
@@ -0,0 +1,379 @@
+#include "resample.h"
+#include "parallel.h"
+#include <cmath>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define VGC_SSE2
+#endif
+
+namespace vgc
+{
+    /*
+     * The source pixels which contribute to each output pixel along one axis, and their
+     * weights, which add up to 1. Output pixel i uses count[i] pixels starting at
+     * first[i], with weights starting at weights[i * maxCount].
+     */
+    struct Contributions
+    {
+        std::vector<UINT> first;
+        std::vector<UINT> count;
+        std::vector<float> weights;
+        UINT maxCount = 0;
+    };
+
+    static double FilterRadius(ResampleFilter filter)
+    {
+        return filter == ResampleFilter::Lanczos3 ? 3.0 : 1.0;
+    }
+
+    static double FilterWeight(ResampleFilter filter, double x)
+    {
+        x = std::abs(x);
+
+        if (filter == ResampleFilter::Bilinear)
+        {
+            return x < 1 ? 1 - x : 0;
+        }
+
+        if (x >= 3)
+        {
+            return 0;
+        }
+
+        if (x < 1e-8)
+        {
+            return 1;
+        }
+
+        constexpr double pi = 3.14159265358979323846;
+        return 3 * std::sin(pi * x) * std::sin(pi * x / 3) / (pi * pi * x * x);
+    }
+
+    static Contributions ComputeContributions(UINT sourceSize, UINT size, ResampleFilter filter)
+    {
+        const double scale = (double)sourceSize / size;
+
+        // A range of source pixels for each output pixel, clamped to the image
+        std::vector<std::pair<UINT, std::vector<double>>> ranges(size);
+
+        for (UINT i = 0; i < size; i++)
+        {
+            auto& [first, weights] = ranges[i];
+
+            if (filter == ResampleFilter::Box)
+            {
+                // The source interval covered by the output pixel
+                double begin = i * scale;
+                double end = (i + 1) * scale;
+
+                first = (UINT)begin;
+                UINT last = std::min(sourceSize, (UINT)std::ceil(end));
+
+                for (UINT k = first; k < last; k++)
+                {
+                    weights.push_back(std::min(end, k + 1.0) - std::max(begin, (double)k));
+                }
+            }
+            else
+            {
+                // Downscaling stretches the filter over the pixels of the source interval
+                double filterScale = std::max(scale, 1.0);
+                double support = FilterRadius(filter) * filterScale;
+                double center = (i + 0.5) * scale;
+
+                first = (UINT)std::max(0.0, std::floor(center - support + 0.5));
+                UINT last = (UINT)std::min((double)sourceSize, std::floor(center + support + 0.5));
+
+                for (UINT k = first; k < last; k++)
+                {
+                    weights.push_back(FilterWeight(filter, (k + 0.5 - center) / filterScale));
+                }
+            }
+
+            // Drop zero weights at the ends, e.g. from the zeros of the filter
+            while (!weights.empty() && weights.back() == 0)
+            {
+                weights.pop_back();
+            }
+
+            while (!weights.empty() && weights.front() == 0)
+            {
+                weights.erase(weights.begin());
+                first++;
+            }
+
+            if (weights.empty())
+            {
+                first = std::min(first, sourceSize - 1);
+                weights.push_back(1);
+            }
+        }
+
+        Contributions result;
+        result.first.resize(size);
+        result.count.resize(size);
+
+        for (auto& [first, weights] : ranges)
+        {
+            result.maxCount = std::max(result.maxCount, (UINT)weights.size());
+        }
+
+        result.weights.resize((size_t)size * result.maxCount);
+
+        for (UINT i = 0; i < size; i++)
+        {
+            auto& [first, weights] = ranges[i];
+            double total = 0;
+
+            for (double weight : weights)
+            {
+                total += weight;
+            }
+
+            result.first[i] = first;
+            result.count[i] = (UINT)weights.size();
+
+            for (size_t k = 0; k < weights.size(); k++)
+            {
+                result.weights[(size_t)i * result.maxCount + k] = (float)(weights[k] / total);
+            }
+        }
+
+        return result;
+    }
+
+    /*
+     * Adds the weighted channel values of a row of BGRA pixels to a row of floats.
+     */
+    static void AccumulateRow(const BYTE* row, float weight, float* sums, size_t values)
+    {
+        size_t k = 0;
+
+#ifdef VGC_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 w = _mm_set1_ps(weight);
+
+        for (; k + 16 <= values; k += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + k));
+            __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            __m128i high = _mm_unpackhi_epi8(bytes, zero);
+
+            __m128i parts[4] =
+            {
+                _mm_unpacklo_epi16(low, zero),
+                _mm_unpackhi_epi16(low, zero),
+                _mm_unpacklo_epi16(high, zero),
+                _mm_unpackhi_epi16(high, zero),
+            };
+
+            for (int p = 0; p < 4; p++)
+            {
+                __m128 sum = _mm_loadu_ps(sums + k + 4 * p);
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_cvtepi32_ps(parts[p]), w));
+                _mm_storeu_ps(sums + k + 4 * p, sum);
+            }
+        }
+#endif
+
+        for (; k < values; k++)
+        {
+            sums[k] += row[k] * weight;
+        }
+    }
+
+    /*
+     * Filters a row of channel values horizontally into a row of BGRA pixels.
+     */
+    static void FilterRow(const float* sums, const Contributions& horizontal, BYTE* out, UINT width)
+    {
+        for (UINT j = 0; j < width; j++)
+        {
+            const float* pixel = sums + 4ull * horizontal.first[j];
+            const float* weights = &horizontal.weights[(size_t)j * horizontal.maxCount];
+            const UINT count = horizontal.count[j];
+
+#ifdef VGC_SSE2
+            __m128 sum = _mm_setzero_ps();
+
+            for (UINT k = 0; k < count; k++)
+            {
+                sum = _mm_add_ps(sum, _mm_mul_ps(_mm_loadu_ps(pixel + 4 * k), _mm_set1_ps(weights[k])));
+            }
+
+            // Round, and saturate to bytes
+            __m128i values = _mm_cvtps_epi32(sum);
+            values = _mm_packs_epi32(values, values);
+            values = _mm_packus_epi16(values, values);
+            int packed = _mm_cvtsi128_si32(values);
+            memcpy(out + 4ull * j, &packed, 4);
+#else
+            for (UINT c = 0; c < 4; c++)
+            {
+                float sum = 0;
+
+                for (UINT k = 0; k < count; k++)
+                {
+                    sum += pixel[4 * k + c] * weights[k];
+                }
+
+                out[4 * j + c] = (BYTE)std::clamp(std::lrint(sum), 0l, 255l);
+            }
+#endif
+        }
+    }
+
+    static ImageData ResizeSeparable(ImageView img, UINT width, UINT height, ResampleFilter filter)
+    {
+        ImageData result(width, height, ImageData::Uninitialized);
+
+        const Contributions horizontal = ComputeContributions(img.width, width, filter);
+        const Contributions vertical = ComputeContributions(img.height, height, filter);
+
+        ParallelForBands(height, [&](size_t begin, size_t end)
+        {
+            std::vector<float> sums(4ull * img.width);
+
+            for (size_t i = begin; i < end; i++)
+            {
+                std::fill(sums.begin(), sums.end(), 0.0f);
+
+                const float* weights = &vertical.weights[i * vertical.maxCount];
+                for (UINT k = 0; k < vertical.count[i]; k++)
+                {
+                    AccumulateRow(img[(size_t)vertical.first[i] + k], weights[k], sums.data(), sums.size());
+                }
+
+                FilterRow(sums.data(), horizontal, result[i], width);
+            }
+        }, 8);
+
+        return result;
+    }
+
+    /*
+     * Adds a row of channel values to a row of integer sums.
+     */
+    static void AddRow(const BYTE* row, uint32_t* sums, size_t values)
+    {
+        size_t k = 0;
+
+#ifdef VGC_SSE2
+        const __m128i zero = _mm_setzero_si128();
+
+        for (; k + 16 <= values; k += 16)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + k));
+            __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            __m128i high = _mm_unpackhi_epi8(bytes, zero);
+
+            __m128i parts[4] =
+            {
+                _mm_unpacklo_epi16(low, zero),
+                _mm_unpackhi_epi16(low, zero),
+                _mm_unpacklo_epi16(high, zero),
+                _mm_unpackhi_epi16(high, zero),
+            };
+
+            for (int p = 0; p < 4; p++)
+            {
+                __m128i* sum = reinterpret_cast<__m128i*>(sums + k + 4 * p);
+                _mm_storeu_si128(sum, _mm_add_epi32(_mm_loadu_si128(sum), parts[p]));
+            }
+        }
+#endif
+
+        for (; k < values; k++)
+        {
+            sums[k] += row[k];
+        }
+    }
+
+    /*
+     * Area averaging when both dimensions shrink by whole factors: every output pixel is
+     * the rounded mean of a block of factorX by factorY source pixels.
+     */
+    static ImageData ResizeBoxInteger(ImageView img, UINT width, UINT height)
+    {
+        ImageData result(width, height, ImageData::Uninitialized);
+
+        const UINT factorX = img.width / width;
+        const UINT factorY = img.height / height;
+        const uint32_t area = factorX * factorY;
+
+        // Rounded division by the area, as a multiplication. The sums are below 2^8 times
+        // the area, so the result is exact for areas up to 2^20.
+        const uint64_t reciprocal = ((1ull << 48) + area - 1) / area;
+
+        ParallelForBands(height, [&](size_t begin, size_t end)
+        {
+            std::vector<uint32_t> sums(4ull * img.width);
+
+            for (size_t i = begin; i < end; i++)
+            {
+                std::fill(sums.begin(), sums.end(), 0);
+
+                for (UINT k = 0; k < factorY; k++)
+                {
+                    AddRow(img[i * factorY + k], sums.data(), sums.size());
+                }
+
+                BYTE* out = result[i];
+                const uint32_t* block = sums.data();
+
+                for (UINT j = 0; j < width; j++, block += 4 * factorX)
+                {
+#ifdef VGC_SSE2
+                    __m128i sum = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+                    for (UINT k = 1; k < factorX; k++)
+                    {
+                        sum = _mm_add_epi32(sum, _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + 4 * k)));
+                    }
+
+                    alignas(16) uint32_t total[4];
+                    _mm_store_si128(reinterpret_cast<__m128i*>(total), sum);
+#else
+                    uint32_t total[4] = {};
+
+                    for (UINT k = 0; k < factorX; k++)
+                    {
+                        for (UINT c = 0; c < 4; c++)
+                        {
+                            total[c] += block[4 * k + c];
+                        }
+                    }
+#endif
+
+                    for (UINT c = 0; c < 4; c++)
+                    {
+                        out[4 * j + c] = (BYTE)(((total[c] + area / 2) * reciprocal) >> 48);
+                    }
+                }
+            }
+        }, 8);
+
+        return result;
+    }
+
+    ImageData ResizeImage(ImageView img, UINT width, UINT height, ResampleFilter filter)
+    {
+        if (!width || !height || !img.width || !img.height)
+        {
+            return ImageData(width, height);
+        }
+
+        if (width == img.width && height == img.height)
+        {
+            return ImageData(img);
+        }
+
+        if (filter == ResampleFilter::Box && img.width % width == 0 && img.height % height == 0 &&
+            (uint64_t)(img.width / width) * (img.height / height) <= (1 << 20))
+        {
+            return ResizeBoxInteger(img, width, height);
+        }
+
+        return ResizeSeparable(img, width, height, filter);
+    }
+}
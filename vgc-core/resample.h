@@ -0,0 +1,33 @@
+#pragma once
+
+#include "pch.h"
+#include "image-data.h"
+
+namespace vgc
+{
+    /*
+     * Filters used by ResizeImage.
+     */
+    enum class ResampleFilter
+    {
+        // Averages the source pixels which each output pixel covers, weighted by the
+        // covered area. When the size divides the source size exactly, an integer
+        // path sums whole blocks of pixels.
+        Box,
+
+        // Linear interpolation between neighbouring pixels, widened when downscaling so
+        // that every source pixel contributes.
+        Bilinear,
+
+        // Windowed sinc with 3 lobes, also widened when downscaling. Keeps text and
+        // edges sharper than the other filters, at a higher cost.
+        Lanczos3,
+    };
+
+    /*
+     * Returns the image resampled to the given size with the given filter. The filter is
+     * applied separately in each direction, and all four channels are filtered alike.
+     * Rows of the result are computed in parallel.
+     */
+    ImageData ResizeImage(ImageView img, UINT width, UINT height, ResampleFilter filter = ResampleFilter::Box);
+}
@@ -199,73 +199,73 @@ namespace vgc {
 
     ImageData D3D11::TextureToImage(ID3D11Texture2D* texture)
     {
-        ID3D11Texture2D* textureCPU = nullptr;
+        MappedTexture mapped(texture);
+        return ImageData(mapped.View());
+    }
+
+    ID3D11Texture2D* D3D11::CreateCPUTexture(UINT width, UINT height, DXGI_FORMAT format)
+    {
+        ID3D11Texture2D* texture;
         D3D11_TEXTURE2D_DESC desc;
 
+        desc.Width = width;
+        desc.Height = height;
+        desc.Format = format;
+        desc.ArraySize = 1;
+        desc.BindFlags = 0;
+        desc.MiscFlags = 0;
+        desc.SampleDesc.Count = 1;
+        desc.SampleDesc.Quality = 0;
+        desc.MipLevels = 1;
+        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
+        desc.Usage = D3D11_USAGE_STAGING;
+
+        CheckResult(D3D11::Device()->CreateTexture2D(&desc, NULL, &texture));
+        return texture;
+    }
+
+    MappedTexture::MappedTexture(ID3D11Texture2D* texture) :
+        m_texture(texture)
+    {
+        D3D11_TEXTURE2D_DESC desc;
         texture->GetDesc(&desc);
 
         D3D11_MAPPED_SUBRESOURCE resource;
-        HRESULT hr = DC()->Map(texture, 0, D3D11_MAP_READ_WRITE, 0, &resource);
-        bool failed = FAILED(hr);
+        HRESULT hr = D3D11::DC()->Map(texture, 0, D3D11_MAP_READ, 0, &resource);
 
-        if (failed)
+        if (FAILED(hr))
         {
             // Try again, first copying the texture to a CPU enabled one.
-            D3D11_TEXTURE2D_DESC textureDesc;
-            texture->GetDesc(&textureDesc);
-            textureCPU = CreateCPUTexture(textureDesc.Width, textureDesc.Height, textureDesc.Format);
-            DC()->CopyResource(textureCPU, texture);
-            hr = DC()->Map(textureCPU, 0, D3D11_MAP_READ_WRITE, 0, &resource);
+            m_textureCPU = D3D11::CreateCPUTexture(desc.Width, desc.Height, desc.Format);
+            D3D11::DC()->CopyResource(m_textureCPU, texture);
+            hr = D3D11::DC()->Map(m_textureCPU, 0, D3D11_MAP_READ, 0, &resource);
 
             if (FAILED(hr))
             {
                 // Something's failing, give up
-                SafeRelease(textureCPU);
+                SafeRelease(m_textureCPU);
                 throw hr;
             }
         }
 
-        UINT bytes = resource.DepthPitch;
-        BYTE* raw = reinterpret_cast<BYTE*>(resource.pData);
-
-        ImageData img(desc.Width, desc.Height);
-
-        for (size_t i = 0; i < desc.Height; i++)
-        {
-            auto base = raw + i * resource.RowPitch;
-            std::copy(base, base + 4ull * desc.Width, img[i]);
-        }
+        m_view = ImageView(reinterpret_cast<const BYTE*>(resource.pData), desc.Width, desc.Height, resource.RowPitch);
+    }
 
-        if (failed)
+    MappedTexture::~MappedTexture()
+    {
+        if (m_textureCPU)
         {
-            DC()->Unmap(textureCPU, 0);
-            SafeRelease(textureCPU);
+            D3D11::DC()->Unmap(m_textureCPU, 0);
+            SafeRelease(m_textureCPU);
         }
         else
         {
-            DC()->Unmap(texture, 0);
+            D3D11::DC()->Unmap(m_texture, 0);
         }
-        return img;
     }
 
-    ID3D11Texture2D* D3D11::CreateCPUTexture(UINT width, UINT height, DXGI_FORMAT format)
+    ImageView MappedTexture::View() const
     {
-        ID3D11Texture2D* texture;
-        D3D11_TEXTURE2D_DESC desc;
-
-        desc.Width = width;
-        desc.Height = height;
-        desc.Format = format;
-        desc.ArraySize = 1;
-        desc.BindFlags = 0;
-        desc.MiscFlags = 0;
-        desc.SampleDesc.Count = 1;
-        desc.SampleDesc.Quality = 0;
-        desc.MipLevels = 1;
-        desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
-        desc.Usage = D3D11_USAGE_STAGING;
-
-        CheckResult(D3D11::Device()->CreateTexture2D(&desc, NULL, &texture));
-        return texture;
+        return m_view;
     }
 }
@@ -43,6 +43,30 @@ namespace vgc
         static ID3D11Texture2D* CreateCPUTexture(UINT width, UINT height, DXGI_FORMAT format);
     };
 
+    /*
+     * Maps a Direct3D texture for reading for as long as the object lives, and exposes
+     * its pixels as an ImageView with the texture's row pitch, so they can be quantized,
+     * encoded or saved without being copied into an ImageData. Like TextureToImage,
+     * textures without CPU access are first copied to a temporary CPU texture.
+     */
+    class MappedTexture
+    {
+        ID3D11Texture2D* m_texture{ nullptr };
+        ID3D11Texture2D* m_textureCPU{ nullptr };
+        ImageView m_view;
+
+    public:
+        MappedTexture(ID3D11Texture2D* texture);
+        MappedTexture(const MappedTexture&) = delete;
+        MappedTexture& operator= (const MappedTexture&) = delete;
+        ~MappedTexture();
+
+        /*
+         * Returns the mapped pixels. The view is invalid once this object is destroyed.
+         */
+        ImageView View() const;
+    };
+
     class ScreenCapture
     {
         UINT m_monitorIndex;
@@ -0,0 +1,234 @@
+#include "video-export.h"
+#include "resample.h"
+#include <cmath>
+
+namespace vgc
+{
+    // Large enough for several chunks of a frame to be in flight
+    static constexpr DWORD s_pipeBufferSize = 1 << 20;
+
+    std::vector<UINT> TimestampsToFrameCounts(const std::vector<Timestamp>& timestamps, Timestamp stopTime, double frameRate)
+    {
+        if (timestamps.empty())
+        {
+            return {};
+        }
+
+        const Timestamp start = timestamps[0];
+
+        // The number of video frames which start before the given time
+        auto framesBefore = [&](Timestamp time)
+        {
+            return time <= start ? 0ll : (long long)std::ceil((time - start) * frameRate / 1e9);
+        };
+
+        const size_t n = timestamps.size();
+        std::vector<UINT> result(n);
+        long long total = 0;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            auto finish = i + 1 == n ? stopTime : timestamps[i + 1];
+            result[i] = (UINT)std::max(0ll, framesBefore(finish) - framesBefore(timestamps[i]));
+            total += result[i];
+        }
+
+        // Even the shortest recording shows its first frame
+        if (total == 0)
+        {
+            result[0] = 1;
+        }
+
+        return result;
+    }
+
+    std::wstring FfmpegCommandLine(const VideoExportOptions& options, UINT width, UINT height, const std::wstring& outputPath)
+    {
+        // ffmpeg's names for the colorimetry of each matrix, so players decode it alike
+        const std::wstring colors = options.matrix == YuvMatrix::Bt709 ? L"bt709" : L"smpte170m";
+
+        std::wstring commandLine = L"\"" + options.ffmpegPath + L"\"";
+        commandLine += L" -hide_banner -loglevel error -y";
+        commandLine += L" -f rawvideo -pix_fmt yuv420p -video_size " + std::to_wstring(width) + L"x" + std::to_wstring(height);
+        commandLine += L" -framerate " + std::to_wstring(options.frameRate) + L" -i -";
+
+        // H.264 in 4:2:0 needs even sizes
+        commandLine += L" -vf pad=ceil(iw/2)*2:ceil(ih/2)*2";
+        commandLine += L" -c:v libx264 -crf " + std::to_wstring(options.quality) + L" -pix_fmt yuv420p";
+        commandLine += L" -color_range tv -colorspace " + colors + L" -color_primaries " + colors + L" -color_trc " + colors;
+        commandLine += L" -movflags +faststart \"" + outputPath + L"\"";
+
+        return commandLine;
+    }
+
+    ChildProcess::ChildProcess(const std::wstring& commandLine) :
+        m_process(nullptr),
+        m_input(nullptr)
+    {
+        SECURITY_ATTRIBUTES security{ sizeof(SECURITY_ATTRIBUTES), nullptr, TRUE };
+        HANDLE output = nullptr;
+
+        if (!CreatePipe(&output, &m_input, &security, s_pipeBufferSize))
+        {
+            throw HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        // Only the end read by the child is inherited
+        SetHandleInformation(m_input, HANDLE_FLAG_INHERIT, 0);
+
+        STARTUPINFOW startupInfo{};
+        startupInfo.cb = sizeof(startupInfo);
+        startupInfo.dwFlags = STARTF_USESTDHANDLES;
+        startupInfo.hStdInput = output;
+        startupInfo.hStdOutput = GetStdHandle(STD_OUTPUT_HANDLE);
+        startupInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+        // CreateProcessW may modify the command line
+        std::wstring mutableCommandLine = commandLine;
+        PROCESS_INFORMATION processInformation{};
+
+        BOOL created = CreateProcessW(nullptr, mutableCommandLine.data(), nullptr, nullptr, TRUE, CREATE_NO_WINDOW, nullptr, nullptr, &startupInfo, &processInformation);
+        DWORD error = GetLastError();
+        CloseHandle(output);
+
+        if (!created)
+        {
+            CloseHandle(m_input);
+            throw HRESULT_FROM_WIN32(error);
+        }
+
+        CloseHandle(processInformation.hThread);
+        m_process = processInformation.hProcess;
+    }
+
+    void ChildProcess::Write(const BYTE* data, size_t size)
+    {
+        while (size > 0)
+        {
+            DWORD written = 0;
+            if (!m_input || !WriteFile(m_input, data, (DWORD)std::min<size_t>(size, s_pipeBufferSize), &written, nullptr))
+            {
+                throw m_input ? HRESULT_FROM_WIN32(GetLastError()) : E_FAIL;
+            }
+
+            data += written;
+            size -= written;
+        }
+    }
+
+    DWORD ChildProcess::Wait()
+    {
+        if (m_input)
+        {
+            CloseHandle(m_input);
+            m_input = nullptr;
+        }
+
+        DWORD exitCode = 0;
+        WaitForSingleObject(m_process, INFINITE);
+        GetExitCodeProcess(m_process, &exitCode);
+        return exitCode;
+    }
+
+    ChildProcess::~ChildProcess()
+    {
+        Wait();
+        CloseHandle(m_process);
+    }
+
+    VideoPipeEncoder::VideoPipeEncoder(const std::wstring& commandLine, UINT width, UINT height, YuvMatrix matrix) :
+        m_process(commandLine),
+        m_width(width),
+        m_height(height),
+        m_matrix(matrix),
+        m_currentBuffer(0),
+        m_result(S_OK),
+        m_finished(false)
+    {
+        m_buffers[0].resize(FrameSize(width, height));
+        m_buffers[1].resize(FrameSize(width, height));
+    }
+
+    size_t VideoPipeEncoder::FrameSize(UINT width, UINT height)
+    {
+        return (size_t)width * height + 2ull * ((width + 1) / 2) * ((height + 1) / 2);
+    }
+
+    void VideoPipeEncoder::WaitForPendingWrite()
+    {
+        if (m_pendingWrite.valid())
+        {
+            try
+            {
+                m_pendingWrite.get();
+            }
+            catch (HRESULT hr)
+            {
+                m_result = hr;
+            }
+        }
+    }
+
+    void VideoPipeEncoder::AddFrame(ImageView img, UINT count)
+    {
+        if (m_finished || FAILED(m_result) || count == 0 || !img.width || !img.height)
+        {
+            return;
+        }
+
+        if (img.width != m_width || img.height != m_height)
+        {
+            AddFrame(ResizeImage(img, m_width, m_height), count);
+            return;
+        }
+
+        // The planes of an I420 frame follow each other without padding
+        auto& buffer = m_buffers[m_currentBuffer];
+        const size_t chromaWidth = (m_width + 1) / 2;
+        const size_t chromaSize = chromaWidth * ((m_height + 1) / 2);
+        BYTE* y = buffer.data();
+        BYTE* u = y + (size_t)m_width * m_height;
+        BYTE* v = u + chromaSize;
+
+        ConvertToI420(img, m_matrix, y, m_width, u, chromaWidth, v, chromaWidth);
+
+        // The other buffer is free once its write is done
+        WaitForPendingWrite();
+        if (FAILED(m_result))
+        {
+            return;
+        }
+
+        m_pendingWrite = std::async(std::launch::async, [this, &buffer, count]()
+        {
+            for (UINT k = 0; k < count; k++)
+            {
+                m_process.Write(buffer.data(), buffer.size());
+            }
+        });
+
+        m_currentBuffer ^= 1;
+    }
+
+    HRESULT VideoPipeEncoder::Finish()
+    {
+        if (!m_finished)
+        {
+            m_finished = true;
+            WaitForPendingWrite();
+
+            DWORD exitCode = m_process.Wait();
+            if (SUCCEEDED(m_result) && exitCode != 0)
+            {
+                m_result = E_FAIL;
+            }
+        }
+
+        return m_result;
+    }
+
+    VideoPipeEncoder::~VideoPipeEncoder()
+    {
+        Finish();
+    }
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include "pch.h"
+#include "image-data.h"
+#include "yuv.h"
+
+namespace vgc
+{
+    /*
+     * Options for exporting videos with ffmpeg.
+     */
+    struct VideoExportOptions
+    {
+        // The ffmpeg executable. Without a directory, it's looked up on the PATH.
+        std::wstring ffmpegPath = L"ffmpeg";
+
+        // Frames per second of the exported video. Recorded frames are repeated, or
+        // dropped, to show each of them at the time it was captured.
+        double frameRate = 30;
+
+        // The x264 constant rate factor. Lower values give better quality and larger files.
+        UINT quality = 23;
+
+        YuvMatrix matrix = YuvMatrix::Bt709;
+    };
+
+    /*
+     * Returns, for each frame captured at the given timestamps, the number of frames of
+     * a constant frame rate video which show it, until the given stop time. Frames which
+     * were replaced before the next video frame get 0. Timestamps are in nanoseconds.
+     */
+    std::vector<UINT> TimestampsToFrameCounts(const std::vector<Timestamp>& timestamps, Timestamp stopTime, double frameRate);
+
+    /*
+     * Returns the command line which makes ffmpeg read raw I420 frames of the given size
+     * from its standard input, and encode them to an H.264 MP4 file.
+     */
+    std::wstring FfmpegCommandLine(const VideoExportOptions& options, UINT width, UINT height, const std::wstring& outputPath);
+
+    /*
+     * Runs a command line as a child process whose standard input is a pipe written by
+     * this process. Throws an HRESULT if the process can't be started.
+     */
+    class ChildProcess
+    {
+        HANDLE m_process;
+        HANDLE m_input;
+
+    public:
+        ChildProcess(const std::wstring& commandLine);
+        ChildProcess(const ChildProcess&) = delete;
+        ChildProcess& operator= (const ChildProcess&) = delete;
+
+        /*
+         * Writes to the standard input of the process. Throws an HRESULT if the process
+         * stopped reading it, e.g. because it exited.
+         */
+        void Write(const BYTE* data, size_t size);
+
+        /*
+         * Closes the standard input of the process, waits for it to exit, and returns its
+         * exit code. Calling it again returns the same exit code.
+         */
+        DWORD Wait();
+
+        ~ChildProcess();
+    };
+
+    /*
+     * Streams frames to a child process, such as ffmpeg, as raw I420 video through its
+     * standard input, without intermediate files. Each frame is converted into one of
+     * two buffers while the other one is written to the pipe on another thread, so
+     * loading and converting the next frame overlaps the write of the previous one.
+     */
+    class VideoPipeEncoder
+    {
+        ChildProcess m_process;
+        UINT m_width;
+        UINT m_height;
+        YuvMatrix m_matrix;
+        std::vector<BYTE> m_buffers[2];
+        size_t m_currentBuffer;
+        std::future<void> m_pendingWrite;
+        HRESULT m_result;
+        bool m_finished;
+
+        void WaitForPendingWrite();
+
+    public:
+        /*
+         * Starts the given command line, which will receive frames of the given size.
+         * Throws an HRESULT if the process can't be started.
+         */
+        VideoPipeEncoder(const std::wstring& commandLine, UINT width, UINT height, YuvMatrix matrix = YuvMatrix::Bt709);
+
+        /*
+         * Returns the size of an I420 frame with the given size, in bytes.
+         */
+        static size_t FrameSize(UINT width, UINT height);
+
+        /*
+         * Writes the frame the given number of times. Images of a different size are
+         * resized. After a failed write, frames are ignored, and Finish returns the error.
+         */
+        void AddFrame(ImageView img, UINT count = 1);
+
+        /*
+         * Waits for the pending write, closes the pipe and waits for the process to exit.
+         * Returns the first write error, or E_FAIL if the process exited with a non-zero
+         * exit code. It's also called by the destructor. Calling it again returns the
+         * same result.
+         */
+        HRESULT Finish();
+
+        ~VideoPipeEncoder();
+    };
+}
@@ -0,0 +1,231 @@
+#include "yuv.h"
+#include "parallel.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define VGC_SSE2
+#endif
+
+namespace vgc
+{
+    /*
+     * Fixed point conversion coefficients with 14 fractional bits, in the B, G, R order
+     * of the pixel channels, already scaled to the limited range.
+     */
+    struct YuvCoefficients
+    {
+        int16_t y[3];
+        int16_t u[3];
+        int16_t v[3];
+    };
+
+    static constexpr int16_t ToFixedPoint(double value)
+    {
+        return (int16_t)(value * (1 << 14) + (value < 0 ? -0.5 : 0.5));
+    }
+
+    static constexpr YuvCoefficients MakeCoefficients(double kr, double kb)
+    {
+        const double kg = 1 - kr - kb;
+        const double luma = 219.0 / 255;
+        const double chroma = 224.0 / 255;
+
+        return YuvCoefficients
+        {
+            { ToFixedPoint(kb * luma), ToFixedPoint(kg * luma), ToFixedPoint(kr * luma) },
+            { ToFixedPoint(0.5 * chroma), ToFixedPoint(-kg / (2 * (1 - kb)) * chroma), ToFixedPoint(-kr / (2 * (1 - kb)) * chroma) },
+            { ToFixedPoint(-kb / (2 * (1 - kr)) * chroma), ToFixedPoint(-kg / (2 * (1 - kr)) * chroma), ToFixedPoint(0.5 * chroma) },
+        };
+    }
+
+    static constexpr YuvCoefficients s_bt601 = MakeCoefficients(0.299, 0.114);
+    static constexpr YuvCoefficients s_bt709 = MakeCoefficients(0.2126, 0.0722);
+
+    // Offsets of the limited range, with the rounding terms. Chroma is computed from
+    // the sums of 4 pixels, which adds 2 fractional bits.
+    static constexpr int s_lumaBias = (16 << 14) + (1 << 13);
+    static constexpr int s_chromaBias = (128 << 16) + (1 << 15);
+
+    static BYTE LumaScalar(const int16_t* coefficients, const BYTE* pixel)
+    {
+        return (BYTE)((coefficients[0] * pixel[0] + coefficients[1] * pixel[1] + coefficients[2] * pixel[2] + s_lumaBias) >> 14);
+    }
+
+    static BYTE ChromaScalar(const int16_t* coefficients, const int* sums)
+    {
+        return (BYTE)((coefficients[0] * sums[0] + coefficients[1] * sums[1] + coefficients[2] * sums[2] + s_chromaBias) >> 16);
+    }
+
+#ifdef VGC_SSE2
+    /*
+     * Returns the weighted sums of the first 3 channels of each of 4 pixels, given
+     * as 16 bit values in two vectors of two pixels each.
+     */
+    static __m128i WeightedSums(__m128i low, __m128i high, __m128i coefficients)
+    {
+        __m128 productsLow = _mm_castsi128_ps(_mm_madd_epi16(low, coefficients));
+        __m128 productsHigh = _mm_castsi128_ps(_mm_madd_epi16(high, coefficients));
+
+        // The products of each pixel are in two adjacent lanes
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(productsLow, productsHigh, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(productsLow, productsHigh, _MM_SHUFFLE(3, 1, 3, 1)));
+        return _mm_add_epi32(even, odd);
+    }
+
+    /*
+     * Converts 16 pixels to luma.
+     */
+    static __m128i Luma16(const BYTE* pixels, __m128i coefficients)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i bias = _mm_set1_epi32(s_lumaBias);
+        __m128i luma[4];
+
+        for (int k = 0; k < 4; k++)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + 16 * k));
+            __m128i sums = WeightedSums(_mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero), coefficients);
+            luma[k] = _mm_srai_epi32(_mm_add_epi32(sums, bias), 14);
+        }
+
+        return _mm_packus_epi16(_mm_packs_epi32(luma[0], luma[1]), _mm_packs_epi32(luma[2], luma[3]));
+    }
+
+    /*
+     * Converts 8 blocks of 2x2 pixels, given as their channel sums in four vectors of
+     * two blocks each, to chroma. The 8 bytes are in the low half of the result.
+     */
+    static __m128i Chroma8(const __m128i* blocks, __m128i coefficients)
+    {
+        const __m128i bias = _mm_set1_epi32(s_chromaBias);
+
+        __m128i low = _mm_srai_epi32(_mm_add_epi32(WeightedSums(blocks[0], blocks[1], coefficients), bias), 16);
+        __m128i high = _mm_srai_epi32(_mm_add_epi32(WeightedSums(blocks[2], blocks[3], coefficients), bias), 16);
+
+        __m128i chroma = _mm_packs_epi32(low, high);
+        return _mm_packus_epi16(chroma, chroma);
+    }
+
+    static __m128i LoadCoefficients(const int16_t* coefficients)
+    {
+        return _mm_setr_epi16(coefficients[0], coefficients[1], coefficients[2], 0, coefficients[0], coefficients[1], coefficients[2], 0);
+    }
+#endif
+
+    /*
+     * Converts two rows of pixels to two rows of luma and one row of each chroma
+     * component. On an odd last row, both rows are the same, and lumaBelow is null.
+     * Interleaved chroma samples are two bytes apart.
+     */
+    template<bool interleaved>
+    static void ConvertRowPair(const YuvCoefficients& coefficients, const BYTE* row, const BYTE* rowBelow, UINT width, BYTE* luma, BYTE* lumaBelow, BYTE* u, BYTE* v)
+    {
+        constexpr UINT chromaStep = interleaved ? 2 : 1;
+        UINT j = 0;
+
+#ifdef VGC_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i yCoefficients = LoadCoefficients(coefficients.y);
+        const __m128i uCoefficients = LoadCoefficients(coefficients.u);
+        const __m128i vCoefficients = LoadCoefficients(coefficients.v);
+
+        for (; j + 16 <= width; j += 16)
+        {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(luma + j), Luma16(row + 4 * j, yCoefficients));
+            if (lumaBelow)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(lumaBelow + j), Luma16(rowBelow + 4 * j, yCoefficients));
+            }
+
+            // Sums of the channels of each 2x2 block
+            __m128i blocks[4];
+            for (int k = 0; k < 4; k++)
+            {
+                __m128i above = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + 4 * j + 16 * k));
+                __m128i below = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rowBelow + 4 * j + 16 * k));
+                __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(above, zero), _mm_unpacklo_epi8(below, zero));
+                __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(above, zero), _mm_unpackhi_epi8(below, zero));
+                blocks[k] = _mm_add_epi16(_mm_unpacklo_epi64(low, high), _mm_unpackhi_epi64(low, high));
+            }
+
+            __m128i uBytes = Chroma8(blocks, uCoefficients);
+            __m128i vBytes = Chroma8(blocks, vCoefficients);
+
+            if constexpr (interleaved)
+            {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(u + j), _mm_unpacklo_epi8(uBytes, vBytes));
+            }
+            else
+            {
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(u + j / 2), uBytes);
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(v + j / 2), vBytes);
+            }
+        }
+#endif
+
+        for (; j < width; j += 2)
+        {
+            // The last column of an odd width is its own neighbour
+            const UINT right = j + 1 < width ? 4 : 0;
+
+            luma[j] = LumaScalar(coefficients.y, row + 4 * j);
+            if (right)
+            {
+                luma[j + 1] = LumaScalar(coefficients.y, row + 4 * j + 4);
+            }
+
+            if (lumaBelow)
+            {
+                lumaBelow[j] = LumaScalar(coefficients.y, rowBelow + 4 * j);
+                if (right)
+                {
+                    lumaBelow[j + 1] = LumaScalar(coefficients.y, rowBelow + 4 * j + 4);
+                }
+            }
+
+            int sums[3];
+            for (UINT c = 0; c < 3; c++)
+            {
+                sums[c] = row[4 * j + c] + row[4 * j + right + c] + rowBelow[4 * j + c] + rowBelow[4 * j + right + c];
+            }
+
+            u[j / 2 * chromaStep] = ChromaScalar(coefficients.u, sums);
+            v[j / 2 * chromaStep] = ChromaScalar(coefficients.v, sums);
+        }
+    }
+
+    template<bool interleaved>
+    static void ConvertToYuv420(ImageView img, YuvMatrix matrix, BYTE* y, size_t yPitch, BYTE* u, size_t uPitch, BYTE* v, size_t vPitch)
+    {
+        const YuvCoefficients& coefficients = matrix == YuvMatrix::Bt709 ? s_bt709 : s_bt601;
+        const UINT chromaHeight = (img.height + 1) / 2;
+
+        ParallelForBands(chromaHeight, [&](size_t begin, size_t end)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                const bool hasRowBelow = 2 * i + 1 < img.height;
+
+                ConvertRowPair<interleaved>(
+                    coefficients,
+                    img[2 * i],
+                    hasRowBelow ? img[2 * i + 1] : img[2 * i],
+                    img.width,
+                    y + 2 * i * yPitch,
+                    hasRowBelow ? y + (2 * i + 1) * yPitch : nullptr,
+                    u + i * uPitch,
+                    v + i * vPitch);
+            }
+        }, 8);
+    }
+
+    void ConvertToI420(ImageView img, YuvMatrix matrix, BYTE* y, size_t yPitch, BYTE* u, size_t uPitch, BYTE* v, size_t vPitch)
+    {
+        ConvertToYuv420<false>(img, matrix, y, yPitch, u, uPitch, v, vPitch);
+    }
+
+    void ConvertToNv12(ImageView img, YuvMatrix matrix, BYTE* y, size_t yPitch, BYTE* uv, size_t uvPitch)
+    {
+        ConvertToYuv420<true>(img, matrix, y, yPitch, uv, uvPitch, uv + 1, uvPitch);
+    }
+}
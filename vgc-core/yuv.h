@@ -0,0 +1,35 @@
+#pragma once
+
+#include "pch.h"
+#include "image-data.h"
+
+namespace vgc
+{
+    /*
+     * The RGB to Y'CbCr matrices of the standard definition (BT.601) and high definition
+     * (BT.709) video standards. Video encoders assume BT.601 unless told otherwise.
+     */
+    enum class YuvMatrix
+    {
+        Bt601,
+        Bt709,
+    };
+
+    /*
+     * Converts BGRA pixels to 8-bit Y'CbCr 4:2:0 in the limited range most video encoders
+     * expect: luma between 16 and 235, chroma between 16 and 240. Each chroma sample is
+     * converted from the mean of a 2x2 block of pixels; on odd sizes, the blocks of the
+     * last column or row repeat it. Alpha is ignored.
+     *
+     * The planes are provided by the caller, along with their pitches in bytes. The Y
+     * plane has img.width by img.height samples, and the chroma planes have
+     * (img.width + 1) / 2 by (img.height + 1) / 2. Rows are converted in parallel.
+     */
+    void ConvertToI420(ImageView img, YuvMatrix matrix, BYTE* y, size_t yPitch, BYTE* u, size_t uPitch, BYTE* v, size_t vPitch);
+
+    /*
+     * Same as ConvertToI420, but the chroma samples are interleaved in a single plane,
+     * U first, as in the NV12 format. Each of its rows holds (img.width + 1) / 2 pairs.
+     */
+    void ConvertToNv12(ImageView img, YuvMatrix matrix, BYTE* y, size_t yPitch, BYTE* uv, size_t uvPitch);
+}